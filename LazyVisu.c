@@ -1,6 +1,11 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -8,14 +13,23 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/un.h>
+#include <poll.h>
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
 
 #include <gtk/gtk.h>
+#ifdef HAVE_COGL_PIXEL_BUFFER_NEW_FOR_SIZE
+# define COGL_ENABLE_EXPERIMENTAL_API
+#endif
 #include <clutter/clutter.h>
 #include <clutter-gtk/clutter-gtk.h>
 
 /**/
 #define __LONG_TYPE_64
 #include "lazy_passthrough_internal.h"
+#include "lazy-decode.h"
 
 /**/
 /* #define HAVE_UI_DEBUG */
@@ -46,9 +60,10 @@
                        G_LOG_LEVEL_WARN,        \
                        args);                   \
         } while (0)
+/* Not fatal: every caller recovers, a bad request only fails itself. */
 #define SERVER_ERROR(args...) do {              \
                 g_log (G_LOG_DOMAIN,            \
-                       G_LOG_LEVEL_ERROR,       \
+                       G_LOG_LEVEL_CRITICAL,    \
                        args);                   \
         } while (0)
 
@@ -59,876 +74,5566 @@
 
 /**/
 gchar *path_to_buffers = DEFAULT_BUFFER_PATH;
+gint   atlas_threshold = 0;
+gint   pbo_ring_size = 0;
+gboolean dedup_uploads = FALSE;
+gboolean tile_diff = FALSE;
+gint   frame_budget = 0;
+gchar *state_file = NULL;
+gchar **screen_modes = NULL;
+gchar *stream_destination = NULL;
+gchar *prewarm_spec = NULL;
+gint   client_kbytes = 0;
+gint   client_layers = 0;
+gint   client_in_flight = 0;
+gint   client_quantum = 16;
+
+/* Microseconds from launch, for the startup figures. */
+GTimer *startup_timer = NULL;
+gulong  startup_listen_us = 0;
+gulong  startup_frame_us = 0;
 
 /**/
-typedef struct
+#define HASH_PRIME1 G_GUINT64_CONSTANT (0x9e3779b185ebca87)
+#define HASH_PRIME2 G_GUINT64_CONSTANT (0xc2b2ae3d27d4eb4f)
+#define HASH_PRIME3 G_GUINT64_CONSTANT (0x165667b19e3779f9)
+#define HASH_PRIME4 G_GUINT64_CONSTANT (0x85ebca77c2b2ae63)
+#define HASH_PRIME5 G_GUINT64_CONSTANT (0x27d4eb2f165667c5)
+
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline guint64
+emu_hash_round (guint64 acc, guint64 input)
 {
-        gchar *filename;
-        gpointer ptr;
-        gint fd;
+        acc += input * HASH_PRIME2;
+        acc = HASH_ROTL (acc, 31);
 
-        guint id;
-        gint  width;
-        gint  height;
-        gint  bpp;
-} emu_buffer_t;
+        return acc * HASH_PRIME1;
+}
 
-guint emu_buffer_get_size (emu_buffer_t *buffer);
+static inline guint64
+emu_hash_read64 (const guint8 *p)
+{
+        guint64 v;
 
-void
-emu_buffer_free (emu_buffer_t *buffer)
+        memcpy (&v, p, sizeof (v));
+
+        return GUINT64_FROM_LE (v);
+}
+
+/*
+  XXH64. The four independent lanes keep the multipliers busy, which
+  is what makes it run at memory speed.
+*/
+guint64
+emu_hash (gconstpointer data, gsize len, guint64 seed)
 {
-        g_return_if_fail (buffer != NULL);
+        const guint8 *p = data, *end = p + len;
+        guint64 h;
 
-        if (buffer->ptr != NULL && buffer->ptr != MAP_FAILED)
-                munmap (buffer->ptr, emu_buffer_get_size (buffer));
+        if (len >= 32)
+        {
+                guint64 v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+                guint64 v2 = seed + HASH_PRIME2;
+                guint64 v3 = seed;
+                guint64 v4 = seed - HASH_PRIME1;
 
-        if (buffer->fd >= 0)
-                close (buffer->fd);
+                do
+                {
+                        v1 = emu_hash_round (v1, emu_hash_read64 (p));
+                        v2 = emu_hash_round (v2, emu_hash_read64 (p + 8));
+                        v3 = emu_hash_round (v3, emu_hash_read64 (p + 16));
+                        v4 = emu_hash_round (v4, emu_hash_read64 (p + 24));
+                        p += 32;
+                } while (p + 32 <= end);
+
+                h = HASH_ROTL (v1, 1) + HASH_ROTL (v2, 7) +
+                        HASH_ROTL (v3, 12) + HASH_ROTL (v4, 18);
+                h = (h ^ emu_hash_round (0, v1)) * HASH_PRIME1 + HASH_PRIME4;
+                h = (h ^ emu_hash_round (0, v2)) * HASH_PRIME1 + HASH_PRIME4;
+                h = (h ^ emu_hash_round (0, v3)) * HASH_PRIME1 + HASH_PRIME4;
+                h = (h ^ emu_hash_round (0, v4)) * HASH_PRIME1 + HASH_PRIME4;
+        }
+        else
+                h = seed + HASH_PRIME5;
 
-        if (buffer->filename)
-                g_free (buffer->filename);
+        h += len;
 
-        g_free (buffer);
+        for (; p + 8 <= end; p += 8)
+        {
+                h ^= emu_hash_round (0, emu_hash_read64 (p));
+                h = HASH_ROTL (h, 27) * HASH_PRIME1 + HASH_PRIME4;
+        }
+
+        if (p + 4 <= end)
+        {
+                guint32 v;
+
+                memcpy (&v, p, sizeof (v));
+                h ^= (guint64) GUINT32_FROM_LE (v) * HASH_PRIME1;
+                h = HASH_ROTL (h, 23) * HASH_PRIME2 + HASH_PRIME3;
+                p += 4;
+        }
+
+        for (; p < end; p++)
+        {
+                h ^= *p * HASH_PRIME5;
+                h = HASH_ROTL (h, 11) * HASH_PRIME1;
+        }
+
+        h ^= h >> 33;
+        h *= HASH_PRIME2;
+        h ^= h >> 29;
+        h *= HASH_PRIME3;
+        h ^= h >> 32;
+
+        return h;
 }
 
-emu_buffer_t *
-emu_buffer_new (guint id, gint width, gint height, gint bpp)
+/**/
+#define HEAP_MIN_ORDER (12)     /* 4KiB, keeps buffers page aligned */
+#define HEAP_DEFAULT_ORDER (26) /* 64MiB */
+#define HEAP_MAX_ORDER (31)
+
+/* Buddy allocator over one shared file mapping. */
+typedef struct
 {
-        emu_buffer_t *buffer;
+        gchar  *filename;
+        guint8 *ptr;
+        gint    fd;
 
-        g_return_val_if_fail (width >= 0 && height >= 0 && bpp >= 0, NULL);
+        guint id;
+        guint order;
+        GList *free[HEAP_MAX_ORDER + 1]; /* free block offsets by order */
+        guint nb_blocks;
+} emu_heap_t;
 
-        buffer = g_new0 (emu_buffer_t, 1);
+void
+emu_heap_free (emu_heap_t *heap)
+{
+        guint i;
 
-        g_return_val_if_fail (buffer != NULL, NULL);
+        g_return_if_fail (heap != NULL);
 
-        buffer->filename = g_strdup_printf ("%s/%x", path_to_buffers, id);
-        buffer->id = id;
-        buffer->width = width;
-        buffer->height = height;
-        buffer->bpp = bpp;
+        if (heap->ptr != NULL && (gpointer) heap->ptr != MAP_FAILED)
+                munmap (heap->ptr, (gsize) 1 << heap->order);
+
+        if (heap->fd >= 0)
+                close (heap->fd);
 
-        buffer->fd = open (buffer->filename, O_CREAT | O_RDWR,
-                           S_IRUSR | S_IWUSR | S_IRGRP |
-                           S_IWGRP | S_IROTH | S_IWOTH);
-        if (buffer->fd < 0)
+        if (heap->filename)
         {
-                SERVER_ERROR ("Cannot open %s : %s",
-                              buffer->filename, strerror (errno));
-                goto error;
+                unlink (heap->filename);
+                g_free (heap->filename);
         }
 
-        if (lseek (buffer->fd,
-                   buffer->width * buffer->height * buffer->bpp,
-                   SEEK_SET) == -1)
+        for (i = 0; i <= HEAP_MAX_ORDER; i++)
+                g_list_free (heap->free[i]);
+
+        g_free (heap);
+}
+
+/* Creates the heap file, or maps back the one left by a previous run. */
+static emu_heap_t *
+emu_heap_open (guint id, guint order, gboolean attach)
+{
+        emu_heap_t *heap;
+        struct stat st;
+
+        g_return_val_if_fail (order >= HEAP_MIN_ORDER &&
+                              order <= HEAP_MAX_ORDER, NULL);
+
+        heap = g_new0 (emu_heap_t, 1);
+
+        g_return_val_if_fail (heap != NULL, NULL);
+
+        heap->filename = g_strdup_printf ("%s/h%x", path_to_buffers, id);
+        heap->id = id;
+        heap->order = order;
+
+        if (attach)
         {
-                SERVER_ERROR ("Cannot lseek in %s : %s",
-                              buffer->filename, strerror (errno));
-                goto error;
+                /* Gone files are expected, they are just not restored. */
+                heap->fd = open (heap->filename, O_RDWR);
+                if (heap->fd < 0 ||
+                    fstat (heap->fd, &st) < 0 ||
+                    st.st_size < ((off_t) 1 << heap->order))
+                {
+                        SERVER_DEBUG ("Cannot attach %s", heap->filename);
+                        goto error;
+                }
         }
-
-        /* Unsure we can mmap the file... */
-        if (write (buffer->fd, &buffer, 4) != 4)
+        else
         {
-                SERVER_ERROR ("Cannot write in %s : %s",
-                              buffer->filename, strerror (errno));
-                goto error;
+                heap->fd = open (heap->filename, O_CREAT | O_TRUNC | O_RDWR,
+                                 S_IRUSR | S_IWUSR | S_IRGRP |
+                                 S_IWGRP | S_IROTH | S_IWOTH);
+                if (heap->fd < 0)
+                {
+                        SERVER_ERROR ("Cannot open %s : %s",
+                                      heap->filename, strerror (errno));
+                        goto error;
+                }
+
+                if (ftruncate (heap->fd, (off_t) 1 << heap->order) < 0)
+                {
+                        SERVER_ERROR ("Cannot resize %s : %s",
+                                      heap->filename, strerror (errno));
+                        goto error;
+                }
         }
 
-        buffer->ptr = mmap (NULL,
-                            width * height * bpp,
-                            PROT_READ, MAP_SHARED,
-                            buffer->fd, 0);
-        if (buffer->ptr == NULL ||
-            buffer->ptr == MAP_FAILED)
+        heap->ptr = mmap (NULL,
+                          (gsize) 1 << heap->order,
+                          PROT_READ, MAP_SHARED,
+                          heap->fd, 0);
+        if (heap->ptr == NULL ||
+            (gpointer) heap->ptr == MAP_FAILED)
         {
                 SERVER_ERROR ("Cannot mmap %s : %s",
-                              buffer->filename, strerror (errno));
+                              heap->filename, strerror (errno));
                 goto error;
         }
 
-        return buffer;
+        heap->free[heap->order] = g_list_prepend (NULL, GUINT_TO_POINTER (0));
+
+        return heap;
 
 error:
-        emu_buffer_free (buffer);
+        emu_heap_free (heap);
 
         return NULL;
 }
 
-guint
-emu_buffer_get_size (emu_buffer_t *buffer)
+/* Backs the whole heap with memory now rather than on first touch. */
+static void
+emu_heap_prefault (emu_heap_t *heap)
 {
-        g_return_val_if_fail (buffer != NULL, 0);
+        gsize size = (gsize) 1 << heap->order, offset, page;
+
+        if (posix_fallocate (heap->fd, 0, size) != 0)
+                SERVER_DEBUG ("Cannot preallocate %s", heap->filename);
 
-        return buffer->width * buffer->height * buffer->bpp;
+        /* The heap is new and zeroed, writing faults the pages in for good. */
+        page = sysconf (_SC_PAGESIZE);
+        for (offset = 0; offset < size; offset += page)
+                heap->ptr[offset] = 0;
 }
 
-gint
-emu_buffer_compare (emu_buffer_t *b1, emu_buffer_t *b2)
+emu_heap_t *
+emu_heap_new (guint id, guint order)
 {
-        return b2->id - b1->id;
+        return emu_heap_open (id, order, FALSE);
 }
 
-/**/
-typedef struct
+emu_heap_t *
+emu_heap_attach (guint id, guint order)
 {
-        GList *buffers;
-        guint  buffer_index;
-        guint  nb_buffers;
-        guint  nb_max_buffers;
-} emu_buffer_pool_t;
+        return emu_heap_open (id, order, TRUE);
+}
 
-void
-emu_buffer_pool_free (emu_buffer_pool_t *pool)
+/* Order of the smallest block holding size bytes. */
+guint
+emu_heap_get_order (gsize size)
 {
-        g_return_if_fail (pool != NULL);
+        guint order = HEAP_MIN_ORDER;
 
-        g_list_foreach (pool->buffers, (GFunc) emu_buffer_free, NULL);
-        g_list_free (pool->buffers);
+        while (order <= HEAP_MAX_ORDER && ((gsize) 1 << order) < size)
+                order++;
 
-        g_free (pool);
+        return order;
 }
 
-emu_buffer_pool_t *
-emu_buffer_pool_new (guint size)
+gboolean
+emu_heap_alloc (emu_heap_t *heap, guint order, guint *offset)
 {
-        emu_buffer_pool_t *pool;
-
-        g_return_val_if_fail (size > 0, NULL);
-
-        pool = g_new0 (emu_buffer_pool_t, 1);
-
-        g_return_val_if_fail (pool != NULL, NULL);
+        guint o;
 
-        pool->nb_max_buffers = size;
+        g_return_val_if_fail (heap != NULL, FALSE);
+        g_return_val_if_fail (offset != NULL, FALSE);
 
-        return pool;
-}
+        if (order > heap->order)
+                return FALSE;
 
-emu_buffer_t *
-emu_buffer_pool_find_buffer (emu_buffer_pool_t *pool, guint id)
-{
-        emu_buffer_t  buffer;
-        GList        *item;
+        for (o = order; o <= heap->order && heap->free[o] == NULL; o++)
+                ;
 
-        g_return_val_if_fail (pool != NULL, NULL);
+        if (o > heap->order)
+                return FALSE;
 
-        buffer.id = id;
-        item = g_list_find_custom (pool->buffers, &buffer,
-                                   (GCompareFunc) emu_buffer_compare);
+        *offset = GPOINTER_TO_UINT (heap->free[o]->data);
+        heap->free[o] = g_list_delete_link (heap->free[o], heap->free[o]);
 
-        if (item)
+        /* Split down, keeping the upper halves free. */
+        while (o > order)
         {
-                if (item != pool->buffers)
-                {
-                        /* LRU :) */
-                        pool->buffers = g_list_remove_link (pool->buffers, item);
-
-                        pool->buffers->prev = item;
-                        item->next = pool->buffers;
-                        pool->buffers = item;
-                }
-
-                return (emu_buffer_t *) item->data;
+                o--;
+                heap->free[o] = g_list_prepend (heap->free[o],
+                                                GUINT_TO_POINTER (*offset + (1u << o)));
         }
 
-        return NULL;
+        heap->nb_blocks++;
+
+        return TRUE;
 }
 
-emu_buffer_t *
-emu_buffer_pool_add_buffer (emu_buffer_pool_t *pool,
-                            gint width, gint height,
-                            gint bpp)
+void
+emu_heap_release (emu_heap_t *heap, guint offset, guint order)
 {
-        emu_buffer_t *buffer;
-
-        g_return_val_if_fail (pool != NULL, NULL);
-
-        buffer = emu_buffer_new (pool->buffer_index++, width, height, bpp);
-
-        g_return_val_if_fail (buffer != NULL, NULL);
+        g_return_if_fail (heap != NULL);
 
-        if (pool->nb_buffers >= pool->nb_max_buffers)
+        /* Coalesce with free buddies. */
+        while (order < heap->order)
         {
-                GList *last_item;
-                emu_buffer_t *last_buffer;
+                GList *buddy;
 
-                last_item = g_list_last (pool->buffers);
-                last_buffer = (emu_buffer_t *) last_item->data;
+                buddy = g_list_find (heap->free[order],
+                                     GUINT_TO_POINTER (offset ^ (1u << order)));
+                if (buddy == NULL)
+                        break;
 
-                pool->buffers = g_list_delete_link (pool->buffers, last_item);
-                emu_buffer_free (last_buffer);
+                heap->free[order] = g_list_delete_link (heap->free[order], buddy);
+                offset &= ~(1u << order);
+                order++;
         }
-        else
-                pool->nb_buffers++;
-
-        pool->buffers = g_list_insert_before (pool->buffers,
-                                              pool->buffers,
-                                              buffer);
 
-        return buffer;
+        heap->free[order] = g_list_prepend (heap->free[order],
+                                            GUINT_TO_POINTER (offset));
+        heap->nb_blocks--;
 }
 
-void
-emu_buffer_pool_del_buffer (emu_buffer_pool_t *pool, guint id)
+/* Takes the block at offset out of the free lists, as alloc would have. */
+gboolean
+emu_heap_reserve (emu_heap_t *heap, guint offset, guint order)
 {
-        emu_buffer_t  dbuffer;
-        GList        *item;
+        guint o;
 
-        g_return_if_fail (pool != NULL);
+        g_return_val_if_fail (heap != NULL, FALSE);
 
-        dbuffer.id = id;
-        item = g_list_find_custom (pool->buffers, &dbuffer,
-                                   (GCompareFunc) emu_buffer_compare);
+        if (order < HEAP_MIN_ORDER || order > heap->order ||
+            (offset & ((1u << order) - 1)) != 0 ||
+            offset > (guint) (((gsize) 1 << heap->order) - (1u << order)))
+                return FALSE;
 
-        if (item)
+        for (o = order; o <= heap->order; o++)
         {
-                emu_buffer_t *buffer;
+                guint base = offset & ~((1u << o) - 1);
+                GList *block;
 
-                buffer = (emu_buffer_t *) item->data;
-                pool->buffers = g_list_delete_link (pool->buffers, item);
-                emu_buffer_free (buffer);
+                block = g_list_find (heap->free[o], GUINT_TO_POINTER (base));
+                if (block == NULL)
+                        continue;
 
-                pool->nb_buffers--;
+                heap->free[o] = g_list_delete_link (heap->free[o], block);
+
+                /* Split down, freeing the halves not holding offset. */
+                while (o > order)
+                {
+                        o--;
+                        heap->free[o] = g_list_prepend (heap->free[o],
+                                                        GUINT_TO_POINTER ((offset & ~((1u << o) - 1)) ^
+                                                                          (1u << o)));
+                }
+
+                heap->nb_blocks++;
+
+                return TRUE;
         }
+
+        return FALSE;
 }
 
 /**/
+#define TILE_SIZE (64)
+
+/* Plane of a buffer, width is in bytes of pixels per line */
 typedef struct
 {
-        gint id;
+        guint offset;
+        gint  width;
+        gint  height;
+        gint  pitch;
+} emu_plane_t;
 
-        emu_buffer_t *buffer;
+typedef struct
+{
+        gchar *filename;
+        gpointer ptr;
+        gint fd;
 
-        gint width, height;
+        guint id;
+        gint  width;
+        gint  height;
+        gint  bpp;
+        gint  pitch;
 
-        GdkRectangle src;
-        GdkRectangle dst;
+        /* Set when sub-allocated from a heap instead of its own file */
+        emu_heap_t *heap;
+        guint       heap_offset;
+        guint       heap_order;
 
-        ClutterActor *actor;
-} emu_layer_t;
+        /* Layout of the pixels, Y, U and V planes for video */
+        lazy_format_t format;
+        emu_plane_t   planes[LAZY_MAX_PLANES];
+        gint          nb_planes;
 
-void
-emu_layer_free (emu_layer_t *layer)
+        /* Shadow checksums of TILE_SIZE tiles, taken at flip time */
+        guint64 *tile_hashes;
+        gint     tiles_x, tiles_y;
+
+        /* Connection that added it, 0 when restored */
+        guint owner;
+} emu_buffer_t;
+
+guint emu_buffer_get_size (emu_buffer_t *buffer);
+
+/*
+  Lays out the planes of a picture in format whose first plane lines
+  are pitch bytes apart. Returns the bytes spanned, 0 for an unknown
+  format.
+*/
+static gsize
+emu_format_get_planes (lazy_format_t format,
+                       gint width, gint height, gint bpp, gint pitch,
+                       emu_plane_t *planes, gint *nb_planes)
 {
-        if (!layer)
-                return;
+        gint chroma_pitch, chroma_height;
+        gsize luma_size, chroma_size;
 
-        if (layer->actor)
+        planes[0].offset = 0;
+        planes[0].width = width * bpp;
+        planes[0].height = height;
+        planes[0].pitch = pitch;
+        luma_size = (gsize) pitch * height;
+
+        switch (format)
         {
-                layer->actor = NULL;
-        }
+        case LAZY_FORMAT_PACKED:
+                *nb_planes = 1;
+                return luma_size;
+
+        case LAZY_FORMAT_I420:
+        case LAZY_FORMAT_YV12:
+                chroma_pitch = (pitch + 1) / 2;
+                chroma_height = (height + 1) / 2;
+                chroma_size = (gsize) chroma_pitch * chroma_height;
+
+                planes[1].width = planes[2].width = (width + 1) / 2;
+                planes[1].height = planes[2].height = chroma_height;
+                planes[1].pitch = planes[2].pitch = chroma_pitch;
+
+                planes[1].offset = luma_size;
+                planes[2].offset = luma_size + chroma_size;
+                if (format == LAZY_FORMAT_YV12)
+                {
+                        planes[2].offset = luma_size;
+                        planes[1].offset = luma_size + chroma_size;
+                }
 
-        g_free (layer);
+                *nb_planes = 3;
+                return luma_size + 2 * chroma_size;
+
+        default:
+                *nb_planes = 0;
+                return 0;
+        }
 }
 
-emu_layer_t *
-emu_layer_new (gint id, gint width, gint height)
+void
+emu_buffer_free (emu_buffer_t *buffer)
 {
-        emu_layer_t *layer;
+        g_return_if_fail (buffer != NULL);
 
-        layer = g_new0 (emu_layer_t, 1);
+        if (buffer->heap)
+                emu_heap_release (buffer->heap,
+                                  buffer->heap_offset, buffer->heap_order);
+        else if (buffer->ptr != NULL && buffer->ptr != MAP_FAILED)
+                munmap (buffer->ptr, emu_buffer_get_size (buffer));
 
-        g_return_val_if_fail (layer != NULL, NULL);
+        if (buffer->fd >= 0)
+                close (buffer->fd);
 
-        layer->id = id;
-        layer->width = width;
-        layer->height = height;
-        /* layer->size = 4 * width * height; */
+        if (buffer->filename)
+                g_free (buffer->filename);
 
-        /* layer->fd = -1; */
+        g_free (buffer->tile_hashes);
+        g_free (buffer);
+}
 
-        /* layer->src.x = sx; */
-        /* layer->src.y = sy; */
-        /* layer->src.width = sw; */
-        /* layer->src.height = sh; */
+/* Creates the buffer file, or maps back the one left by a previous run. */
+static emu_buffer_t *
+emu_buffer_open (guint id, gint width, gint height, gint bpp,
+                 gboolean attach)
+{
+        emu_buffer_t *buffer;
+        struct stat st;
+        gsize size;
 
-        /* layer->dst.x = dx; */
-        /* layer->dst.y = dy; */
-        /* layer->dst.width = dw; */
-        /* layer->dst.height = dh; */
+        g_return_val_if_fail (width > 0 && height > 0 && bpp > 0, NULL);
 
-        layer->actor = clutter_texture_new ();
-        clutter_actor_set_opacity (layer->actor, 0xff);
-        clutter_actor_show (layer->actor);
+        size = (gsize) width * height * bpp;
+        g_return_val_if_fail (size <= G_MAXINT, NULL);
 
-        return layer;
+        buffer = g_new0 (emu_buffer_t, 1);
+
+        g_return_val_if_fail (buffer != NULL, NULL);
+
+        buffer->filename = g_strdup_printf ("%s/%x", path_to_buffers, id);
+        buffer->id = id;
+        buffer->width = width;
+        buffer->height = height;
+        buffer->bpp = bpp;
+        buffer->pitch = width * bpp;
+        buffer->format = LAZY_FORMAT_PACKED;
+        emu_format_get_planes (buffer->format, width, height, bpp,
+                               buffer->pitch, buffer->planes,
+                               &buffer->nb_planes);
+
+        if (attach)
+        {
+                /* Gone files are expected, they are just not restored. */
+                buffer->fd = open (buffer->filename, O_RDWR);
+                if (buffer->fd < 0 ||
+                    fstat (buffer->fd, &st) < 0 ||
+                    st.st_size < (off_t) size)
+                {
+                        SERVER_DEBUG ("Cannot attach %s", buffer->filename);
+                        goto error;
+                }
+        }
+        else
+        {
+                buffer->fd = open (buffer->filename, O_CREAT | O_RDWR,
+                                   S_IRUSR | S_IWUSR | S_IRGRP |
+                                   S_IWGRP | S_IROTH | S_IWOTH);
+                if (buffer->fd < 0)
+                {
+                        SERVER_ERROR ("Cannot open %s : %s",
+                                      buffer->filename, strerror (errno));
+                        goto error;
+                }
+
+                if (lseek (buffer->fd, size, SEEK_SET) == -1)
+                {
+                        SERVER_ERROR ("Cannot lseek in %s : %s",
+                                      buffer->filename, strerror (errno));
+                        goto error;
+                }
+
+                /* Unsure we can mmap the file... */
+                if (write (buffer->fd, &buffer, 4) != 4)
+                {
+                        SERVER_ERROR ("Cannot write in %s : %s",
+                                      buffer->filename, strerror (errno));
+                        goto error;
+                }
+        }
+
+        buffer->ptr = mmap (NULL, size,
+                            PROT_READ, MAP_SHARED,
+                            buffer->fd, 0);
+        if (buffer->ptr == NULL ||
+            buffer->ptr == MAP_FAILED)
+        {
+                SERVER_ERROR ("Cannot mmap %s : %s",
+                              buffer->filename, strerror (errno));
+                goto error;
+        }
+
+        return buffer;
+
+error:
+        emu_buffer_free (buffer);
 
         return NULL;
 }
 
-void
-emu_layer_set_viewport_input (emu_layer_t *layer,
-                              gint x, gint y,
-                              gint width, gint height)
+emu_buffer_t *
+emu_buffer_new (guint id, gint width, gint height, gint bpp)
 {
-        g_return_if_fail (layer != NULL);
+        return emu_buffer_open (id, width, height, bpp, FALSE);
+}
 
-        layer->src.x = x;
-        layer->src.y = y;
-        layer->src.width = width;
-        layer->src.height = height;
+emu_buffer_t *
+emu_buffer_attach (guint id, gint width, gint height, gint bpp)
+{
+        return emu_buffer_open (id, width, height, bpp, TRUE);
+}
 
-        clutter_actor_set_clip (layer->actor,
-                                layer->src.x, layer->src.y,
-                                layer->src.width, layer->src.height);
+emu_buffer_t *
+emu_buffer_new_from_heap (guint id, emu_heap_t *heap,
+                          guint offset, guint order,
+                          gint width, gint height, gint bpp, gint pitch,
+                          lazy_format_t format)
+{
+        emu_buffer_t *buffer;
+        gsize size;
+
+        g_return_val_if_fail (heap != NULL, NULL);
+        g_return_val_if_fail (width >= 0 && height >= 0 && bpp >= 0, NULL);
+        g_return_val_if_fail (pitch >= width * bpp, NULL);
+
+        buffer = g_new0 (emu_buffer_t, 1);
+
+        g_return_val_if_fail (buffer != NULL, NULL);
+
+        size = emu_format_get_planes (format, width, height, bpp, pitch,
+                                      buffer->planes, &buffer->nb_planes);
+        if (size == 0 || size > ((gsize) 1 << order))
+        {
+                g_free (buffer);
+                return NULL;
+        }
+        buffer->format = format;
+
+        buffer->filename = g_strdup (heap->filename);
+        buffer->ptr = heap->ptr + offset;
+        buffer->fd = -1;
+
+        buffer->id = id;
+        buffer->width = width;
+        buffer->height = height;
+        buffer->bpp = bpp;
+        buffer->pitch = pitch;
+
+        buffer->heap = heap;
+        buffer->heap_offset = offset;
+        buffer->heap_order = order;
+
+        return buffer;
 }
 
-void
-emu_layer_set_viewport_output (emu_layer_t *layer,
-                               gint x, gint y,
-                               gint width, gint height)
+guint
+emu_buffer_get_size (emu_buffer_t *buffer)
 {
-        g_return_if_fail (layer != NULL);
+        guint size = 0;
+        gint i;
 
-        layer->dst.x = x;
-        layer->dst.y = y;
-        layer->dst.width = width;
-        layer->dst.height = height;
+        g_return_val_if_fail (buffer != NULL, 0);
 
-        clutter_actor_set_position (layer->actor,
-                                    layer->dst.x,
-                                    layer->dst.y);
-        clutter_actor_set_size (layer->actor,
-                                layer->dst.width,
-                                layer->dst.height);
+        for (i = 0; i < buffer->nb_planes; i++)
+                size = MAX (size, buffer->planes[i].offset +
+                            buffer->planes[i].pitch * buffer->planes[i].height);
+
+        return size;
 }
 
-void
-emu_layer_set_opacity (emu_layer_t *layer, guint8 opacity)
+/* Hash of the pixels, padding at the end of rows left out. */
+guint64
+emu_buffer_hash (emu_buffer_t *buffer)
 {
-        g_return_if_fail (layer != NULL);
+        const guint8 *row;
+        guint64 hash;
+        gint i, y;
 
-        clutter_actor_set_opacity (layer->actor, opacity);
+        g_return_val_if_fail (buffer != NULL, 0);
+
+        /* Same bytes in another shape are another picture. */
+        hash = ((guint64) buffer->width << 32) | buffer->height;
+
+        for (i = 0; i < buffer->nb_planes; i++)
+        {
+                const emu_plane_t *plane = &buffer->planes[i];
+
+                row = (const guint8 *) buffer->ptr + plane->offset;
+                if (plane->width == plane->pitch)
+                {
+                        hash = emu_hash (row, (gsize) plane->pitch * plane->height,
+                                         hash);
+                        continue;
+                }
+
+                for (y = 0; y < plane->height; y++, row += plane->pitch)
+                        hash = emu_hash (row, plane->width, hash);
+        }
+
+        return hash;
 }
 
+/* Checksums every tile, rows are walked in memory order. */
 void
-emu_layer_set_buffer (emu_layer_t *layer, emu_buffer_t *buffer)
+emu_buffer_update_tiles (emu_buffer_t *buffer)
 {
-        /* gboolean  buffer_changed = FALSE; */
+        gint tx, ty, y;
 
-        g_return_if_fail (layer != NULL || buffer != NULL);
+        g_return_if_fail (buffer != NULL);
 
-        UI_DEBUG ("buffer in %s", buffer->filename);
+        if (buffer->tile_hashes == NULL)
+        {
+                buffer->tiles_x = (buffer->width + TILE_SIZE - 1) / TILE_SIZE;
+                buffer->tiles_y = (buffer->height + TILE_SIZE - 1) / TILE_SIZE;
+                buffer->tile_hashes = g_new (guint64,
+                                             buffer->tiles_x * buffer->tiles_y);
+        }
 
-        if (layer->buffer != buffer)
+        for (ty = 0; ty < buffer->tiles_y; ty++)
         {
-                UI_DEBUG ("changing buffer ptr in clutter");
-                clutter_texture_set_from_rgb_data (CLUTTER_TEXTURE (layer->actor),
-                                                   buffer->ptr,
-                                                   TRUE,
-                                                   layer->width,
-                                                   layer->height,
-                                                   4 * layer->width,
-                                                   4,
-                                                   CLUTTER_TEXTURE_RGB_FLAG_BGR,
-                                                   NULL);
+                guint64 *hashes = buffer->tile_hashes + ty * buffer->tiles_x;
+                gint height = MIN (TILE_SIZE, buffer->height - ty * TILE_SIZE);
+
+                for (tx = 0; tx < buffer->tiles_x; tx++)
+                        hashes[tx] = tx;
+
+                for (y = 0; y < height; y++)
+                {
+                        const guint8 *row = (const guint8 *) buffer->ptr +
+                                (ty * TILE_SIZE + y) * buffer->pitch;
+
+                        for (tx = 0; tx < buffer->tiles_x; tx++)
+                        {
+                                gint width = MIN (TILE_SIZE,
+                                                  buffer->width - tx * TILE_SIZE);
+
+                                hashes[tx] = emu_hash (row + tx * TILE_SIZE * buffer->bpp,
+                                                       width * buffer->bpp,
+                                                       hashes[tx]);
+                        }
+                }
         }
+}
 
-        clutter_actor_queue_redraw (layer->actor);
+gint
+emu_buffer_compare (emu_buffer_t *b1, emu_buffer_t *b2)
+{
+        return b2->id - b1->id;
 }
 
 /**/
 typedef struct
 {
-        emu_buffer_pool_t *buffer_pool;
-        GList             *layers;
-        ClutterStage      *stage;
-} emu_mixer_t;
+        GList *buffers;
+        guint  buffer_index;
+        guint  nb_buffers;
+        guint  nb_max_buffers;
 
-static void
-emu_mixer_free_layer (emu_layer_t *layer,
-                      emu_mixer_t *mixer)
-{
-        clutter_container_remove_actor (CLUTTER_CONTAINER (mixer->stage),
-                                        layer->actor);
-        layer->actor = NULL;
-        emu_layer_free (layer);
-}
+        GList *heaps;
+        guint  heap_index;
+        guint  nb_warm_heaps; /* kept even when empty */
+
+        /* Called before a buffer is freed */
+        GFunc    release_func;
+        gpointer release_data;
+} emu_buffer_pool_t;
 
 void
-emu_mixer_free (emu_mixer_t *mixer)
+emu_buffer_pool_free (emu_buffer_pool_t *pool)
 {
-        g_return_if_fail (mixer != NULL);
+        g_return_if_fail (pool != NULL);
 
-        g_list_foreach (mixer->layers,
-                        (GFunc) emu_mixer_free_layer,
-                        mixer);
-        g_list_free (mixer->layers);
+        g_list_foreach (pool->buffers, (GFunc) emu_buffer_free, NULL);
+        g_list_free (pool->buffers);
 
-        emu_buffer_pool_free (mixer->buffer_pool);
+        g_list_foreach (pool->heaps, (GFunc) emu_heap_free, NULL);
+        g_list_free (pool->heaps);
 
-        g_free (mixer);
+        g_free (pool);
 }
 
-emu_mixer_t *
-emu_mixer_new (ClutterStage *stage)
+emu_buffer_pool_t *
+emu_buffer_pool_new (guint size)
 {
-        emu_mixer_t *mixer;
+        emu_buffer_pool_t *pool;
 
-        g_return_val_if_fail (stage != NULL, NULL);
+        g_return_val_if_fail (size > 0, NULL);
 
-        mixer = g_new0 (emu_mixer_t, 1);
+        pool = g_new0 (emu_buffer_pool_t, 1);
 
-        g_return_val_if_fail (mixer != NULL, NULL);
+        g_return_val_if_fail (pool != NULL, NULL);
 
-        mixer->stage = stage;
+        pool->nb_max_buffers = size;
 
-        mixer->buffer_pool = emu_buffer_pool_new (10);
-        if (mixer->buffer_pool == NULL)
-                goto error;
+        return pool;
+}
 
-        return mixer;
+emu_buffer_t *
+emu_buffer_pool_find_buffer (emu_buffer_pool_t *pool, guint id)
+{
+        emu_buffer_t  buffer;
+        GList        *item;
 
-error:
-        emu_mixer_free (mixer);
+        g_return_val_if_fail (pool != NULL, NULL);
+
+        buffer.id = id;
+        item = g_list_find_custom (pool->buffers, &buffer,
+                                   (GCompareFunc) emu_buffer_compare);
+
+        if (item)
+        {
+                if (item != pool->buffers)
+                {
+                        /* LRU :) */
+                        pool->buffers = g_list_remove_link (pool->buffers, item);
+
+                        pool->buffers->prev = item;
+                        item->next = pool->buffers;
+                        pool->buffers = item;
+                }
+
+                return (emu_buffer_t *) item->data;
+        }
 
         return NULL;
 }
 
-static gint
-emu_mixer_compare_layer (emu_layer_t *layer1,
-                         emu_layer_t *layer2)
+/* Keeps one heap around to avoid mmap/munmap churn, drops other empty ones. */
+static void
+emu_buffer_pool_trim_heaps (emu_buffer_pool_t *pool)
 {
-        return layer2->id - layer1->id;
+        GList *e, *next;
+        guint i;
+
+        for (e = pool->heaps, i = 0; e != NULL; e = next, i++)
+        {
+                emu_heap_t *heap = e->data;
+
+                next = e->next;
+                if (heap->nb_blocks == 0 && i >= MAX (pool->nb_warm_heaps, 1))
+                {
+                        pool->heaps = g_list_delete_link (pool->heaps, e);
+                        emu_heap_free (heap);
+                }
+        }
 }
 
-/*
-  Returns: negative value if error, 0 if added for the first time, 1
-  if already added.
-*/
-int
-emu_mixer_add_layer (emu_mixer_t *mixer, emu_layer_t *layer)
+static void
+emu_buffer_pool_insert_buffer (emu_buffer_pool_t *pool,
+                               emu_buffer_t *buffer)
 {
-        GList *e;
-
-        g_return_val_if_fail (mixer != NULL, -1);
-        g_return_val_if_fail (layer != NULL, -1);
+        if (pool->nb_buffers >= pool->nb_max_buffers)
+        {
+                GList *last_item;
+                emu_buffer_t *last_buffer;
 
-        e = g_list_find_custom (mixer->layers,
-                                layer,
-                                (GCompareFunc) emu_mixer_compare_layer);
+                last_item = g_list_last (pool->buffers);
+                last_buffer = (emu_buffer_t *) last_item->data;
 
-        if (e)
-        {
-                UI_DEBUG ("layer already added...");
-                return 1;
+                pool->buffers = g_list_delete_link (pool->buffers, last_item);
+                if (pool->release_func)
+                        pool->release_func (last_buffer, pool->release_data);
+                emu_buffer_free (last_buffer);
+                emu_buffer_pool_trim_heaps (pool);
         }
+        else
+                pool->nb_buffers++;
 
-        mixer->layers = g_list_append (mixer->layers, layer);
-        clutter_container_add_actor (CLUTTER_CONTAINER (mixer->stage),
-                                     layer->actor);
+        pool->buffers = g_list_insert_before (pool->buffers,
+                                              pool->buffers,
+                                              buffer);
+}
+
+emu_buffer_t *
+emu_buffer_pool_add_buffer (emu_buffer_pool_t *pool,
+                            gint width, gint height,
+                            gint bpp)
+{
+        emu_buffer_t *buffer;
+
+        g_return_val_if_fail (pool != NULL, NULL);
+
+        buffer = emu_buffer_new (pool->buffer_index++, width, height, bpp);
+
+        g_return_val_if_fail (buffer != NULL, NULL);
+
+        emu_buffer_pool_insert_buffer (pool, buffer);
+
+        return buffer;
+}
+
+/*
+  Sub-allocates a buffer in format, of height lines of pitch bytes for
+  its first plane, in one of the pool's heaps, creating a new heap when
+  none has room.
+*/
+static emu_buffer_t *
+emu_buffer_pool_add_heap_buffer (emu_buffer_pool_t *pool,
+                                 gint width, gint height,
+                                 gint bpp, gint pitch,
+                                 lazy_format_t format)
+{
+        emu_buffer_t *buffer;
+        emu_heap_t *heap = NULL;
+        emu_plane_t planes[LAZY_MAX_PLANES];
+        GList *e;
+        gint nb_planes;
+        guint order, offset;
+
+        order = emu_heap_get_order (emu_format_get_planes (format,
+                                                           width, height,
+                                                           bpp, pitch,
+                                                           planes,
+                                                           &nb_planes));
+        if (order > HEAP_MAX_ORDER)
+        {
+                SERVER_DEBUG ("Buffer too large for a heap (%ix%i)",
+                              pitch, height);
+                return NULL;
+        }
+
+        for (e = pool->heaps; e != NULL; e = e->next)
+        {
+                if (emu_heap_alloc (e->data, order, &offset))
+                {
+                        heap = e->data;
+                        break;
+                }
+        }
+
+        if (heap == NULL)
+        {
+                heap = emu_heap_new (pool->heap_index++,
+                                     MAX (order, HEAP_DEFAULT_ORDER));
+
+                g_return_val_if_fail (heap != NULL, NULL);
+
+                pool->heaps = g_list_append (pool->heaps, heap);
+
+                if (!emu_heap_alloc (heap, order, &offset))
+                        return NULL;
+        }
+
+        buffer = emu_buffer_new_from_heap (pool->buffer_index++,
+                                           heap, offset, order,
+                                           width, height, bpp, pitch,
+                                           format);
+        if (buffer == NULL)
+        {
+                emu_heap_release (heap, offset, order);
+                return NULL;
+        }
+
+        emu_buffer_pool_insert_buffer (pool, buffer);
+
+        return buffer;
+}
+
+emu_buffer_t *
+emu_buffer_pool_add_pitched_buffer (emu_buffer_pool_t *pool,
+                                    gint width, gint height,
+                                    gint bpp, gint pitch)
+{
+        g_return_val_if_fail (pool != NULL, NULL);
+
+        return emu_buffer_pool_add_heap_buffer (pool, width, height,
+                                                bpp, pitch,
+                                                LAZY_FORMAT_PACKED);
+}
+
+/* Video frame, one byte per sample in every plane. */
+emu_buffer_t *
+emu_buffer_pool_add_planar_buffer (emu_buffer_pool_t *pool,
+                                   gint width, gint height,
+                                   lazy_format_t format, gint pitch)
+{
+        g_return_val_if_fail (pool != NULL, NULL);
+        g_return_val_if_fail (format != LAZY_FORMAT_PACKED, NULL);
+
+        return emu_buffer_pool_add_heap_buffer (pool, width, height,
+                                                1, pitch, format);
+}
+
+/*
+  Makes room for nb pitched buffers of the given geometry in prefaulted
+  heaps, so that the first clients don't wait on the allocator nor on
+  page faults. Returns the number of buffers there is room for.
+*/
+guint
+emu_buffer_pool_prewarm (emu_buffer_pool_t *pool, guint nb,
+                         gint width, gint height, gint bpp)
+{
+        emu_heap_t *heap;
+        guint order, heap_order, capacity = 0;
+
+        g_return_val_if_fail (pool != NULL, 0);
+        g_return_val_if_fail (width > 0 && height > 0 && bpp > 0, 0);
+
+        order = emu_heap_get_order ((gsize) width * height * bpp);
+        if (order > HEAP_MAX_ORDER)
+                return 0;
+        heap_order = MAX (order, HEAP_DEFAULT_ORDER);
+
+        while (capacity < nb)
+        {
+                heap = emu_heap_new (pool->heap_index++, heap_order);
+                if (heap == NULL)
+                        break;
+
+                emu_heap_prefault (heap);
+                /* Kept first, where trimming spares nb_warm_heaps heaps */
+                pool->heaps = g_list_prepend (pool->heaps, heap);
+                pool->nb_warm_heaps++;
+                capacity += 1u << (heap_order - order);
+        }
+
+        /* Room nobody may use would be wasted. */
+        pool->nb_max_buffers = MAX (pool->nb_max_buffers, MIN (capacity, nb));
+
+        return MIN (capacity, nb);
+}
+
+emu_heap_t *
+emu_buffer_pool_attach_heap (emu_buffer_pool_t *pool, guint id, guint order)
+{
+        emu_heap_t *heap;
+
+        g_return_val_if_fail (pool != NULL, NULL);
+
+        heap = emu_heap_attach (id, order);
+        if (heap != NULL)
+                pool->heaps = g_list_append (pool->heaps, heap);
+
+        return heap;
+}
+
+/*
+  Maps back a buffer left by a previous run under its former id, from
+  its own file or, when heap_id isn't -1, from an attached heap.
+*/
+emu_buffer_t *
+emu_buffer_pool_attach_buffer (emu_buffer_pool_t *pool, guint id,
+                               gint width, gint height,
+                               gint bpp, gint pitch,
+                               lazy_format_t format,
+                               gint heap_id, guint heap_offset,
+                               guint heap_order)
+{
+        emu_buffer_t *buffer;
+        emu_heap_t *heap = NULL;
+        GList *e;
+
+        g_return_val_if_fail (pool != NULL, NULL);
+
+        if (emu_buffer_pool_find_buffer (pool, id) != NULL)
+                return NULL;
+
+        if (heap_id < 0)
+        {
+                if (format != LAZY_FORMAT_PACKED)
+                        return NULL;
+                buffer = emu_buffer_attach (id, width, height, bpp);
+        }
+        else
+        {
+                for (e = pool->heaps; e != NULL; e = e->next)
+                        if (((emu_heap_t *) e->data)->id == (guint) heap_id)
+                                heap = e->data;
+
+                if (heap == NULL || heap_order > heap->order ||
+                    (gsize) pitch * height > (1u << heap_order) ||
+                    !emu_heap_reserve (heap, heap_offset, heap_order))
+                        return NULL;
+
+                buffer = emu_buffer_new_from_heap (id, heap,
+                                                   heap_offset, heap_order,
+                                                   width, height, bpp, pitch,
+                                                   format);
+                if (buffer == NULL)
+                        emu_heap_release (heap, heap_offset, heap_order);
+        }
+
+        if (buffer != NULL)
+                emu_buffer_pool_insert_buffer (pool, buffer);
+
+        return buffer;
+}
+
+void
+emu_buffer_pool_del_buffer (emu_buffer_pool_t *pool, guint id)
+{
+        emu_buffer_t  dbuffer;
+        GList        *item;
+
+        g_return_if_fail (pool != NULL);
+
+        dbuffer.id = id;
+        item = g_list_find_custom (pool->buffers, &dbuffer,
+                                   (GCompareFunc) emu_buffer_compare);
+
+        if (item)
+        {
+                emu_buffer_t *buffer;
+
+                buffer = (emu_buffer_t *) item->data;
+                pool->buffers = g_list_delete_link (pool->buffers, item);
+                if (pool->release_func)
+                        pool->release_func (buffer, pool->release_data);
+                emu_buffer_free (buffer);
+                emu_buffer_pool_trim_heaps (pool);
+
+                pool->nb_buffers--;
+        }
+}
+
+
+/* Memory a buffer holds, whole buddy blocks for heap buffers. */
+static gsize
+emu_buffer_get_footprint (emu_buffer_t *buffer)
+{
+        if (buffer->heap)
+                return (gsize) 1 << buffer->heap_order;
+
+        return emu_buffer_get_size (buffer);
+}
+
+/* Number of buffers owner has in the pool, and the memory they hold. */
+guint
+emu_buffer_pool_get_usage (emu_buffer_pool_t *pool, guint owner,
+                           gsize *nb_bytes)
+{
+        GList *e;
+        guint nb = 0;
+
+        g_return_val_if_fail (pool != NULL, 0);
+
+        *nb_bytes = 0;
+        for (e = pool->buffers; e != NULL; e = e->next)
+        {
+                emu_buffer_t *buffer = e->data;
+
+                if (buffer->owner == owner)
+                {
+                        *nb_bytes += emu_buffer_get_footprint (buffer);
+                        nb++;
+                }
+        }
+
+        return nb;
+}
+
+/*
+  Picks the buffer to drop for a new one of owner in a full pool: its
+  least recently used one, else one no connection owns anymore. FALSE
+  when only buffers of others could make room, *victim is left NULL
+  when there is room already.
+*/
+gboolean
+emu_buffer_pool_find_victim (emu_buffer_pool_t *pool, guint owner,
+                             emu_buffer_t **victim)
+{
+        GList *e;
+
+        g_return_val_if_fail (pool != NULL && victim != NULL, FALSE);
+
+        *victim = NULL;
+        if (pool->nb_buffers < pool->nb_max_buffers)
+                return TRUE;
+
+        for (e = g_list_last (pool->buffers); e != NULL; e = e->prev)
+        {
+                emu_buffer_t *buffer = e->data;
+
+                if (buffer->owner == owner)
+                {
+                        *victim = buffer;
+                        break;
+                }
+
+                if (buffer->owner == 0 && *victim == NULL)
+                        *victim = buffer;
+        }
+
+        return *victim != NULL;
+}
+/**/
+#define ATLAS_SIZE (1024)
+#define ATLAS_PADDING (1)
+
+typedef struct
+{
+        gint   y;
+        gint   height;
+        gint   x;        /* first column never allocated */
+        GList *free;     /* released GdkRectangle spans, sorted by x */
+        guint  nb_slots;
+} emu_atlas_shelf_t;
+
+typedef struct
+{
+        CoglHandle texture;
+        gint       size;
+        gint       threshold;
+        GList     *shelves; /* sorted by y */
+} emu_atlas_t;
+
+static void
+emu_atlas_shelf_free (emu_atlas_shelf_t *shelf)
+{
+        g_list_foreach (shelf->free, (GFunc) g_free, NULL);
+        g_list_free (shelf->free);
+
+        g_free (shelf);
+}
+
+void
+emu_atlas_free (emu_atlas_t *atlas)
+{
+        g_return_if_fail (atlas != NULL);
+
+        g_list_foreach (atlas->shelves, (GFunc) emu_atlas_shelf_free, NULL);
+        g_list_free (atlas->shelves);
+
+        if (atlas->texture != COGL_INVALID_HANDLE)
+                cogl_handle_unref (atlas->texture);
+
+        g_free (atlas);
+}
+
+emu_atlas_t *
+emu_atlas_new (gint size, gint threshold)
+{
+        emu_atlas_t *atlas;
+
+        g_return_val_if_fail (size > 0 && threshold > 0, NULL);
+
+        atlas = g_new0 (emu_atlas_t, 1);
+
+        g_return_val_if_fail (atlas != NULL, NULL);
+
+        atlas->size = size;
+        atlas->threshold = threshold;
+
+        return atlas;
+}
+
+gboolean
+emu_atlas_accepts (emu_atlas_t *atlas, gint width, gint height)
+{
+        g_return_val_if_fail (atlas != NULL, FALSE);
+
+        return (width > 0 && height > 0 &&
+                width <= atlas->threshold &&
+                height <= atlas->threshold);
+}
+
+static gboolean
+emu_atlas_shelf_alloc (emu_atlas_t *atlas,
+                       emu_atlas_shelf_t *shelf,
+                       gint width,
+                       GdkRectangle *slot)
+{
+        GList *e;
+
+        /* Reuse released spans first... */
+        for (e = shelf->free; e != NULL; e = e->next)
+        {
+                GdkRectangle *span = e->data;
+
+                if (span->width < width)
+                        continue;
+
+                slot->x = span->x;
+                span->x += width;
+                span->width -= width;
+
+                if (span->width == 0)
+                {
+                        shelf->free = g_list_delete_link (shelf->free, e);
+                        g_free (span);
+                }
+
+                goto found;
+        }
+
+        /* ...then the end of the shelf. */
+        if (atlas->size - shelf->x < width)
+                return FALSE;
+
+        slot->x = shelf->x;
+        shelf->x += width;
+
+found:
+        slot->y = shelf->y;
+        slot->width = width;
+        slot->height = shelf->height;
+        shelf->nb_slots++;
+
+        return TRUE;
+}
+
+/*
+  Shelf packing: a slot goes in the first shelf tall enough without
+  wasting more than half of its height, or in a new shelf below the
+  last one. Returns the padded slot, or NULL if the atlas is full.
+*/
+GdkRectangle *
+emu_atlas_alloc (emu_atlas_t *atlas, gint width, gint height)
+{
+        GdkRectangle slot, *ret;
+        emu_atlas_shelf_t *shelf;
+        GList *e;
+        gint bottom = 0;
+
+        g_return_val_if_fail (atlas != NULL, NULL);
+
+        width += 2 * ATLAS_PADDING;
+        height += 2 * ATLAS_PADDING;
+
+        if (width > atlas->size || height > atlas->size)
+                return NULL;
+
+        if (atlas->texture == COGL_INVALID_HANDLE)
+        {
+                atlas->texture = cogl_texture_new_with_size (atlas->size,
+                                                             atlas->size,
+                                                             COGL_TEXTURE_NO_AUTO_MIPMAP,
+                                                             COGL_PIXEL_FORMAT_RGBA_8888_PRE);
+                if (atlas->texture == COGL_INVALID_HANDLE)
+                {
+                        UI_DEBUG ("Cannot allocate %ix%i atlas",
+                                  atlas->size, atlas->size);
+                        return NULL;
+                }
+        }
+
+        for (e = atlas->shelves; e != NULL; e = e->next)
+        {
+                shelf = e->data;
+                bottom = shelf->y + shelf->height;
+
+                if (shelf->height < height ||
+                    (shelf->nb_slots > 0 && shelf->height > height + height / 2))
+                        continue;
+
+                if (emu_atlas_shelf_alloc (atlas, shelf, width, &slot))
+                        goto found;
+        }
+
+        if (atlas->size - bottom < height)
+                return NULL;
+
+        shelf = g_new0 (emu_atlas_shelf_t, 1);
+        shelf->y = bottom;
+        shelf->height = height;
+        atlas->shelves = g_list_append (atlas->shelves, shelf);
+
+        if (!emu_atlas_shelf_alloc (atlas, shelf, width, &slot))
+                return NULL;
+
+found:
+        ret = g_new (GdkRectangle, 1);
+        *ret = slot;
+
+        return ret;
+}
+
+static gint
+emu_atlas_compare_span (GdkRectangle *span1, GdkRectangle *span2)
+{
+        return span1->x - span2->x;
+}
+
+void
+emu_atlas_release (emu_atlas_t *atlas, GdkRectangle *slot)
+{
+        emu_atlas_shelf_t *shelf = NULL;
+        GList *e, *next;
+
+        g_return_if_fail (atlas != NULL);
+        g_return_if_fail (slot != NULL);
+
+        for (e = atlas->shelves; e != NULL; e = e->next)
+        {
+                shelf = e->data;
+                if (shelf->y == slot->y)
+                        break;
+        }
+
+        g_return_if_fail (e != NULL);
+
+        shelf->free = g_list_insert_sorted (shelf->free, slot,
+                                            (GCompareFunc) emu_atlas_compare_span);
+        shelf->nb_slots--;
+
+        /* Merge neighbouring spans. */
+        for (e = shelf->free; e != NULL && e->next != NULL; e = next)
+        {
+                GdkRectangle *span = e->data, *nspan = e->next->data;
+
+                next = e->next;
+                if (span->x + span->width == nspan->x)
+                {
+                        span->width += nspan->width;
+                        shelf->free = g_list_delete_link (shelf->free, next);
+                        g_free (nspan);
+                        next = e;
+                }
+        }
+
+        /* Give the trailing span back to the end of the shelf. */
+        e = g_list_last (shelf->free);
+        if (e)
+        {
+                GdkRectangle *span = e->data;
+
+                if (span->x + span->width == shelf->x)
+                {
+                        shelf->x = span->x;
+                        shelf->free = g_list_delete_link (shelf->free, e);
+                        g_free (span);
+                }
+        }
+
+        /* Drop empty shelves at the bottom so their height can change. */
+        while ((e = g_list_last (atlas->shelves)) != NULL &&
+               ((emu_atlas_shelf_t *) e->data)->nb_slots == 0)
+        {
+                emu_atlas_shelf_free (e->data);
+                atlas->shelves = g_list_delete_link (atlas->shelves, e);
+        }
+}
+
+/* Uploads data to the area at x,y within slot. */
+void
+emu_atlas_upload (emu_atlas_t *atlas, GdkRectangle *slot,
+                  gconstpointer data,
+                  gint x, gint y,
+                  gint width, gint height, gint rowstride)
+{
+        g_return_if_fail (atlas != NULL);
+        g_return_if_fail (slot != NULL);
+
+        cogl_texture_set_region (atlas->texture,
+                                 0, 0,
+                                 slot->x + ATLAS_PADDING + x,
+                                 slot->y + ATLAS_PADDING + y,
+                                 width, height,
+                                 width, height,
+                                 COGL_PIXEL_FORMAT_BGRA_8888,
+                                 rowstride,
+                                 data);
+}
+
+/* Returns a texture sampling the content of slot only. */
+CoglHandle
+emu_atlas_get_slot_texture (emu_atlas_t *atlas, GdkRectangle *slot,
+                            gint width, gint height)
+{
+        g_return_val_if_fail (atlas != NULL, COGL_INVALID_HANDLE);
+        g_return_val_if_fail (slot != NULL, COGL_INVALID_HANDLE);
+
+        return cogl_texture_new_from_sub_texture (atlas->texture,
+                                                  slot->x + ATLAS_PADDING,
+                                                  slot->y + ATLAS_PADDING,
+                                                  width, height);
+}
+
+/**/
+#define PBO_RING_MAX (4)
+
+/* Layers this big may be uploaded at a lower resolution under load */
+#define SCALE_MIN_PIXELS (256 * 256)
+#define SCALE_MAX_SHIFT (2)
+
+typedef struct
+{
+        gint id;
+
+        emu_buffer_t *buffer;  /* last uploaded */
+        emu_buffer_t *pending; /* latched, uploaded before next paint */
+
+        /* Content of the last latched buffer, when deduplicating */
+        guint64  content_hash;
+        gboolean content_hashed;
+
+        /* Tile checksums of the latched content, tiles not uploaded yet */
+        guint64  *tile_hashes;
+        guint8   *dirty_tiles;
+        gint      tiles_x, tiles_y;
+        gboolean  all_tiles_dirty;
+
+        gint width, height;
+
+        /* Size of the texture storage currently allocated */
+        gint texture_width, texture_height;
+
+        /* Small layers may live in a shared atlas */
+        emu_atlas_t  *atlas;
+        GdkRectangle *atlas_slot;
+
+#ifdef HAVE_COGL_PIXEL_BUFFER_NEW_FOR_SIZE
+        /* Streaming uploads go round these pixel buffers */
+        CoglHandle pbos[PBO_RING_MAX];
+        guint      pbo_index;
+        guint      pbo_stride;
+        gint       pbo_width, pbo_height;
+#endif
+        gboolean   streamed; /* last upload went through a pixel buffer */
+
+        /* Y, U and V textures of video content, for the shader */
+        CoglHandle planes[LAZY_MAX_PLANES];
+        gint       planes_width, planes_height;
+
+        /* Video converted to BGRA in software, without shaders */
+        guint8    *converted;
+
+        GdkRectangle src;
+        GdkRectangle dst;
+
+        guint8 opacity;
+        guint  zorder;
+
+        /* Texture resolution divided by 2^scale_shift when overloaded */
+        gint    scale_shift;
+        guint8 *scaled;
+        guint   upload_frame;
+
+        ClutterActor *actor;
+
+        /* Connection that added it, 0 when restored */
+        guint owner;
+} emu_layer_t;
+
+#ifdef HAVE_COGL_PIXEL_BUFFER_NEW_FOR_SIZE
+static void
+emu_layer_free_pbos (emu_layer_t *layer)
+{
+        guint i;
+
+        for (i = 0; i < PBO_RING_MAX; i++)
+        {
+                if (layer->pbos[i] != COGL_INVALID_HANDLE)
+                        cogl_handle_unref (layer->pbos[i]);
+                layer->pbos[i] = COGL_INVALID_HANDLE;
+        }
+
+        layer->pbo_width = 0;
+        layer->pbo_height = 0;
+}
+
+static gboolean emu_layer_ensure_texture (emu_layer_t *layer,
+                                          gint width, gint height);
+
+/*
+  Streams area through the next pixel buffer of the ring into the layer
+  texture, the driver copies it while we go on.
+*/
+static gboolean
+emu_layer_upload_pbo (emu_layer_t *layer,
+                      emu_buffer_t *buffer,
+                      GdkRectangle *area,
+                      const guint8 *data)
+{
+        CoglHandle pbo, texture;
+        guint8 *ptr;
+        gint i;
+
+        if (layer->pbo_width != layer->width ||
+            layer->pbo_height != layer->height)
+        {
+                emu_layer_free_pbos (layer);
+
+                for (i = 0; i < pbo_ring_size; i++)
+                {
+                        layer->pbos[i] =
+                                cogl_pixel_buffer_new_for_size (layer->width,
+                                                                layer->height,
+                                                                COGL_PIXEL_FORMAT_BGRA_8888,
+                                                                &layer->pbo_stride);
+                        if (layer->pbos[i] == COGL_INVALID_HANDLE)
+                        {
+                                emu_layer_free_pbos (layer);
+                                return FALSE;
+                        }
+
+                        cogl_buffer_set_update_hint (layer->pbos[i],
+                                                     COGL_BUFFER_UPDATE_HINT_STREAM);
+                }
+
+                layer->pbo_index = 0;
+                layer->pbo_width = layer->width;
+                layer->pbo_height = layer->height;
+        }
+
+        pbo = layer->pbos[layer->pbo_index];
+        layer->pbo_index = (layer->pbo_index + 1) % pbo_ring_size;
+
+        /*
+          Only area is written and only area is transferred, the rest of
+          the pixel buffer may hold an older frame: the texture is kept
+          across uploads and keeps the pixels outside area itself.
+        */
+        ptr = cogl_buffer_map (pbo, COGL_BUFFER_ACCESS_WRITE);
+        if (ptr == NULL)
+                return FALSE;
+
+        ptr += area->y * layer->pbo_stride + area->x * 4;
+        for (i = 0; i < area->height; i++)
+        {
+                memcpy (ptr, data, area->width * 4);
+                ptr += layer->pbo_stride;
+                data += buffer->pitch;
+        }
+
+        cogl_buffer_unmap (pbo);
+
+        if (emu_layer_ensure_texture (layer, layer->width, layer->height))
+                layer->all_tiles_dirty = TRUE;
+
+        texture = clutter_texture_get_cogl_texture (CLUTTER_TEXTURE (layer->actor));
+        return cogl_texture_set_region_from_buffer (texture,
+                                                    area->x, area->y,
+                                                    area->x, area->y,
+                                                    area->width, area->height,
+                                                    pbo,
+                                                    COGL_PIXEL_FORMAT_BGRA_8888,
+                                                    layer->pbo_stride);
+}
+#endif /* HAVE_COGL_PIXEL_BUFFER_NEW_FOR_SIZE */
+
+/* Goes back to a single RGB texture, left to the caller to allocate. */
+static void
+emu_layer_free_planes (emu_layer_t *layer)
+{
+        CoglHandle material;
+        gint i;
+
+        if (layer->planes[0] == COGL_INVALID_HANDLE)
+                return;
+
+        if (layer->actor)
+        {
+                material = clutter_texture_get_cogl_material (CLUTTER_TEXTURE (layer->actor));
+                for (i = 1; i < LAZY_MAX_PLANES; i++)
+                        cogl_material_remove_layer (material, i);
+                clutter_actor_set_shader (layer->actor, NULL);
+        }
+
+        for (i = 0; i < LAZY_MAX_PLANES; i++)
+        {
+                if (layer->planes[i] != COGL_INVALID_HANDLE)
+                        cogl_handle_unref (layer->planes[i]);
+                layer->planes[i] = COGL_INVALID_HANDLE;
+        }
+
+        layer->planes_width = 0;
+        layer->planes_height = 0;
+}
+
+void
+emu_layer_free (emu_layer_t *layer)
+{
+        if (!layer)
+                return;
+
+        if (layer->atlas_slot)
+                emu_atlas_release (layer->atlas, layer->atlas_slot);
+
+#ifdef HAVE_COGL_PIXEL_BUFFER_NEW_FOR_SIZE
+        emu_layer_free_pbos (layer);
+#endif
+        emu_layer_free_planes (layer);
+
+        g_free (layer->tile_hashes);
+        g_free (layer->dirty_tiles);
+        g_free (layer->scaled);
+        g_free (layer->converted);
+
+        if (layer->actor)
+        {
+                layer->actor = NULL;
+        }
+
+        g_free (layer);
+}
+
+emu_layer_t *
+emu_layer_new (gint id, gint width, gint height)
+{
+        emu_layer_t *layer;
+
+        layer = g_new0 (emu_layer_t, 1);
+
+        g_return_val_if_fail (layer != NULL, NULL);
+
+        layer->id = id;
+        layer->width = width;
+        layer->height = height;
+        /* layer->size = 4 * width * height; */
+
+        /* layer->fd = -1; */
+
+        /* layer->src.x = sx; */
+        /* layer->src.y = sy; */
+        /* layer->src.width = sw; */
+        /* layer->src.height = sh; */
+
+        /* layer->dst.x = dx; */
+        /* layer->dst.y = dy; */
+        /* layer->dst.width = dw; */
+        /* layer->dst.height = dh; */
+
+        /* No viewport applied yet. */
+        layer->src.width = -1;
+        layer->dst.width = -1;
+
+        layer->opacity = 0xff;
+
+        layer->actor = clutter_texture_new ();
+        clutter_actor_set_opacity (layer->actor, layer->opacity);
+        clutter_actor_show (layer->actor);
+
+        return layer;
+
+        return NULL;
+}
+
+void
+emu_layer_set_viewport_input (emu_layer_t *layer,
+                              gint x, gint y,
+                              gint width, gint height)
+{
+        gfloat clip_x, clip_y, clip_width, clip_height;
+
+        g_return_if_fail (layer != NULL);
+
+        /* What the actor shows, layer->src may be ahead of it. */
+        if (clutter_actor_has_clip (layer->actor))
+        {
+                clutter_actor_get_clip (layer->actor, &clip_x, &clip_y,
+                                        &clip_width, &clip_height);
+                if (layer->src.x == x && layer->src.y == y &&
+                    layer->src.width == width && layer->src.height == height &&
+                    clip_x == x && clip_y == y &&
+                    clip_width == width && clip_height == height)
+                        return;
+        }
+
+        layer->src.x = x;
+        layer->src.y = y;
+        layer->src.width = width;
+        layer->src.height = height;
+
+        /* Parts not sampled so far may be stale. */
+        if (layer->pending == NULL)
+                layer->pending = layer->buffer;
+        layer->all_tiles_dirty = TRUE;
+
+        clutter_actor_set_clip (layer->actor,
+                                layer->src.x, layer->src.y,
+                                layer->src.width, layer->src.height);
+}
+
+void
+emu_layer_set_viewport_output (emu_layer_t *layer,
+                               gint x, gint y,
+                               gint width, gint height)
+{
+        gfloat actor_x, actor_y, actor_width, actor_height;
+
+        g_return_if_fail (layer != NULL);
+
+        /*
+          Compared to where the actor is rather than to layer->dst, which
+          holds the target of a transition that may have been cut short.
+        */
+        clutter_actor_get_position (layer->actor, &actor_x, &actor_y);
+        clutter_actor_get_size (layer->actor, &actor_width, &actor_height);
+        if (actor_x == x && actor_y == y &&
+            actor_width == width && actor_height == height)
+        {
+                layer->dst.x = x;
+                layer->dst.y = y;
+                layer->dst.width = width;
+                layer->dst.height = height;
+                return;
+        }
+
+        layer->dst.x = x;
+        layer->dst.y = y;
+        layer->dst.width = width;
+        layer->dst.height = height;
+
+        clutter_actor_set_position (layer->actor,
+                                    layer->dst.x,
+                                    layer->dst.y);
+        clutter_actor_set_size (layer->actor,
+                                layer->dst.width,
+                                layer->dst.height);
+}
+
+/* Moves the layer in or out of its atlas, depending on its size. */
+static void
+emu_layer_update_atlas_slot (emu_layer_t *layer)
+{
+        CoglHandle texture;
+
+        emu_layer_free_planes (layer);
+
+        if (layer->atlas_slot)
+        {
+                emu_atlas_release (layer->atlas, layer->atlas_slot);
+                layer->atlas_slot = NULL;
+        }
+
+        /* Own texture storage, allocated on next upload. */
+        layer->texture_width = 0;
+        layer->texture_height = 0;
+        layer->all_tiles_dirty = TRUE;
+
+        if (layer->atlas == NULL ||
+            !emu_atlas_accepts (layer->atlas, layer->width, layer->height))
+                return;
+
+        layer->atlas_slot = emu_atlas_alloc (layer->atlas,
+                                             layer->width, layer->height);
+        if (layer->atlas_slot == NULL)
+        {
+                UI_DEBUG ("atlas full, layer %i gets its own texture",
+                          layer->id);
+                return;
+        }
+
+        texture = emu_atlas_get_slot_texture (layer->atlas, layer->atlas_slot,
+                                              layer->width, layer->height);
+        clutter_texture_set_cogl_texture (CLUTTER_TEXTURE (layer->actor),
+                                          texture);
+        cogl_handle_unref (texture);
+}
+
+void
+emu_layer_set_atlas (emu_layer_t *layer, emu_atlas_t *atlas)
+{
+        g_return_if_fail (layer != NULL);
+
+        layer->atlas = atlas;
+        emu_layer_update_atlas_slot (layer);
+}
+
+/*
+  Changes the size of the layer, the actor is kept and the texture
+  storage is only reallocated on the next buffer upload if the size
+  actually changed.
+*/
+void
+emu_layer_set_size (emu_layer_t *layer, gint width, gint height)
+{
+        g_return_if_fail (layer != NULL);
+
+        if (layer->width == width && layer->height == height)
+                return;
+
+        UI_DEBUG ("resizing layer %i to %ix%i", layer->id, width, height);
+
+        layer->width = width;
+        layer->height = height;
+
+        if (layer->atlas)
+                emu_layer_update_atlas_slot (layer);
+
+        /* New storage, the whole buffer has to go again. */
+        if (layer->pending == NULL)
+                layer->pending = layer->buffer;
+}
+
+void
+emu_layer_set_scale (emu_layer_t *layer, gint scale_shift)
+{
+        g_return_if_fail (layer != NULL);
+
+        if (layer->scale_shift == scale_shift)
+                return;
+
+        UI_DEBUG ("layer %i now uploaded at 1/%i", layer->id, 1 << scale_shift);
+
+        layer->scale_shift = scale_shift;
+
+        /* Static content has to be sent again at the new resolution. */
+        if (layer->pending == NULL)
+                layer->pending = layer->buffer;
+}
+
+void
+emu_layer_set_opacity (emu_layer_t *layer, guint8 opacity)
+{
+        g_return_if_fail (layer != NULL);
+
+        layer->opacity = opacity;
+
+        clutter_actor_set_opacity (layer->actor, opacity);
+}
+
+/* Stops a running transition on property so it can be set directly. */
+static void
+emu_layer_unbind_animation (emu_layer_t *layer, const gchar *property)
+{
+        ClutterAnimation *animation;
+
+        animation = clutter_actor_get_animation (layer->actor);
+        if (animation && clutter_animation_has_property (animation, property))
+                clutter_animation_unbind_property (animation, property);
+}
+
+void
+emu_layer_animate_viewport_output (emu_layer_t *layer,
+                                   gint x, gint y,
+                                   gint width, gint height,
+                                   guint duration,
+                                   gulong mode)
+{
+        g_return_if_fail (layer != NULL);
+
+        emu_layer_unbind_animation (layer, "x");
+        emu_layer_unbind_animation (layer, "y");
+        emu_layer_unbind_animation (layer, "width");
+        emu_layer_unbind_animation (layer, "height");
+
+        if (duration == 0)
+        {
+                emu_layer_set_viewport_output (layer, x, y, width, height);
+                return;
+        }
+
+        layer->dst.x = x;
+        layer->dst.y = y;
+        layer->dst.width = width;
+        layer->dst.height = height;
+
+        clutter_actor_animate (layer->actor, mode, duration,
+                               "x", (gfloat) layer->dst.x,
+                               "y", (gfloat) layer->dst.y,
+                               "width", (gfloat) layer->dst.width,
+                               "height", (gfloat) layer->dst.height,
+                               NULL);
+}
+
+void
+emu_layer_animate_opacity (emu_layer_t *layer,
+                           guint8 opacity,
+                           guint duration,
+                           gulong mode)
+{
+        g_return_if_fail (layer != NULL);
+
+        emu_layer_unbind_animation (layer, "opacity");
+
+        if (duration == 0)
+        {
+                emu_layer_set_opacity (layer, opacity);
+                return;
+        }
+
+        layer->opacity = opacity;
+
+        clutter_actor_animate (layer->actor, mode, duration,
+                               "opacity", (guint) layer->opacity,
+                               NULL);
+}
+
+/*
+  Latches buffer, the transfer is deferred to emu_layer_upload() right
+  before the stage paints. Returns TRUE if a previously latched buffer
+  is dropped without ever being uploaded.
+*/
+gboolean
+emu_layer_set_buffer (emu_layer_t *layer, emu_buffer_t *buffer)
+{
+        gboolean redundant;
+
+        g_return_val_if_fail (layer != NULL && buffer != NULL, FALSE);
+
+        UI_DEBUG ("buffer in %s", buffer->filename);
+
+        redundant = (layer->pending != NULL);
+        layer->pending = buffer;
+
+        clutter_actor_queue_redraw (layer->actor);
+
+        return redundant;
+}
+
+static void
+emu_layer_keep_buffer (emu_layer_t *layer, emu_buffer_t *buffer)
+{
+        UI_DEBUG ("buffer %s unchanged", buffer->filename);
+
+        /*
+          Same pixels, but the client may now rewrite the buffer it
+          flipped before: whatever is latched, and re-latched later,
+          has to read from the one it just handed over.
+        */
+        if (layer->pending != NULL)
+                layer->pending = buffer;
+        else
+                layer->buffer = buffer;
+}
+
+/*
+  Stands in for emu_layer_set_buffer() when buffer holds the same
+  pixels as the last latched one, nothing gets uploaded nor redrawn.
+  Returns FALSE if the content changed.
+*/
+gboolean
+emu_layer_skip_buffer (emu_layer_t *layer, emu_buffer_t *buffer,
+                       guint64 hash)
+{
+        gboolean unchanged;
+
+        g_return_val_if_fail (layer != NULL && buffer != NULL, FALSE);
+
+        unchanged = (layer->content_hashed && layer->content_hash == hash);
+
+        layer->content_hash = hash;
+        layer->content_hashed = TRUE;
+
+        if (!unchanged)
+                return FALSE;
+
+        emu_layer_keep_buffer (layer, buffer);
+
+        return TRUE;
+}
+
+/*
+  Accumulates the tiles of buffer that differ from the latched content,
+  skipping buffer like emu_layer_skip_buffer() when none does.
+*/
+gboolean
+emu_layer_diff_tiles (emu_layer_t *layer, emu_buffer_t *buffer)
+{
+        gboolean changed = FALSE;
+        gint i, nb_tiles;
+
+        g_return_val_if_fail (layer != NULL && buffer != NULL, FALSE);
+
+        nb_tiles = buffer->tiles_x * buffer->tiles_y;
+
+        if (layer->tile_hashes == NULL ||
+            layer->tiles_x != buffer->tiles_x ||
+            layer->tiles_y != buffer->tiles_y)
+        {
+                g_free (layer->tile_hashes);
+                g_free (layer->dirty_tiles);
+
+                layer->tile_hashes = g_new (guint64, nb_tiles);
+                layer->dirty_tiles = g_new0 (guint8, nb_tiles);
+                layer->tiles_x = buffer->tiles_x;
+                layer->tiles_y = buffer->tiles_y;
+                layer->all_tiles_dirty = TRUE;
+        }
+
+        for (i = 0; i < nb_tiles; i++)
+        {
+                if (!layer->all_tiles_dirty &&
+                    layer->tile_hashes[i] == buffer->tile_hashes[i])
+                        continue;
+
+                layer->tile_hashes[i] = buffer->tile_hashes[i];
+                layer->dirty_tiles[i] = 1;
+                changed = TRUE;
+        }
+
+        if (!changed)
+                emu_layer_keep_buffer (layer, buffer);
+
+        return changed;
+}
+
+gboolean
+emu_layer_is_visible (emu_layer_t *layer,
+                      gfloat stage_width, gfloat stage_height)
+{
+        gfloat x, y, width, height;
+
+        g_return_val_if_fail (layer != NULL, FALSE);
+
+        if (clutter_actor_get_opacity (layer->actor) == 0)
+                return FALSE;
+
+        if (layer->src.width == 0 || layer->src.height == 0)
+                return FALSE;
+
+        clutter_actor_get_position (layer->actor, &x, &y);
+        clutter_actor_get_size (layer->actor, &width, &height);
+
+        return (x < stage_width && y < stage_height &&
+                (x + width) > 0 && (y + height) > 0);
+}
+
+/*
+  Area of the texture actually sampled on screen. The clip set from
+  src is in actor coordinates, the texture being stretched to dst.
+*/
+static void
+emu_layer_get_sampled_area (emu_layer_t *layer, GdkRectangle *area)
+{
+        gint x1, y1, x2, y2;
+
+        area->x = 0;
+        area->y = 0;
+        area->width = layer->width;
+        area->height = layer->height;
+
+        /* The scale changes while dst is animated. */
+        if (layer->src.width < 0 ||
+            layer->dst.width <= 0 || layer->dst.height <= 0 ||
+            clutter_actor_get_animation (layer->actor) != NULL)
+                return;
+
+        x1 = layer->src.x * layer->width / layer->dst.width;
+        y1 = layer->src.y * layer->height / layer->dst.height;
+        x2 = ((layer->src.x + layer->src.width) * layer->width +
+              layer->dst.width - 1) / layer->dst.width;
+        y2 = ((layer->src.y + layer->src.height) * layer->height +
+              layer->dst.height - 1) / layer->dst.height;
+
+        area->x = CLAMP (x1, 0, layer->width);
+        area->y = CLAMP (y1, 0, layer->height);
+        area->width = CLAMP (x2, 0, layer->width) - area->x;
+        area->height = CLAMP (y2, 0, layer->height) - area->y;
+}
+
+/* (Re)allocates the layer own texture, returns TRUE if it is new. */
+static gboolean
+emu_layer_ensure_texture (emu_layer_t *layer, gint width, gint height)
+{
+        CoglHandle texture;
+
+        if (layer->texture_width == width &&
+            layer->texture_height == height)
+                return FALSE;
+
+        UI_DEBUG ("allocating %ix%i texture storage", width, height);
+        texture = cogl_texture_new_with_size (width, height,
+                                              COGL_TEXTURE_NO_AUTO_MIPMAP,
+                                              COGL_PIXEL_FORMAT_RGBA_8888_PRE);
+        clutter_texture_set_cogl_texture (CLUTTER_TEXTURE (layer->actor),
+                                          texture);
+        cogl_handle_unref (texture);
+
+        layer->texture_width = width;
+        layer->texture_height = height;
+
+        return TRUE;
+}
+
+/*
+  Box filters area of buffer down by 2^scale_shift into a texture of
+  the reduced size, the actor stretches it back to its geometry.
+*/
+static gsize
+emu_layer_upload_scaled (emu_layer_t *layer,
+                         emu_buffer_t *buffer,
+                         const GdkRectangle *area)
+{
+        gint shift = layer->scale_shift, n = 1 << shift;
+        gint x0, y0, x1, y1, x, y, i, j;
+        guint8 *dst;
+
+        x0 = area->x >> shift;
+        y0 = area->y >> shift;
+        x1 = MIN ((area->x + area->width + n - 1) >> shift,
+                  MIN (buffer->width, layer->width) >> shift);
+        y1 = MIN ((area->y + area->height + n - 1) >> shift,
+                  MIN (buffer->height, layer->height) >> shift);
+        if (x1 <= x0 || y1 <= y0)
+                return 0;
+
+        emu_layer_ensure_texture (layer,
+                                  layer->width >> shift,
+                                  layer->height >> shift);
+
+        /* Back to full size, everything goes again. */
+        layer->all_tiles_dirty = TRUE;
+
+        layer->scaled = g_realloc (layer->scaled, (x1 - x0) * (y1 - y0) * 4);
+        dst = layer->scaled;
+
+        for (y = y0; y < y1; y++)
+        {
+                for (x = x0; x < x1; x++)
+                {
+                        guint sum[4] = { 0, 0, 0, 0 };
+
+                        for (j = 0; j < n; j++)
+                        {
+                                const guint8 *src = (const guint8 *) buffer->ptr +
+                                        ((y << shift) + j) * buffer->pitch +
+                                        (x << shift) * 4;
+
+                                for (i = 0; i < n * 4; i++)
+                                        sum[i & 3] += src[i];
+                        }
+
+                        for (i = 0; i < 4; i++)
+                                *dst++ = sum[i] >> (2 * shift);
+                }
+        }
+
+        UI_DEBUG ("updating %ix%i@%ix%i at 1/%i in clutter",
+                  x1 - x0, y1 - y0, x0, y0, n);
+        clutter_texture_set_area_from_rgb_data (CLUTTER_TEXTURE (layer->actor),
+                                                layer->scaled,
+                                                TRUE,
+                                                x0, y0,
+                                                x1 - x0, y1 - y0,
+                                                (x1 - x0) * 4,
+                                                4,
+                                                CLUTTER_TEXTURE_RGB_FLAG_BGR,
+                                                NULL);
+
+        return (gsize) (x1 - x0) * (y1 - y0) * 4;
+}
+
+/*
+  Copies BGRA pixels to area of the layer storage, data pointing at the
+  top left pixel of the area. Returns the bytes sent.
+*/
+static gsize
+emu_layer_upload_pixels (emu_layer_t *layer,
+                         const GdkRectangle *area,
+                         const guint8 *data, gint pitch)
+{
+        if (layer->atlas_slot)
+        {
+                UI_DEBUG ("updating atlas slot");
+                emu_atlas_upload (layer->atlas, layer->atlas_slot,
+                                  data,
+                                  area->x, area->y,
+                                  area->width, area->height,
+                                  pitch);
+        }
+        else
+        {
+                UI_DEBUG ("updating %ix%i@%ix%i in clutter",
+                          area->width, area->height, area->x, area->y);
+                clutter_texture_set_area_from_rgb_data (CLUTTER_TEXTURE (layer->actor),
+                                                        data,
+                                                        TRUE,
+                                                        area->x, area->y,
+                                                        area->width,
+                                                        area->height,
+                                                        pitch,
+                                                        4,
+                                                        CLUTTER_TEXTURE_RGB_FLAG_BGR,
+                                                        NULL);
+        }
+
+        return (gsize) area->width * area->height * 4;
+}
+
+/* Copies area of buffer to the layer storage, returns the bytes sent. */
+static gsize
+emu_layer_upload_area (emu_layer_t *layer,
+                       emu_buffer_t *buffer,
+                       const GdkRectangle *area)
+{
+        return emu_layer_upload_pixels (layer, area,
+                                        (const guint8 *) buffer->ptr +
+                                        area->y * buffer->pitch + area->x * 4,
+                                        buffer->pitch);
+}
+
+/* Whether the part of tile within the buffer lies inside area. */
+static gboolean
+emu_layer_tile_inside (emu_buffer_t *buffer, gint tx, gint ty,
+                       const GdkRectangle *area)
+{
+        gint x = tx * TILE_SIZE, y = ty * TILE_SIZE;
+
+        return (x >= area->x && y >= area->y &&
+                MIN (x + TILE_SIZE, buffer->width) <= area->x + area->width &&
+                MIN (y + TILE_SIZE, buffer->height) <= area->y + area->height);
+}
+
+/*
+  Sends the dirty tiles overlapping area, one transfer per horizontal
+  run. Tiles only partly sampled stay dirty for when the viewport
+  moves.
+*/
+static gsize
+emu_layer_upload_tiles (emu_layer_t *layer,
+                        emu_buffer_t *buffer,
+                        const GdkRectangle *area)
+{
+        gsize size = 0;
+        gint tx, ty, end;
+
+        for (ty = 0; ty < layer->tiles_y; ty++)
+        {
+                guint8 *dirty = layer->dirty_tiles + ty * layer->tiles_x;
+
+                for (tx = 0; tx < layer->tiles_x; tx = end)
+                {
+                        GdkRectangle run, part;
+
+                        for (; tx < layer->tiles_x && !dirty[tx]; tx++);
+                        for (end = tx; end < layer->tiles_x && dirty[end]; end++);
+                        if (tx == end)
+                                break;
+
+                        run.x = tx * TILE_SIZE;
+                        run.y = ty * TILE_SIZE;
+                        run.width = (end - tx) * TILE_SIZE;
+                        run.height = TILE_SIZE;
+
+                        if (gdk_rectangle_intersect (&run, area, &part))
+                                size += emu_layer_upload_area (layer, buffer,
+                                                               &part);
+
+                        for (; tx < end; tx++)
+                                dirty[tx] = !emu_layer_tile_inside (buffer,
+                                                                    tx, ty,
+                                                                    area);
+                }
+        }
+
+        return size;
+}
+
+/* After a whole area upload, only the tiles outside it are stale. */
+static void
+emu_layer_reset_tiles (emu_layer_t *layer,
+                       emu_buffer_t *buffer,
+                       const GdkRectangle *area)
+{
+        gint tx, ty;
+
+        if (layer->dirty_tiles == NULL ||
+            layer->tiles_x != buffer->tiles_x ||
+            layer->tiles_y != buffer->tiles_y)
+                return;
+
+        for (ty = 0; ty < layer->tiles_y; ty++)
+                for (tx = 0; tx < layer->tiles_x; tx++)
+                        layer->dirty_tiles[ty * layer->tiles_x + tx] =
+                                !emu_layer_tile_inside (buffer, tx, ty, area);
+
+        layer->all_tiles_dirty = FALSE;
+}
+
+/* BT.601 studio range, samples fetched from alpha-only textures */
+static const gchar *yuv_shader_source =
+        "uniform sampler2D y_plane, u_plane, v_plane;\n"
+        "void main ()\n"
+        "{\n"
+        "  vec2 coord = gl_TexCoord[0].st;\n"
+        "  float y = 1.164 * (texture2D (y_plane, coord).a - 0.0625);\n"
+        "  float u = texture2D (u_plane, coord).a - 0.5;\n"
+        "  float v = texture2D (v_plane, coord).a - 0.5;\n"
+        "  gl_FragColor = vec4 (y + 1.596 * v,\n"
+        "                       y - 0.391 * u - 0.813 * v,\n"
+        "                       y + 2.018 * u,\n"
+        "                       1.0) * gl_Color;\n"
+        "}\n";
+
+/* Shared by all video layers, NULL when GLSL is not available. */
+static ClutterShader *
+emu_layer_get_yuv_shader (void)
+{
+        static ClutterShader *shader = NULL;
+        static gboolean compiled = FALSE;
+        GError *error = NULL;
+
+        if (compiled)
+                return shader;
+        compiled = TRUE;
+
+        if (!clutter_feature_available (CLUTTER_FEATURE_SHADERS_GLSL))
+        {
+                g_warning ("No GLSL support, video is converted in software");
+                return NULL;
+        }
+
+        shader = clutter_shader_new ();
+        clutter_shader_set_fragment_source (shader, yuv_shader_source, -1);
+        if (!clutter_shader_compile (shader, &error))
+        {
+                g_warning ("Cannot compile the YUV shader, video is "
+                           "converted in software: %s", error->message);
+                g_error_free (error);
+                g_object_unref (shader);
+                shader = NULL;
+        }
+
+        return shader;
+}
+
+/* Texture per plane, bound as layers of the actor material. */
+static gboolean
+emu_layer_ensure_planes (emu_layer_t *layer, ClutterShader *shader)
+{
+        CoglHandle material;
+        gint i;
+
+        if (layer->planes_width == layer->width &&
+            layer->planes_height == layer->height)
+                return TRUE;
+
+        emu_layer_free_planes (layer);
+
+        /* The planes stand in for the atlas slot or own texture. */
+        if (layer->atlas_slot)
+        {
+                emu_atlas_release (layer->atlas, layer->atlas_slot);
+                layer->atlas_slot = NULL;
+        }
+        layer->texture_width = 0;
+        layer->texture_height = 0;
+
+        UI_DEBUG ("allocating %ix%i video planes", layer->width, layer->height);
+        for (i = 0; i < LAZY_MAX_PLANES; i++)
+        {
+                gint shift = (i > 0);
+
+                layer->planes[i] =
+                        cogl_texture_new_with_size ((layer->width + shift) >> shift,
+                                                    (layer->height + shift) >> shift,
+                                                    COGL_TEXTURE_NO_AUTO_MIPMAP,
+                                                    COGL_PIXEL_FORMAT_A_8);
+                if (layer->planes[i] == COGL_INVALID_HANDLE)
+                {
+                        emu_layer_free_planes (layer);
+                        return FALSE;
+                }
+        }
+
+        clutter_texture_set_cogl_texture (CLUTTER_TEXTURE (layer->actor),
+                                          layer->planes[0]);
+        material = clutter_texture_get_cogl_material (CLUTTER_TEXTURE (layer->actor));
+        for (i = 1; i < LAZY_MAX_PLANES; i++)
+                cogl_material_set_layer (material, i, layer->planes[i]);
+
+        clutter_actor_set_shader (layer->actor, shader);
+        clutter_actor_set_shader_param_int (layer->actor, "y_plane", 0);
+        clutter_actor_set_shader_param_int (layer->actor, "u_plane", 1);
+        clutter_actor_set_shader_param_int (layer->actor, "v_plane", 2);
+
+        layer->planes_width = layer->width;
+        layer->planes_height = layer->height;
+
+        return TRUE;
+}
+
+/*
+  One line of BT.601 studio range video to BGRA, in 8.8 fixed point.
+  Kept free of branches so that the compiler vectorises it.
+*/
+static void
+emu_convert_yuv_line (const guint8 *y, const guint8 *u, const guint8 *v,
+                      gint x, gint width, guint8 *dst)
+{
+        gint i;
+
+        for (i = 0; i < width; i++)
+        {
+                gint c = 298 * (y[x + i] - 16) + 128;
+                gint d = u[(x + i) >> 1] - 128;
+                gint e = v[(x + i) >> 1] - 128;
+
+                dst[4 * i + 0] = CLAMP ((c + 516 * d) >> 8, 0, 255);
+                dst[4 * i + 1] = CLAMP ((c - 100 * d - 208 * e) >> 8, 0, 255);
+                dst[4 * i + 2] = CLAMP ((c + 409 * e) >> 8, 0, 255);
+                dst[4 * i + 3] = 0xff;
+        }
+}
+
+/* Converts area of a video buffer on the CPU into the RGB storage. */
+static gsize
+emu_layer_upload_converted (emu_layer_t *layer,
+                            emu_buffer_t *buffer,
+                            const GdkRectangle *area)
+{
+        const guint8 *ptr = buffer->ptr;
+        const emu_plane_t *planes = buffer->planes;
+        gint y;
+
+        layer->converted = g_realloc (layer->converted,
+                                      area->width * area->height * 4);
+
+        for (y = area->y; y < area->y + area->height; y++)
+                emu_convert_yuv_line (ptr + planes[0].offset + y * planes[0].pitch,
+                                      ptr + planes[1].offset + (y >> 1) * planes[1].pitch,
+                                      ptr + planes[2].offset + (y >> 1) * planes[2].pitch,
+                                      area->x, area->width,
+                                      layer->converted +
+                                      (y - area->y) * area->width * 4);
+
+        if (layer->atlas_slot == NULL)
+                emu_layer_ensure_texture (layer, layer->width, layer->height);
+
+        return emu_layer_upload_pixels (layer, area, layer->converted,
+                                        area->width * 4);
+}
+
+/*
+  Sends area of each plane of a video buffer as is, the shader converts
+  it when painting. Chroma planes are sent at half the resolution.
+*/
+static gsize
+emu_layer_upload_planes (emu_layer_t *layer,
+                         emu_buffer_t *buffer,
+                         const GdkRectangle *area)
+{
+        ClutterShader *shader = emu_layer_get_yuv_shader ();
+        gsize size = 0;
+        gint i;
+
+        /* Whatever the path, static content has to go again afterwards. */
+        layer->all_tiles_dirty = TRUE;
+
+        if (shader == NULL || !emu_layer_ensure_planes (layer, shader))
+                return emu_layer_upload_converted (layer, buffer, area);
+
+        for (i = 0; i < buffer->nb_planes; i++)
+        {
+                const emu_plane_t *plane = &buffer->planes[i];
+                gint shift = (i > 0);
+                gint x1 = area->x >> shift, y1 = area->y >> shift;
+                gint x2, y2;
+
+                x2 = MIN ((area->x + area->width + shift) >> shift,
+                          MIN (plane->width,
+                               (gint) cogl_texture_get_width (layer->planes[i])));
+                y2 = MIN ((area->y + area->height + shift) >> shift,
+                          MIN (plane->height,
+                               (gint) cogl_texture_get_height (layer->planes[i])));
+                if (x2 <= x1 || y2 <= y1)
+                        continue;
+
+                cogl_texture_set_region (layer->planes[i],
+                                         x1, y1, x1, y1,
+                                         x2 - x1, y2 - y1,
+                                         plane->width, plane->height,
+                                         COGL_PIXEL_FORMAT_A_8,
+                                         plane->pitch,
+                                         (const guint8 *) buffer->ptr +
+                                         plane->offset);
+                size += (gsize) (x2 - x1) * (y2 - y1);
+        }
+
+        UI_DEBUG ("updating %ix%i@%ix%i video planes in clutter",
+                  area->width, area->height, area->x, area->y);
+
+        return size;
+}
+
+/*
+  Transfers the latched buffer to the texture, limited to the area
+  sampled on screen and, when diffing tiles, to the tiles that changed.
+  Returns the number of bytes uploaded.
+*/
+gsize
+emu_layer_upload (emu_layer_t *layer)
+{
+        emu_buffer_t *buffer;
+        GdkRectangle area;
+        gsize size;
+
+        g_return_val_if_fail (layer != NULL, 0);
+
+        buffer = layer->pending;
+        if (buffer == NULL)
+                return 0;
+
+        layer->pending = NULL;
+        layer->buffer = buffer;
+        layer->streamed = FALSE;
+
+        emu_layer_get_sampled_area (layer, &area);
+        area.width = MIN (area.x + area.width, buffer->width) - area.x;
+        area.height = MIN (area.y + area.height, buffer->height) - area.y;
+        if (area.width <= 0 || area.height <= 0)
+                return 0;
+
+        if (buffer->format != LAZY_FORMAT_PACKED)
+                return emu_layer_upload_planes (layer, buffer, &area);
+
+        /* Back from video, the planes and their shader go. */
+        if (layer->planes[0] != COGL_INVALID_HANDLE)
+                emu_layer_update_atlas_slot (layer);
+
+        if (layer->scale_shift > 0 && layer->atlas_slot == NULL)
+                return emu_layer_upload_scaled (layer, buffer, &area);
+
+        if (layer->atlas_slot == NULL)
+        {
+#ifdef HAVE_COGL_PIXEL_BUFFER_NEW_FOR_SIZE
+                /* Tile diffs send their own runs of tiles. */
+                if (pbo_ring_size > 0 && !tile_diff &&
+                    emu_layer_upload_pbo (layer, buffer, &area,
+                                          (const guint8 *) buffer->ptr +
+                                          area.y * buffer->pitch + area.x * 4))
+                {
+                        layer->streamed = TRUE;
+                        return (gsize) area.width * area.height * 4;
+                }
+#endif
+
+                if (emu_layer_ensure_texture (layer,
+                                              layer->width, layer->height))
+                        layer->all_tiles_dirty = TRUE;
+        }
+
+        if (tile_diff && !layer->all_tiles_dirty &&
+            layer->dirty_tiles != NULL &&
+            layer->tiles_x == buffer->tiles_x &&
+            layer->tiles_y == buffer->tiles_y)
+                return emu_layer_upload_tiles (layer, buffer, &area);
+
+        size = emu_layer_upload_area (layer, buffer, &area);
+        if (tile_diff)
+                emu_layer_reset_tiles (layer, buffer, &area);
+
+        return size;
+}
+
+/* Forgets buffer, uploading it first if it is still latched. */
+void
+emu_layer_release_buffer (emu_layer_t *layer, emu_buffer_t *buffer)
+{
+        g_return_if_fail (layer != NULL);
+
+        if (layer->pending == buffer)
+                emu_layer_upload (layer);
+
+        if (layer->buffer == buffer)
+                layer->buffer = NULL;
+}
+
+/**/
+typedef enum
+{
+        EMU_QUALITY_FULL,       /* every flip uploaded at full resolution */
+        EMU_QUALITY_DROP_FLIPS, /* a layer uploads at most every other frame */
+        EMU_QUALITY_MATCH_DST,  /* large layers uploaded at their dst size */
+        EMU_QUALITY_PREVIEW,    /* large layers at half that */
+} emu_quality_t;
+
+/* Frames the upload time is averaged on before changing quality */
+#define QUALITY_HOLD_FRAMES (8)
+
+/* One per output screen, each composited on its own stage. */
+typedef struct
+{
+        guint              screen_id;
+        GHashTable        *layers_by_id;
+        GList             *layers; /* bottom to top */
+        emu_atlas_t       *atlas;
+        ClutterStage      *stage;
+
+        guint              repaint_id;
+
+        /* Content updates are paced to the screen refresh rate */
+        gint               refresh_rate;
+        GTimer            *refresh_timer;
+        guint              pacing_id;
+
+        /* Overload control */
+        GTimer            *frame_timer;
+        guint              frame;
+        gdouble            upload_time; /* ms, averaged */
+        emu_quality_t      quality;
+        guint              quality_frames;
+
+        /* Statistics */
+        guint              nb_flips;
+        guint              nb_uploads;
+        guint              nb_redundant_uploads; /* never painted */
+        guint64            upload_bytes;
+        guint              nb_dedup_flips;
+        guint64            dedup_bytes;
+        guint              nb_deferred_uploads;
+        guint              nb_streamed_uploads; /* through pixel buffers */
+} emu_mixer_t;
+
+static void
+emu_mixer_free_layer (emu_layer_t *layer,
+                      emu_mixer_t *mixer)
+{
+        clutter_container_remove_actor (CLUTTER_CONTAINER (mixer->stage),
+                                        layer->actor);
+        layer->actor = NULL;
+        emu_layer_free (layer);
+}
+
+static void
+emu_mixer_release_buffer (emu_buffer_t *buffer, emu_mixer_t *mixer)
+{
+        GList *e;
+
+        for (e = mixer->layers; e != NULL; e = e->next)
+                emu_layer_release_buffer (e->data, buffer);
+}
+
+/* Resolution a layer is uploaded at for the current quality level. */
+static gint
+emu_mixer_get_layer_scale (emu_mixer_t *mixer, emu_layer_t *layer)
+{
+        gint shift = 0;
+
+        if (mixer->quality < EMU_QUALITY_MATCH_DST ||
+            layer->atlas_slot != NULL ||
+            layer->width * layer->height < SCALE_MIN_PIXELS ||
+            layer->dst.width <= 0 || layer->dst.height <= 0)
+                return 0;
+
+        while (shift < SCALE_MAX_SHIFT &&
+               (layer->width >> (shift + 1)) >= layer->dst.width &&
+               (layer->height >> (shift + 1)) >= layer->dst.height)
+                shift++;
+
+        if (mixer->quality >= EMU_QUALITY_PREVIEW)
+                shift = MIN (shift + 1, SCALE_MAX_SHIFT);
+
+        return shift;
+}
+
+/*
+  Steps the quality down while uploads overrun the frame budget, and
+  back up once they take well under it.
+*/
+static void
+emu_mixer_update_quality (emu_mixer_t *mixer, gdouble upload_time)
+{
+        mixer->upload_time = 0.8 * mixer->upload_time + 0.2 * upload_time;
+
+        if (++mixer->quality_frames < QUALITY_HOLD_FRAMES)
+                return;
+
+        if (mixer->upload_time > frame_budget &&
+            mixer->quality < EMU_QUALITY_PREVIEW)
+                mixer->quality++;
+        else if (mixer->upload_time < frame_budget / 4.0 &&
+                 mixer->quality > EMU_QUALITY_FULL)
+                mixer->quality--;
+        else
+                return;
+
+        SERVER_DEBUG ("uploads take %.1fms, quality level %i",
+                      mixer->upload_time, mixer->quality);
+        mixer->quality_frames = 0;
+}
+
+static gboolean
+emu_mixer_pace (emu_mixer_t *mixer)
+{
+        mixer->pacing_id = 0;
+        clutter_actor_queue_redraw (CLUTTER_ACTOR (mixer->stage));
+
+        return FALSE;
+}
+
+/* Uploads latched buffers of visible layers right before painting. */
+static gboolean
+emu_mixer_repaint (emu_mixer_t *mixer)
+{
+        gfloat stage_width, stage_height;
+        GList *e;
+
+        /* Too early for this screen, latched buffers wait for the next slot. */
+        if (mixer->refresh_rate > 0)
+        {
+                gdouble wait = 1.0 / mixer->refresh_rate -
+                        g_timer_elapsed (mixer->refresh_timer, NULL);
+
+                if (wait > 0)
+                {
+                        if (mixer->pacing_id == 0)
+                                mixer->pacing_id =
+                                        g_timeout_add ((guint) (wait * 1000) + 1,
+                                                       (GSourceFunc) emu_mixer_pace,
+                                                       mixer);
+                        return TRUE;
+                }
+
+                g_timer_start (mixer->refresh_timer);
+        }
+
+        clutter_actor_get_size (CLUTTER_ACTOR (mixer->stage),
+                                &stage_width, &stage_height);
+
+        mixer->frame++;
+        g_timer_start (mixer->frame_timer);
+
+        for (e = mixer->layers; e != NULL; e = e->next)
+        {
+                emu_layer_t *layer = e->data;
+
+                /* A quality change may have to send static content again. */
+                if (layer->pending == NULL &&
+                    (frame_budget == 0 || layer->buffer == NULL))
+                        continue;
+
+                if (!emu_layer_is_visible (layer, stage_width, stage_height))
+                        continue;
+
+                if (frame_budget > 0)
+                        emu_layer_set_scale (layer,
+                                             emu_mixer_get_layer_scale (mixer,
+                                                                        layer));
+
+                if (layer->pending == NULL)
+                        continue;
+
+                /* Let the other layers through, this one waits a frame. */
+                if (mixer->quality >= EMU_QUALITY_DROP_FLIPS &&
+                    layer->upload_frame + 1 == mixer->frame)
+                {
+                        clutter_actor_queue_redraw (layer->actor);
+                        mixer->nb_deferred_uploads++;
+                        continue;
+                }
+
+                mixer->upload_bytes += emu_layer_upload (layer);
+                mixer->nb_uploads++;
+                if (layer->streamed)
+                        mixer->nb_streamed_uploads++;
+                layer->upload_frame = mixer->frame;
+        }
+
+        if (frame_budget > 0)
+                emu_mixer_update_quality (mixer,
+                                          g_timer_elapsed (mixer->frame_timer,
+                                                           NULL) * 1000);
+
+        return TRUE;
+}
+
+void
+emu_mixer_free (emu_mixer_t *mixer)
+{
+        g_return_if_fail (mixer != NULL);
+
+        if (mixer->repaint_id)
+                clutter_threads_remove_repaint_func (mixer->repaint_id);
+
+        if (mixer->pacing_id)
+                g_source_remove (mixer->pacing_id);
+
+        g_list_foreach (mixer->layers,
+                        (GFunc) emu_mixer_free_layer,
+                        mixer);
+        g_list_free (mixer->layers);
+
+        if (mixer->layers_by_id)
+                g_hash_table_destroy (mixer->layers_by_id);
+
+        if (mixer->atlas)
+                emu_atlas_free (mixer->atlas);
+
+        if (mixer->frame_timer)
+                g_timer_destroy (mixer->frame_timer);
+
+        if (mixer->refresh_timer)
+                g_timer_destroy (mixer->refresh_timer);
+
+        g_free (mixer);
+}
+
+emu_mixer_t *
+emu_mixer_new (ClutterStage *stage, guint screen_id, gint refresh_rate)
+{
+        emu_mixer_t *mixer;
+
+        g_return_val_if_fail (stage != NULL, NULL);
+
+        mixer = g_new0 (emu_mixer_t, 1);
+
+        g_return_val_if_fail (mixer != NULL, NULL);
+
+        mixer->screen_id = screen_id;
+        mixer->stage = stage;
+        mixer->frame_timer = g_timer_new ();
+        mixer->refresh_rate = refresh_rate;
+        mixer->refresh_timer = g_timer_new ();
+
+        mixer->layers_by_id = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+        mixer->repaint_id =
+                clutter_threads_add_repaint_func ((GSourceFunc) emu_mixer_repaint,
+                                                  mixer, NULL);
+
+        if (atlas_threshold > 0)
+        {
+                mixer->atlas = emu_atlas_new (ATLAS_SIZE, atlas_threshold);
+                if (mixer->atlas == NULL)
+                        goto error;
+        }
+
+        return mixer;
+
+error:
+        emu_mixer_free (mixer);
+
+        return NULL;
+}
+
+/* Sorts on zorder, a layer goes on top of the ones sharing its zorder. */
+static gint
+emu_mixer_compare_zorder (emu_layer_t *layer1,
+                          emu_layer_t *layer2)
+{
+        return (layer1->zorder >= layer2->zorder) ? 1 : -1;
+}
+
+/* Moves the actor of a layer just above the one of its predecessor. */
+static void
+emu_mixer_restack_layer (emu_mixer_t *mixer, GList *e)
+{
+        emu_layer_t *layer = e->data;
+
+        if (e->prev)
+                clutter_container_raise_child (CLUTTER_CONTAINER (mixer->stage),
+                                               layer->actor,
+                                               ((emu_layer_t *) e->prev->data)->actor);
+        else
+                clutter_container_lower_child (CLUTTER_CONTAINER (mixer->stage),
+                                               layer->actor,
+                                               NULL);
+}
+
+/*
+  Returns: negative value if error, 0 if added for the first time, 1
+  if already added.
+*/
+int
+emu_mixer_add_layer (emu_mixer_t *mixer, emu_layer_t *layer)
+{
+        g_return_val_if_fail (mixer != NULL, -1);
+        g_return_val_if_fail (layer != NULL, -1);
+
+        if (g_hash_table_lookup (mixer->layers_by_id,
+                                 GINT_TO_POINTER (layer->id)))
+        {
+                UI_DEBUG ("layer already added...");
+                return 1;
+        }
+
+        g_hash_table_insert (mixer->layers_by_id,
+                             GINT_TO_POINTER (layer->id), layer);
+
+        if (mixer->atlas)
+                emu_layer_set_atlas (layer, mixer->atlas);
+
+        mixer->layers = g_list_insert_sorted (mixer->layers, layer,
+                                              (GCompareFunc) emu_mixer_compare_zorder);
+        clutter_container_add_actor (CLUTTER_CONTAINER (mixer->stage),
+                                     layer->actor);
+        emu_mixer_restack_layer (mixer, g_list_find (mixer->layers, layer));
+
+        return 0;
+}
+
+void
+emu_mixer_del_layer (emu_mixer_t *mixer, gint id)
+{
+        emu_layer_t *layer;
+
+        g_return_if_fail (mixer != NULL);
+
+        layer = g_hash_table_lookup (mixer->layers_by_id, GINT_TO_POINTER (id));
+
+        if (layer)
+        {
+                g_hash_table_remove (mixer->layers_by_id, GINT_TO_POINTER (id));
+                mixer->layers = g_list_remove (mixer->layers, layer);
+                emu_mixer_free_layer (layer, mixer);
+        }
+}
+
+void
+emu_mixer_set_layer_zorder (emu_mixer_t *mixer,
+                            emu_layer_t *layer,
+                            guint zorder)
+{
+        g_return_if_fail (mixer != NULL);
+        g_return_if_fail (layer != NULL);
+
+        if (layer->zorder == zorder)
+                return;
+
+        mixer->layers = g_list_remove (mixer->layers, layer);
+
+        layer->zorder = zorder;
+        mixer->layers = g_list_insert_sorted (mixer->layers, layer,
+                                              (GCompareFunc) emu_mixer_compare_zorder);
+        emu_mixer_restack_layer (mixer, g_list_find (mixer->layers, layer));
+}
+
+void
+emu_mixer_flip_layer (emu_mixer_t *mixer,
+                      emu_layer_t *layer,
+                      emu_buffer_t *buffer)
+{
+        gboolean unchanged = FALSE;
+
+        g_return_if_fail (mixer != NULL);
+
+        mixer->nb_flips++;
+
+        if (tile_diff && buffer->format == LAZY_FORMAT_PACKED)
+        {
+                emu_buffer_update_tiles (buffer);
+                unchanged = !emu_layer_diff_tiles (layer, buffer);
+        }
+        /* Video frames are compared whole, planes are not tiled. */
+        else if (dedup_uploads || tile_diff)
+                unchanged = emu_layer_skip_buffer (layer, buffer,
+                                                   emu_buffer_hash (buffer));
+
+        if (unchanged)
+        {
+                mixer->nb_dedup_flips++;
+                mixer->dedup_bytes += emu_buffer_get_size (buffer);
+                return;
+        }
+
+        if (emu_layer_set_buffer (layer, buffer))
+                mixer->nb_redundant_uploads++;
+}
+
+emu_layer_t *
+emu_mixer_find_layer (emu_mixer_t *mixer, gint id)
+{
+        g_return_val_if_fail (mixer != NULL, NULL);
+
+        return (emu_layer_t *) g_hash_table_lookup (mixer->layers_by_id,
+                                                    GINT_TO_POINTER (id));
+}
+
+/**/
+#define DISPLAY_POOL_SIZE (10)
+
+/* Output screens, sharing one buffer pool. Layer ids are global. */
+typedef struct
+{
+        emu_buffer_pool_t *buffer_pool;
+        GPtrArray         *screens; /* emu_mixer_t, by screen id */
+
+        /* Last state written by emu_display_save() */
+        GByteArray        *snapshot;
+} emu_display_t;
+
+static void
+emu_display_release_buffer (emu_buffer_t *buffer, emu_display_t *display)
+{
+        guint i;
+
+        for (i = 0; i < display->screens->len; i++)
+                emu_mixer_release_buffer (buffer,
+                                          g_ptr_array_index (display->screens, i));
+}
+
+void
+emu_display_free (emu_display_t *display)
+{
+        guint i;
+
+        g_return_if_fail (display != NULL);
+
+        if (display->screens)
+        {
+                for (i = 0; i < display->screens->len; i++)
+                        emu_mixer_free (g_ptr_array_index (display->screens, i));
+                g_ptr_array_free (display->screens, TRUE);
+        }
+
+        if (display->buffer_pool)
+                emu_buffer_pool_free (display->buffer_pool);
+
+        if (display->snapshot)
+                g_byte_array_free (display->snapshot, TRUE);
+
+        g_free (display);
+}
+
+emu_display_t *
+emu_display_new (void)
+{
+        emu_display_t *display;
+
+        display = g_new0 (emu_display_t, 1);
+
+        g_return_val_if_fail (display != NULL, NULL);
+
+        display->screens = g_ptr_array_new ();
+
+        display->buffer_pool = emu_buffer_pool_new (DISPLAY_POOL_SIZE);
+        if (display->buffer_pool == NULL)
+                goto error;
+
+        display->buffer_pool->release_func = (GFunc) emu_display_release_buffer;
+        display->buffer_pool->release_data = display;
+
+        return display;
+
+error:
+        emu_display_free (display);
+
+        return NULL;
+}
+
+/* Adds the next screen, composited on stage. */
+emu_mixer_t *
+emu_display_add_screen (emu_display_t *display,
+                        ClutterStage *stage, gint refresh_rate)
+{
+        emu_mixer_t *mixer;
+
+        g_return_val_if_fail (display != NULL, NULL);
+
+        mixer = emu_mixer_new (stage, display->screens->len, refresh_rate);
+        if (mixer != NULL)
+                g_ptr_array_add (display->screens, mixer);
+
+        return mixer;
+}
+
+emu_mixer_t *
+emu_display_get_screen (emu_display_t *display, guint screen_id)
+{
+        g_return_val_if_fail (display != NULL, NULL);
+
+        if (screen_id >= display->screens->len)
+                return NULL;
+
+        return g_ptr_array_index (display->screens, screen_id);
+}
+
+/* Finds layer id on whichever screen shows it. */
+emu_layer_t *
+emu_display_find_layer (emu_display_t *display, gint id,
+                        emu_mixer_t **mixer)
+{
+        guint i;
+
+        g_return_val_if_fail (display != NULL, NULL);
+
+        for (i = 0; i < display->screens->len; i++)
+        {
+                emu_mixer_t *screen = g_ptr_array_index (display->screens, i);
+                emu_layer_t *layer = emu_mixer_find_layer (screen, id);
+
+                if (layer != NULL)
+                {
+                        if (mixer)
+                                *mixer = screen;
+                        return layer;
+                }
+        }
+
+        return NULL;
+}
+
+/* Number of layers owner has on all screens. */
+guint
+emu_display_count_layers (emu_display_t *display, guint owner)
+{
+        guint i, nb = 0;
+        GList *e;
+
+        g_return_val_if_fail (display != NULL, 0);
+
+        for (i = 0; i < display->screens->len; i++)
+        {
+                emu_mixer_t *screen = g_ptr_array_index (display->screens, i);
+
+                for (e = screen->layers; e != NULL; e = e->next)
+                        if (((emu_layer_t *) e->data)->owner == owner)
+                                nb++;
+        }
+
+        return nb;
+}
+
+/**/
+#define SNAPSHOT_MAGIC (0x4c565333) /* "LVS3" */
+#define SNAPSHOT_PERIOD (5)         /* seconds */
+#define SNAPSHOT_NO_ID (-1)
+
+/*
+  State file: a header followed by the heaps, the buffers from least
+  to most recently used and the layers of each screen from bottom to
+  top. Pixels stay
+  in the buffer files, which are mapped back on restore.
+*/
+typedef struct
+{
+        guint32 magic;
+        guint32 buffer_index;
+        guint32 heap_index;
+        guint32 nb_heaps;
+        guint32 nb_buffers;
+        guint32 nb_layers;
+} emu_snapshot_header_t;
+
+typedef struct
+{
+        guint32 id;
+        guint32 order;
+} emu_snapshot_heap_t;
+
+typedef struct
+{
+        guint32 id;
+        gint32  width;
+        gint32  height;
+        gint32  bpp;
+        gint32  pitch;
+        gint32  format;
+        gint32  heap_id;
+        guint32 heap_offset;
+        guint32 heap_order;
+} emu_snapshot_buffer_t;
+
+typedef struct
+{
+        guint32 screen_id;
+        gint32  id;
+        gint32  width;
+        gint32  height;
+        gint32  src[4];
+        gint32  dst[4];
+        guint32 opacity;
+        guint32 zorder;
+        gint32  buffer_id;
+} emu_snapshot_layer_t;
+
+static GByteArray *
+emu_display_snapshot (emu_display_t *display)
+{
+        emu_buffer_pool_t *pool = display->buffer_pool;
+        emu_snapshot_header_t header;
+        GByteArray *data;
+        GList *e;
+        guint i;
+
+        header.magic = SNAPSHOT_MAGIC;
+        header.buffer_index = pool->buffer_index;
+        header.heap_index = pool->heap_index;
+        header.nb_heaps = g_list_length (pool->heaps);
+        header.nb_buffers = g_list_length (pool->buffers);
+        header.nb_layers = 0;
+        for (i = 0; i < display->screens->len; i++)
+                header.nb_layers += g_list_length (((emu_mixer_t *)
+                                                    g_ptr_array_index (display->screens, i))->layers);
+
+        data = g_byte_array_new ();
+        g_byte_array_append (data, (guint8 *) &header, sizeof (header));
+
+        for (e = pool->heaps; e != NULL; e = e->next)
+        {
+                emu_heap_t *heap = e->data;
+                emu_snapshot_heap_t record;
+
+                record.id = heap->id;
+                record.order = heap->order;
+                g_byte_array_append (data, (guint8 *) &record, sizeof (record));
+        }
+
+        for (e = g_list_last (pool->buffers); e != NULL; e = e->prev)
+        {
+                emu_buffer_t *buffer = e->data;
+                emu_snapshot_buffer_t record;
+
+                record.id = buffer->id;
+                record.width = buffer->width;
+                record.height = buffer->height;
+                record.bpp = buffer->bpp;
+                record.pitch = buffer->pitch;
+                record.format = buffer->format;
+                record.heap_id = buffer->heap ? (gint32) buffer->heap->id : SNAPSHOT_NO_ID;
+                record.heap_offset = buffer->heap_offset;
+                record.heap_order = buffer->heap_order;
+                g_byte_array_append (data, (guint8 *) &record, sizeof (record));
+        }
+
+        for (i = 0; i < display->screens->len; i++)
+        for (e = ((emu_mixer_t *) g_ptr_array_index (display->screens, i))->layers;
+             e != NULL; e = e->next)
+        {
+                emu_layer_t *layer = e->data;
+                emu_buffer_t *buffer = layer->pending ? layer->pending : layer->buffer;
+                emu_snapshot_layer_t record;
+
+                record.screen_id = i;
+                record.id = layer->id;
+                record.width = layer->width;
+                record.height = layer->height;
+                record.src[0] = layer->src.x;
+                record.src[1] = layer->src.y;
+                record.src[2] = layer->src.width;
+                record.src[3] = layer->src.height;
+                record.dst[0] = layer->dst.x;
+                record.dst[1] = layer->dst.y;
+                record.dst[2] = layer->dst.width;
+                record.dst[3] = layer->dst.height;
+                record.opacity = layer->opacity;
+                record.zorder = layer->zorder;
+                record.buffer_id = buffer ? (gint32) buffer->id : SNAPSHOT_NO_ID;
+                g_byte_array_append (data, (guint8 *) &record, sizeof (record));
+        }
+
+        return data;
+}
+
+/* Writes the state out, unless it is the same as last time. */
+gboolean
+emu_display_save (emu_display_t *display, const gchar *filename)
+{
+        GByteArray *data;
+        GError *error = NULL;
+
+        g_return_val_if_fail (display != NULL && filename != NULL, FALSE);
+
+        data = emu_display_snapshot (display);
+
+        if (display->snapshot != NULL &&
+            display->snapshot->len == data->len &&
+            memcmp (display->snapshot->data, data->data, data->len) == 0)
+        {
+                g_byte_array_free (data, TRUE);
+                return TRUE;
+        }
+
+        if (!g_file_set_contents (filename,
+                                  (const gchar *) data->data, data->len,
+                                  &error))
+        {
+                g_warning ("Cannot save state to %s : %s",
+                           filename, error->message);
+                g_error_free (error);
+                g_byte_array_free (data, TRUE);
+                return FALSE;
+        }
+
+        if (display->snapshot)
+                g_byte_array_free (display->snapshot, TRUE);
+        display->snapshot = data;
+
+        return TRUE;
+}
+
+/*
+  Brings back the heaps, buffers and layers saved by a previous run.
+  Whatever can't be re-attached is left out, clients re-create it.
+*/
+/*
+  A stale or corrupted snapshot must not create what no request could,
+  restored records go through the checks of the requests behind them.
+*/
+static gboolean
+emu_snapshot_check_buffer (const emu_snapshot_buffer_t *record)
+{
+        lazy_ring_command_t command;
+
+        memset (&command, 0, sizeof (command));
+        if (record->format == LAZY_FORMAT_PACKED)
+        {
+                command.addpitchedbuffer.operation = LAZY_OPERATION_ADD_PITCHED_BUFFER;
+                command.addpitchedbuffer.width = record->width;
+                command.addpitchedbuffer.height = record->height;
+                command.addpitchedbuffer.bpp = record->bpp;
+                command.addpitchedbuffer.pitch = record->pitch;
+        }
+        else
+        {
+                command.addplanarbuffer.operation = LAZY_OPERATION_ADD_PLANAR_BUFFER;
+                command.addplanarbuffer.width = record->width;
+                command.addplanarbuffer.height = record->height;
+                command.addplanarbuffer.format = record->format;
+                command.addplanarbuffer.pitch = record->pitch;
+        }
+
+        return lazy_request_check (&command) == 0;
+}
+
+static gboolean
+emu_snapshot_check_layer (const emu_snapshot_layer_t *record)
+{
+        lazy_ring_command_t command;
+
+        memset (&command, 0, sizeof (command));
+        command.addlayer.operation = LAZY_OPERATION_ADD_LAYER;
+        command.addlayer.width = record->width;
+        command.addlayer.height = record->height;
+        command.addlayer.src.x = record->src[0];
+        command.addlayer.src.y = record->src[1];
+        command.addlayer.src.w = record->src[2];
+        command.addlayer.src.h = record->src[3];
+        command.addlayer.dst.x = record->dst[0];
+        command.addlayer.dst.y = record->dst[1];
+        command.addlayer.dst.w = record->dst[2];
+        command.addlayer.dst.h = record->dst[3];
+
+        /* As SET_LAYER_GEOMETRY, the input viewport stays in the layer */
+        return lazy_request_check (&command) == 0 &&
+                record->src[0] < record->width &&
+                record->src[1] < record->height &&
+                record->src[0] + record->src[2] <= record->width &&
+                record->src[1] + record->src[3] <= record->height &&
+                record->opacity <= 0xff;
+}
+
+gboolean
+emu_display_restore (emu_display_t *display, const gchar *filename)
+{
+        const emu_snapshot_header_t *header;
+        const emu_snapshot_heap_t *heaps;
+        const emu_snapshot_buffer_t *buffers;
+        const emu_snapshot_layer_t *layers;
+        gchar *contents;
+        gsize length;
+        guint i, nb_buffers = 0, nb_layers = 0;
+
+        g_return_val_if_fail (display != NULL && filename != NULL, FALSE);
+
+        if (!g_file_get_contents (filename, &contents, &length, NULL))
+                return FALSE;
+
+        header = (const emu_snapshot_header_t *) contents;
+        if (length < sizeof (*header) ||
+            header->magic != SNAPSHOT_MAGIC ||
+            length != sizeof (*header) +
+            (guint64) header->nb_heaps * sizeof (emu_snapshot_heap_t) +
+            (guint64) header->nb_buffers * sizeof (emu_snapshot_buffer_t) +
+            (guint64) header->nb_layers * sizeof (emu_snapshot_layer_t))
+        {
+                g_warning ("Ignoring malformed state file %s", filename);
+                g_free (contents);
+                return FALSE;
+        }
+
+        heaps = (const emu_snapshot_heap_t *) (header + 1);
+        buffers = (const emu_snapshot_buffer_t *) (heaps + header->nb_heaps);
+        layers = (const emu_snapshot_layer_t *) (buffers + header->nb_buffers);
+
+        /* Ids handed out before must not come back. */
+        display->buffer_pool->buffer_index = header->buffer_index;
+        display->buffer_pool->heap_index = header->heap_index;
+
+        for (i = 0; i < header->nb_heaps; i++)
+                emu_buffer_pool_attach_heap (display->buffer_pool,
+                                             heaps[i].id, heaps[i].order);
+
+        for (i = 0; i < header->nb_buffers; i++)
+        {
+                if (!emu_snapshot_check_buffer (&buffers[i]))
+                        continue;
+
+                if (emu_buffer_pool_attach_buffer (display->buffer_pool,
+                                                   buffers[i].id,
+                                                   buffers[i].width,
+                                                   buffers[i].height,
+                                                   buffers[i].bpp,
+                                                   buffers[i].pitch,
+                                                   buffers[i].format,
+                                                   buffers[i].heap_id,
+                                                   buffers[i].heap_offset,
+                                                   buffers[i].heap_order))
+                        nb_buffers++;
+        }
+
+        for (i = 0; i < header->nb_layers; i++)
+        {
+                const emu_snapshot_layer_t *record = &layers[i];
+                emu_mixer_t *mixer;
+                emu_layer_t *layer;
+                emu_buffer_t *buffer;
+
+                /* Screens may have been dropped from the command line. */
+                mixer = emu_display_get_screen (display, record->screen_id);
+                if (mixer == NULL || !emu_snapshot_check_layer (record))
+                        continue;
+
+                layer = emu_layer_new (record->id, record->width, record->height);
+                if (layer == NULL)
+                        continue;
+
+                layer->zorder = record->zorder;
+                if (emu_mixer_add_layer (mixer, layer) != 0)
+                {
+                        emu_layer_free (layer);
+                        continue;
+                }
+
+                emu_layer_set_viewport_input (layer,
+                                              record->src[0], record->src[1],
+                                              record->src[2], record->src[3]);
+                emu_layer_set_viewport_output (layer,
+                                               record->dst[0], record->dst[1],
+                                               record->dst[2], record->dst[3]);
+                emu_layer_set_opacity (layer, record->opacity);
+
+                buffer = emu_buffer_pool_find_buffer (display->buffer_pool,
+                                                      record->buffer_id);
+                if (buffer)
+                        emu_layer_set_buffer (layer, buffer);
+
+                nb_layers++;
+        }
+
+        SERVER_DEBUG ("restored %u/%u buffers and %u/%u layers from %s",
+                      nb_buffers, header->nb_buffers,
+                      nb_layers, header->nb_layers, filename);
+
+        g_free (contents);
+
+        return TRUE;
+}
+
+/**/
+#define STREAM_MAX_FPS (25)
+#define STREAM_QUEUE_MAX (2)    /* frames waiting per screen, then dropped */
+#define STREAM_MAX_SHIFT (2)    /* tiles sent down to 1/4 of their size */
+#define STREAM_HOLD_FRAMES (16) /* fast frames before sharpening again */
+#define STREAM_ZLIB_LEVEL (1)
+
+/* Composited picture of a screen, handed over to its encoder. */
+typedef struct
+{
+        guint8 *pixels; /* RGBA, NULL stops the encoder */
+        gint    width, height;
+} emu_frame_t;
+
+typedef struct _emu_sink emu_sink_t;
+
+/* Encodes the frames of one screen on its own thread. */
+typedef struct
+{
+        emu_sink_t  *sink;
+        emu_mixer_t *mixer;
+
+        GAsyncQueue *frames;
+        GThread     *thread;
+
+        /* Main thread */
+        GTimer      *timer;
+        guint        pacing_id;
+        gulong       paint_id;
+        guint        nb_dropped;
+
+        /* Encoder thread, last picture sent and its size */
+        guint8      *previous;
+        gint         width, height;
+        guint        viewer;
+        gboolean     refresh;
+        gint         scale_shift;
+        guint        hold_frames;
+        GTimer      *write_timer;
+        GByteArray  *packet;
+        guint8      *scratch;
+
+        guint        frame;
+        guint64      sent_bytes;
+} emu_stream_t;
+
+/*
+  Where the streams go: stdout, or the last viewer that connected to
+  the listening socket. Viewers are accepted on the main thread and
+  handed to the encoders, only they write.
+*/
+struct _emu_sink
+{
+        GAsyncQueue *viewers;   /* accepted sockets, as fd + 1 */
+
+        /* Under lock, connected is also read without it by the painter */
+        GMutex      *lock;
+        volatile gint connected;
+
+        /*
+          Under write_lock, only ever taken by the encoders: it is held
+          across writes to a possibly stalled viewer, which must never
+          hold up the main loop.
+        */
+        GMutex      *write_lock;
+        gint         fd;
+        guint        viewer;    /* bumped for every new viewer */
+
+        gboolean     is_socket;
+        gint         listen_fd;
+        guint        accept_id;
+        gchar       *unix_path;
+
+        GPtrArray   *streams;
+};
+
+static gboolean
+emu_stream_write (gint fd, gboolean is_socket, const guint8 *data, gsize size)
+{
+        while (size > 0)
+        {
+                gssize written;
+
+                if (is_socket)
+                        written = send (fd, data, size, MSG_NOSIGNAL);
+                else
+                        written = write (fd, data, size);
+
+                if (written < 0 && errno == EINTR)
+                        continue;
+                if (written <= 0)
+                        return FALSE;
+
+                data += written;
+                size -= written;
+        }
+
+        return TRUE;
+}
+
+/* Copies a tile to scratch, box filtered down by 2^shift. */
+static gsize
+emu_stream_gather (emu_stream_t *stream, const emu_frame_t *frame,
+                   gint x, gint y, gint width, gint height, gint shift)
+{
+        gint n = 1 << shift;
+        gint sw = (width + n - 1) >> shift, sh = (height + n - 1) >> shift;
+        guint8 *dst = stream->scratch;
+        gint i, j, u, v, k;
+
+        if (shift == 0)
+        {
+                for (j = 0; j < height; j++)
+                        memcpy (dst + j * width * 4,
+                                frame->pixels + ((y + j) * frame->width + x) * 4,
+                                width * 4);
+                return (gsize) width * height * 4;
+        }
+
+        for (j = 0; j < sh; j++)
+        {
+                for (i = 0; i < sw; i++)
+                {
+                        guint sum[4] = { 0, 0, 0, 0 }, count = 0;
+
+                        for (v = 0; v < n && (j << shift) + v < height; v++)
+                        {
+                                const guint8 *src = frame->pixels +
+                                        ((y + (j << shift) + v) * frame->width +
+                                         x + (i << shift)) * 4;
+
+                                for (u = 0; u < n && (i << shift) + u < width; u++, count++)
+                                        for (k = 0; k < 4; k++)
+                                                sum[k] += src[u * 4 + k];
+                        }
+
+                        for (k = 0; k < 4; k++)
+                                *dst++ = sum[k] / count;
+                }
+        }
+
+        return (gsize) sw * sh * 4;
+}
+
+#ifndef HAVE_LIBZ
+/* Runs of identical pixels, the usual case for emulated displays. */
+static void
+emu_stream_rle (const guint8 *data, gsize size, GByteArray *out)
+{
+        const guint32 *pixels = (const guint32 *) data;
+        gsize i = 0, nb_pixels = size / 4;
+
+        while (i < nb_pixels)
+        {
+                guint8 count = 0;
+
+                while (i + count + 1 < nb_pixels && count < 0xff &&
+                       pixels[i + count + 1] == pixels[i])
+                        count++;
+
+                g_byte_array_append (out, &count, 1);
+                g_byte_array_append (out, (const guint8 *) &pixels[i], 4);
+                i += count + 1;
+        }
+}
+#endif
+
+/* Appends the tile in scratch to the packet, raw if it doesn't shrink. */
+static void
+emu_stream_append_tile (emu_stream_t *stream, lazy_stream_tile_t *tile,
+                        gsize size)
+{
+        GByteArray *packet = stream->packet;
+        guint header = packet->len, offset = header + sizeof (*tile);
+
+        g_byte_array_set_size (packet, offset);
+
+#ifdef HAVE_LIBZ
+        {
+                uLongf zsize = compressBound (size);
+
+                g_byte_array_set_size (packet, offset + zsize);
+                if (compress2 (packet->data + offset, &zsize,
+                               stream->scratch, size,
+                               STREAM_ZLIB_LEVEL) == Z_OK && zsize < size)
+                {
+                        tile->encoding = LAZY_STREAM_ENCODING_ZLIB;
+                        g_byte_array_set_size (packet, offset + zsize);
+                }
+                else
+                        g_byte_array_set_size (packet, offset);
+        }
+#else
+        emu_stream_rle (stream->scratch, size, packet);
+        if (packet->len - offset < size)
+                tile->encoding = LAZY_STREAM_ENCODING_RLE;
+        else
+                g_byte_array_set_size (packet, offset);
+#endif
+
+        if (packet->len == offset)
+        {
+                tile->encoding = LAZY_STREAM_ENCODING_RAW;
+                g_byte_array_append (packet, stream->scratch, size);
+        }
+
+        tile->size = packet->len - offset;
+        memcpy (packet->data + header, tile, sizeof (*tile));
+}
+
+/* Builds the packet of the tiles that differ from the last picture sent. */
+static guint
+emu_stream_encode (emu_stream_t *stream, const emu_frame_t *frame,
+                   gboolean keyframe)
+{
+        lazy_stream_frame_t header;
+        gint x, y, j;
+
+        if (stream->width != frame->width || stream->height != frame->height)
+        {
+                stream->previous = g_realloc (stream->previous,
+                                              (gsize) frame->width * frame->height * 4);
+                stream->width = frame->width;
+                stream->height = frame->height;
+                keyframe = TRUE;
+        }
+
+        memset (&header, 0, sizeof (header));
+        header.magic = LAZY_STREAM_MAGIC;
+        header.screen_id = stream->mixer->screen_id;
+        header.frame = stream->frame++;
+        header.width = frame->width;
+        header.height = frame->height;
+
+        g_byte_array_set_size (stream->packet, sizeof (header));
+
+        for (y = 0; y < frame->height; y += LAZY_STREAM_TILE_SIZE)
+        {
+                for (x = 0; x < frame->width; x += LAZY_STREAM_TILE_SIZE)
+                {
+                        gint width = MIN (LAZY_STREAM_TILE_SIZE, frame->width - x);
+                        gint height = MIN (LAZY_STREAM_TILE_SIZE, frame->height - y);
+                        gboolean changed = keyframe;
+                        lazy_stream_tile_t tile;
+
+                        for (j = 0; j < height; j++)
+                        {
+                                gsize offset = ((gsize) (y + j) * frame->width + x) * 4;
+
+                                if (!changed &&
+                                    memcmp (stream->previous + offset,
+                                            frame->pixels + offset, width * 4) == 0)
+                                        continue;
+
+                                changed = TRUE;
+                                memcpy (stream->previous + offset,
+                                        frame->pixels + offset, width * 4);
+                        }
+
+                        if (!changed)
+                                continue;
+
+                        tile.x = x;
+                        tile.y = y;
+                        tile.w = width;
+                        tile.h = height;
+                        tile.scale_shift = stream->scale_shift;
+                        emu_stream_append_tile (stream, &tile,
+                                                emu_stream_gather (stream, frame,
+                                                                   x, y,
+                                                                   width, height,
+                                                                   stream->scale_shift));
+                        header.nb_tiles++;
+                }
+        }
+
+        memcpy (stream->packet->data, &header, sizeof (header));
+
+        return header.nb_tiles;
+}
+
+/*
+  Sends tiles at a lower resolution while writing a frame takes longer
+  than the frame period, sharpening back once the link keeps up.
+*/
+static void
+emu_stream_update_quality (emu_stream_t *stream, gdouble write_time)
+{
+        gdouble period = 1.0 / STREAM_MAX_FPS;
+
+        if (write_time > period && stream->scale_shift < STREAM_MAX_SHIFT)
+        {
+                stream->scale_shift++;
+                stream->hold_frames = 0;
+        }
+        else if (write_time < period / 4 && stream->scale_shift > 0 &&
+                 ++stream->hold_frames >= STREAM_HOLD_FRAMES)
+        {
+                stream->scale_shift--;
+                stream->hold_frames = 0;
+                stream->refresh = TRUE;
+        }
+        else
+                return;
+
+        SERVER_DEBUG ("stream %u: %.1fms per frame, tiles at 1/%i",
+                      stream->mixer->screen_id, write_time * 1000,
+                      1 << stream->scale_shift);
+}
+
+static void
+emu_stream_send (emu_stream_t *stream, const emu_frame_t *frame)
+{
+        emu_sink_t *sink = stream->sink;
+        gpointer viewer;
+        guint serial;
+        gboolean sent = FALSE;
+
+        g_mutex_lock (sink->write_lock);
+        while ((viewer = g_async_queue_try_pop (sink->viewers)) != NULL)
+        {
+                if (sink->fd >= 0)
+                        close (sink->fd);
+                sink->fd = GPOINTER_TO_INT (viewer) - 1;
+                sink->viewer++;
+        }
+        serial = sink->viewer;
+        if (sink->fd < 0)
+                serial = 0;
+        g_mutex_unlock (sink->write_lock);
+
+        if (serial == 0)
+                return;
+
+        /* A new viewer has nothing to diff against. */
+        emu_stream_encode (stream, frame,
+                           stream->viewer != serial || stream->refresh);
+        stream->refresh = FALSE;
+
+        g_mutex_lock (sink->write_lock);
+        if (sink->viewer == serial && sink->fd >= 0)
+        {
+                g_timer_start (stream->write_timer);
+                sent = emu_stream_write (sink->fd, sink->is_socket,
+                                         stream->packet->data,
+                                         stream->packet->len);
+                if (!sent)
+                {
+                        SERVER_DEBUG ("viewer gone: %s", strerror (errno));
+                        if (sink->is_socket)
+                                close (sink->fd);
+                        sink->fd = -1;
+
+                        /* Unless a viewer was accepted meanwhile */
+                        g_mutex_lock (sink->lock);
+                        if (g_async_queue_length (sink->viewers) <= 0)
+                                g_atomic_int_set (&sink->connected, 0);
+                        g_mutex_unlock (sink->lock);
+                }
+        }
+        g_mutex_unlock (sink->write_lock);
+
+        if (!sent)
+                return;
+
+        stream->viewer = serial;
+        stream->sent_bytes += stream->packet->len;
+        emu_stream_update_quality (stream,
+                                   g_timer_elapsed (stream->write_timer, NULL));
+}
+
+static gpointer
+emu_stream_thread (emu_stream_t *stream)
+{
+        while (TRUE)
+        {
+                emu_frame_t *frame = g_async_queue_pop (stream->frames);
+                gboolean stop = (frame->pixels == NULL);
+
+                if (!stop)
+                        emu_stream_send (stream, frame);
+
+                g_free (frame->pixels);
+                g_free (frame);
+
+                if (stop)
+                        break;
+        }
+
+        return NULL;
+}
+
+static gboolean
+emu_stream_pace (emu_stream_t *stream)
+{
+        stream->pacing_id = 0;
+        clutter_actor_queue_redraw (CLUTTER_ACTOR (stream->mixer->stage));
+
+        return FALSE;
+}
+
+/*
+  Grabs the stage once painted. Frames come at most STREAM_MAX_FPS and
+  are dropped while the encoder lags, the paint never waits for it.
+*/
+static void
+emu_stream_paint (ClutterActor *stage, emu_stream_t *stream)
+{
+        emu_frame_t *frame;
+        gfloat width, height;
+
+        if (!g_atomic_int_get (&stream->sink->connected))
+                return;
+
+        if (g_timer_elapsed (stream->timer, NULL) < 1.0 / STREAM_MAX_FPS ||
+            g_async_queue_length (stream->frames) >= STREAM_QUEUE_MAX)
+        {
+                /* The last picture must get out even if nothing repaints. */
+                if (stream->pacing_id == 0)
+                        stream->pacing_id =
+                                g_timeout_add (1000 / STREAM_MAX_FPS,
+                                               (GSourceFunc) emu_stream_pace,
+                                               stream);
+                if (g_async_queue_length (stream->frames) >= STREAM_QUEUE_MAX)
+                        stream->nb_dropped++;
+                return;
+        }
+
+        clutter_actor_get_size (stage, &width, &height);
+        if (width < 1 || height < 1)
+                return;
+
+        frame = g_new0 (emu_frame_t, 1);
+        frame->width = width;
+        frame->height = height;
+        frame->pixels = clutter_stage_read_pixels (CLUTTER_STAGE (stage), 0, 0,
+                                                   frame->width, frame->height);
+        if (frame->pixels == NULL)
+        {
+                g_free (frame);
+                return;
+        }
+
+        g_async_queue_push (stream->frames, frame);
+        g_timer_start (stream->timer);
+}
+
+static void
+emu_stream_free (emu_stream_t *stream)
+{
+        if (stream->thread)
+        {
+                emu_frame_t *stop = g_new0 (emu_frame_t, 1);
+
+                g_async_queue_push (stream->frames, stop);
+                g_thread_join (stream->thread);
+        }
+
+        if (stream->paint_id)
+                g_signal_handler_disconnect (stream->mixer->stage,
+                                             stream->paint_id);
+
+        if (stream->pacing_id)
+                g_source_remove (stream->pacing_id);
+
+        if (stream->frames)
+        {
+                emu_frame_t *frame;
+
+                while ((frame = g_async_queue_try_pop (stream->frames)) != NULL)
+                {
+                        g_free (frame->pixels);
+                        g_free (frame);
+                }
+                g_async_queue_unref (stream->frames);
+        }
+
+        if (stream->timer)
+                g_timer_destroy (stream->timer);
+        if (stream->write_timer)
+                g_timer_destroy (stream->write_timer);
+        if (stream->packet)
+                g_byte_array_free (stream->packet, TRUE);
+
+        g_free (stream->previous);
+        g_free (stream->scratch);
+        g_free (stream);
+}
+
+static emu_stream_t *
+emu_stream_new (emu_sink_t *sink, emu_mixer_t *mixer)
+{
+        emu_stream_t *stream;
+        GError *error = NULL;
+
+        stream = g_new0 (emu_stream_t, 1);
+
+        g_return_val_if_fail (stream != NULL, NULL);
+
+        stream->sink = sink;
+        stream->mixer = mixer;
+        stream->frames = g_async_queue_new ();
+        stream->timer = g_timer_new ();
+        stream->write_timer = g_timer_new ();
+        stream->packet = g_byte_array_new ();
+        stream->scratch = g_malloc (LAZY_STREAM_TILE_SIZE *
+                                    LAZY_STREAM_TILE_SIZE * 4);
+
+        stream->thread = g_thread_create ((GThreadFunc) emu_stream_thread,
+                                          stream, TRUE, &error);
+        if (stream->thread == NULL)
+        {
+                g_warning ("Cannot start stream encoder: %s", error->message);
+                g_error_free (error);
+                emu_stream_free (stream);
+                return NULL;
+        }
+
+        stream->paint_id = g_signal_connect_after (mixer->stage, "paint",
+                                                   G_CALLBACK (emu_stream_paint),
+                                                   stream);
+
+        return stream;
+}
+
+static gboolean
+emu_sink_accept (GIOChannel *source, GIOCondition condition,
+                 emu_sink_t *sink)
+{
+        gint fd;
+        guint i;
+
+        fd = accept (sink->listen_fd, NULL, NULL);
+        if (fd < 0)
+                return TRUE;
+
+        SERVER_DEBUG ("New stream viewer...");
+
+        /* Never lost to an encoder dropping the previous viewer */
+        g_mutex_lock (sink->lock);
+        g_async_queue_push (sink->viewers, GINT_TO_POINTER (fd + 1));
+        g_atomic_int_set (&sink->connected, 1);
+        g_mutex_unlock (sink->lock);
+
+        /* Everything goes to the newcomer, even static screens. */
+        for (i = 0; i < sink->streams->len; i++)
+        {
+                emu_stream_t *stream = g_ptr_array_index (sink->streams, i);
+
+                clutter_actor_queue_redraw (CLUTTER_ACTOR (stream->mixer->stage));
+        }
+
+        return TRUE;
+}
+
+void
+emu_sink_free (emu_sink_t *sink)
+{
+        gpointer viewer;
+
+        g_return_if_fail (sink != NULL);
+
+        if (sink->streams)
+        {
+                g_ptr_array_foreach (sink->streams, (GFunc) emu_stream_free, NULL);
+                g_ptr_array_free (sink->streams, TRUE);
+        }
+
+        if (sink->accept_id)
+                g_source_remove (sink->accept_id);
+
+        if (sink->viewers)
+        {
+                while ((viewer = g_async_queue_try_pop (sink->viewers)) != NULL)
+                        close (GPOINTER_TO_INT (viewer) - 1);
+                g_async_queue_unref (sink->viewers);
+        }
+
+        if (sink->is_socket && sink->fd >= 0)
+                close (sink->fd);
+
+        if (sink->listen_fd >= 0)
+                close (sink->listen_fd);
+
+        if (sink->unix_path)
+        {
+                unlink (sink->unix_path);
+                g_free (sink->unix_path);
+        }
+
+        if (sink->lock)
+                g_mutex_free (sink->lock);
+        if (sink->write_lock)
+                g_mutex_free (sink->write_lock);
+
+        g_free (sink);
+}
+
+/*
+  Opens the sink named by destination: "-" for stdout, "unix:PATH" to
+  listen on a local socket, or a TCP port to listen on.
+*/
+emu_sink_t *
+emu_sink_new (const gchar *destination)
+{
+        emu_sink_t *sink;
+        GIOChannel *ioc;
+        gint on = 1;
+
+        g_return_val_if_fail (destination != NULL, NULL);
+
+        sink = g_new0 (emu_sink_t, 1);
+
+        g_return_val_if_fail (sink != NULL, NULL);
+
+        sink->lock = g_mutex_new ();
+        sink->write_lock = g_mutex_new ();
+        sink->viewers = g_async_queue_new ();
+        sink->streams = g_ptr_array_new ();
+        sink->fd = -1;
+        sink->listen_fd = -1;
+
+        if (strcmp (destination, "-") == 0)
+        {
+                sink->fd = STDOUT_FILENO;
+                sink->viewer = 1;
+                sink->connected = 1;
+                return sink;
+        }
+
+        sink->is_socket = TRUE;
+
+        if (g_str_has_prefix (destination, "unix:"))
+        {
+                struct sockaddr_un addr;
+
+                memset (&addr, 0, sizeof (addr));
+                addr.sun_family = AF_UNIX;
+                g_strlcpy (addr.sun_path, destination + strlen ("unix:"),
+                           sizeof (addr.sun_path));
+
+                sink->listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+                if (sink->listen_fd < 0)
+                        goto error;
+
+                unlink (addr.sun_path);
+                if (bind (sink->listen_fd, (struct sockaddr *) &addr,
+                          sizeof (addr)) < 0)
+                        goto error;
+                sink->unix_path = g_strdup (addr.sun_path);
+        }
+        else
+        {
+                struct sockaddr_in addr;
+                gchar *end;
+                glong port = strtol (destination, &end, 10);
+
+                if (*end != '\0' || port <= 0 || port > 0xffff)
+                {
+                        errno = EINVAL;
+                        goto error;
+                }
+
+                memset (&addr, 0, sizeof (addr));
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons (port);
+                addr.sin_addr.s_addr = htonl (INADDR_ANY);
+
+                sink->listen_fd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+                if (sink->listen_fd < 0)
+                        goto error;
+
+                setsockopt (sink->listen_fd, SOL_SOCKET, SO_REUSEADDR,
+                            &on, sizeof (on));
+                if (bind (sink->listen_fd, (struct sockaddr *) &addr,
+                          sizeof (addr)) < 0)
+                        goto error;
+        }
+
+        if (listen (sink->listen_fd, 1) < 0)
+                goto error;
+
+        ioc = g_io_channel_unix_new (sink->listen_fd);
+        sink->accept_id = g_io_add_watch (ioc, G_IO_IN,
+                                          (GIOFunc) emu_sink_accept, sink);
+        g_io_channel_unref (ioc);
+
+        return sink;
+
+error:
+        g_warning ("Cannot stream to %s: %s", destination, strerror (errno));
+        emu_sink_free (sink);
+
+        return NULL;
+}
+
+gboolean
+emu_sink_add_screen (emu_sink_t *sink, emu_mixer_t *mixer)
+{
+        emu_stream_t *stream;
+
+        g_return_val_if_fail (sink != NULL && mixer != NULL, FALSE);
+
+        stream = emu_stream_new (sink, mixer);
+        if (stream == NULL)
+                return FALSE;
+
+        g_ptr_array_add (sink->streams, stream);
+
+        return TRUE;
+}
+
+/**/
+typedef struct
+{
+        gchar      *filename;
+        lazy_ring_t *ptr;
+        gint        fd;
+
+        guint id;
+} emu_ring_t;
+
+void
+emu_ring_free (emu_ring_t *ring)
+{
+        g_return_if_fail (ring != NULL);
+
+        if (ring->ptr != NULL && (gpointer) ring->ptr != MAP_FAILED)
+                munmap (ring->ptr, sizeof (lazy_ring_t));
+
+        if (ring->fd >= 0)
+                close (ring->fd);
+
+        if (ring->filename)
+        {
+                unlink (ring->filename);
+                g_free (ring->filename);
+        }
+
+        g_free (ring);
+}
+
+emu_ring_t *
+emu_ring_new (guint id)
+{
+        emu_ring_t *ring;
+
+        ring = g_new0 (emu_ring_t, 1);
+
+        g_return_val_if_fail (ring != NULL, NULL);
+
+        ring->filename = g_strdup_printf ("%s/r%x", path_to_buffers, id);
+        ring->id = id;
+
+        ring->fd = open (ring->filename, O_CREAT | O_TRUNC | O_RDWR,
+                         S_IRUSR | S_IWUSR | S_IRGRP |
+                         S_IWGRP | S_IROTH | S_IWOTH);
+        if (ring->fd < 0)
+        {
+                SERVER_ERROR ("Cannot open %s : %s",
+                              ring->filename, strerror (errno));
+                goto error;
+        }
+
+        if (ftruncate (ring->fd, sizeof (lazy_ring_t)) < 0)
+        {
+                SERVER_ERROR ("Cannot resize %s : %s",
+                              ring->filename, strerror (errno));
+                goto error;
+        }
+
+        ring->ptr = mmap (NULL,
+                          sizeof (lazy_ring_t),
+                          PROT_READ | PROT_WRITE, MAP_SHARED,
+                          ring->fd, 0);
+        if (ring->ptr == NULL ||
+            (gpointer) ring->ptr == MAP_FAILED)
+        {
+                SERVER_ERROR ("Cannot mmap %s : %s",
+                              ring->filename, strerror (errno));
+                goto error;
+        }
+
+        /* Nothing to consume yet, the first push has to kick us. */
+        g_atomic_int_set ((volatile gint *) &ring->ptr->command_index.waiting,
+                          1);
+
+        return ring;
+
+error:
+        emu_ring_free (ring);
+
+        return NULL;
+}
+
+/**/
+/* Unread replies past which a client is no longer served. */
+#define CONNECTION_OUTPUT_MAX (64 * 1024)
+
+typedef struct
+{
+        guint          id;
+        GIOChannel    *channel;
+        emu_display_t *display;
+        emu_ring_t    *ring;
+
+        /* Request being received, read without blocking */
+        lazy_request_t input;
+        gsize          input_length;
+
+        /* Replies not taken by the socket yet, flushed on G_IO_OUT */
+        GByteArray    *output;
+        guint          output_id;
+        gboolean       output_full; /* parked until output drains */
+
+        /* Scheduling, see server_schedule() */
+        guint          watch_id;
+        gint           deficit;
+        gboolean       ring_pending; /* commands left when out of turn */
+} emu_connection_t;
+
+void
+emu_connection_free (emu_connection_t *connection)
+{
+        g_return_if_fail (connection != NULL);
+
+        if (connection->watch_id)
+                g_source_remove (connection->watch_id);
+
+        if (connection->output_id)
+                g_source_remove (connection->output_id);
+
+        if (connection->output)
+                g_byte_array_free (connection->output, TRUE);
+
+        if (connection->ring)
+                emu_ring_free (connection->ring);
+
+        if (connection->channel)
+                g_io_channel_unref (connection->channel);
+
+        g_free (connection);
+}
+
+emu_connection_t *
+emu_connection_new (guint id, GIOChannel *channel, emu_display_t *display)
+{
+        emu_connection_t *connection;
+
+        g_return_val_if_fail (channel != NULL, NULL);
+        g_return_val_if_fail (display != NULL, NULL);
+
+        connection = g_new0 (emu_connection_t, 1);
+
+        g_return_val_if_fail (connection != NULL, NULL);
+
+        connection->id = id;
+        connection->channel = channel;
+        connection->display = display;
+        connection->output = g_byte_array_new ();
+
+        return connection;
+}
+
+guint connection_id = 0;
+guint connection_index = 0;
+guint ring_index = 0;
+
+/* Connections with requests waiting for their turn */
+GQueue *ready_connections = NULL;
+guint   scheduler_id = 0;
+
+/*
+  Quotas, checked before a client gets more. Buffers it adds to a full
+  pool replace its own least recently used ones rather than others'.
+*/
+static gboolean
+server_quota_buffer (emu_connection_t *connection, gsize size)
+{
+        emu_buffer_pool_t *pool = connection->display->buffer_pool;
+        emu_buffer_t *victim;
+        gsize nb_bytes;
+
+        /* A full pool never makes room with the buffers of others. */
+        if (!emu_buffer_pool_find_victim (pool, connection->id, &victim))
+        {
+                SERVER_DEBUG ("client %u has no buffer to make room with",
+                              connection->id);
+                return FALSE;
+        }
+
+        emu_buffer_pool_get_usage (pool, connection->id, &nb_bytes);
+        if (victim != NULL && victim->owner == connection->id)
+                nb_bytes -= emu_buffer_get_footprint (victim);
+
+        if (client_kbytes > 0 &&
+            (nb_bytes + size) / 1024 > (gsize) client_kbytes)
+        {
+                SERVER_DEBUG ("client %u over its %i KiB of buffers",
+                              connection->id, client_kbytes);
+                return FALSE;
+        }
+
+        if (victim != NULL)
+                emu_buffer_pool_del_buffer (pool, victim->id);
+
+        return TRUE;
+}
+
+static gboolean
+server_quota_layer (emu_connection_t *connection, gint layer_id)
+{
+        emu_display_t *display = connection->display;
+
+        if (client_layers > 0 &&
+            emu_display_find_layer (display, layer_id, NULL) == NULL &&
+            emu_display_count_layers (display, connection->id) >=
+            (guint) client_layers)
+        {
+                SERVER_DEBUG ("client %u over its %i layers",
+                              connection->id, client_layers);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Memory a heap buffer of that layout will hold. */
+static gsize
+server_heap_buffer_size (lazy_format_t format, gint width, gint height,
+                         gint bpp, gint pitch)
+{
+        emu_plane_t planes[LAZY_MAX_PLANES];
+        gint nb_planes;
+
+        return (gsize) 1 << emu_heap_get_order (emu_format_get_planes (format,
+                                                                       width, height,
+                                                                       bpp, pitch,
+                                                                       planes,
+                                                                       &nb_planes));
+}
+
+/*
+  Sends what the socket takes of the queued replies, without blocking.
+  FALSE when the connection is over.
+*/
+static gboolean
+server_output_flush (emu_connection_t *connection)
+{
+        GByteArray *output = connection->output;
+        gsize sent = 0;
+        gssize written;
+
+        while (sent < output->len)
+        {
+                written = send (g_io_channel_unix_get_fd (connection->channel),
+                                output->data + sent, output->len - sent,
+                                MSG_DONTWAIT);
+                if (written < 0 && errno == EINTR)
+                        continue;
+                if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                if (written <= 0)
+                {
+                        SERVER_ERROR ("Cannot ack operation...");
+                        return FALSE;
+                }
+
+                sent += written;
+        }
+
+        g_byte_array_remove_range (output, 0, sent);
+
+        return TRUE;
+}
+
+static gboolean
+server_output_callback (GIOChannel *source,
+                        GIOCondition condition,
+                        emu_connection_t *connection);
+
+/*
+  Queues a reply behind the ones not sent yet, a client that does not
+  read them only fills its own queue. FALSE when the connection is over.
+*/
+static gboolean
+server_input_send_result (emu_connection_t *connection,
+                          const void *result, guint length)
+{
+        g_byte_array_append (connection->output, result, length);
+
+        if (connection->output_id != 0)
+                return TRUE;
+
+        if (!server_output_flush (connection))
+                return FALSE;
+
+        if (connection->output->len > 0)
+                connection->output_id = g_io_add_watch (connection->channel,
+                                                        G_IO_OUT | G_IO_HUP | G_IO_ERR,
+                                                        (GIOFunc) server_output_callback,
+                                                        connection);
+
+        return TRUE;
+}
+
+/*
+  Whether connection may use what owner refers to. Restored objects
+  have no owner, the first connection to use them claims them.
+*/
+static gboolean
+server_check_owner (emu_connection_t *connection, guint *owner)
+{
+        if (*owner == 0)
+                *owner = connection->id;
+
+        if (*owner != connection->id)
+        {
+                SERVER_DEBUG ("client %u cannot use what client %u added",
+                              connection->id, *owner);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+static void
+server_process_addlayer (emu_connection_t *connection,
+                         guint screen_id,
+                         const lazy_operation_addlayer_t *operation,
+                         lazy_operation_addlayer_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_mixer_t *mixer, *owner = NULL;
+        emu_layer_t *layer;
+        emu_buffer_t *buffer;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("add layer %ix%i@%ix%i -> %ix%i@%ix%i - buffer=%i screen=%i",
+                      operation->src.w, operation->src.h,
+                      operation->src.x, operation->src.y,
+                      operation->dst.w, operation->dst.h,
+                      operation->dst.x, operation->dst.y,
+                      operation->buffer_id, screen_id);
+
+        mixer = emu_display_get_screen (display, screen_id);
+        if (mixer == NULL)
+        {
+                SERVER_ERROR ("Cannot find screen %i...", screen_id);
+                return;
+        }
+
+
+        buffer = emu_buffer_pool_find_buffer (display->buffer_pool, operation->buffer_id);
+        if (buffer == NULL)
+        {
+                SERVER_ERROR ("Cannot find buffer %i in mixer...",
+                              operation->buffer_id);
+                return;
+        }
+
+        if (!server_check_owner (connection, &buffer->owner))
+                return;
+
+        if (operation->src.x >= buffer->width ||
+            operation->src.y >= buffer->height ||
+            (operation->src.x + operation->src.w) > buffer->width ||
+            (operation->src.y + operation->src.h) > buffer->height)
+        {
+                SERVER_ERROR ("Input viewport is outside of buffer %i...",
+                              operation->buffer_id);
+                return;
+        }
+
+        layer = emu_display_find_layer (display, operation->layer_id, &owner);
+        if (layer != NULL && !server_check_owner (connection, &layer->owner))
+                return;
+
+        if (layer != NULL && owner != mixer)
+        {
+                SERVER_DEBUG ("\tmoving layer %i to screen %i",
+                              operation->layer_id, mixer->screen_id);
+                emu_mixer_del_layer (owner, operation->layer_id);
+                layer = NULL;
+        }
+
+        if (layer == NULL && !server_quota_layer (connection, operation->layer_id))
+                return;
+
+        if (layer != NULL)
+        {
+                SERVER_DEBUG ("\treconfiguring layer %i in place",
+                              operation->layer_id);
+                emu_layer_set_size (layer, operation->width, operation->height);
+        }
+        else
+        {
+                layer = emu_layer_new (operation->layer_id,
+                                       operation->width,
+                                       operation->height);
+
+                if (layer == NULL)
+                {
+                        SERVER_ERROR ("Cannot create new layer%i (%ix%i)",
+                                      operation->layer_id,
+                                      operation->width, operation->height);
+                        return;
+                }
+                layer->owner = connection->id;
+
+                if (emu_mixer_add_layer (mixer, layer) != 0)
+                {
+                        emu_layer_free (layer);
+                        SERVER_ERROR ("Cannot add layer%i to mixer...",
+                                      operation->layer_id);
+                        return;
+                }
+        }
+
+        emu_layer_set_viewport_input (layer,
+                                      operation->src.x, operation->src.y,
+                                      operation->src.w, operation->src.h);
+        /* Lands at once, cutting any transition short */
+        emu_layer_animate_viewport_output (layer,
+                                           operation->dst.x, operation->dst.y,
+                                           operation->dst.w, operation->dst.h,
+                                           0, CLUTTER_LINEAR);
+
+        emu_mixer_flip_layer (mixer, layer, buffer);
+        res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+}
+
+static void
+server_process_dellayer (emu_connection_t *connection,
+                         const lazy_operation_dellayer_t *operation,
+                         lazy_operation_dellayer_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_mixer_t *mixer;
+        emu_layer_t *layer;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("del layer %i", operation->layer_id);
+
+        layer = emu_display_find_layer (display, operation->layer_id, &mixer);
+        if (layer != NULL)
+        {
+                if (!server_check_owner (connection, &layer->owner))
+                        return;
+
+                emu_mixer_del_layer (mixer, operation->layer_id);
+        }
+        res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+}
+
+static void
+server_process_fliplayer (emu_connection_t *connection,
+                          const lazy_operation_fliplayer_t *operation,
+                          lazy_operation_fliplayer_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_mixer_t *mixer;
+        emu_layer_t *layer;
+        emu_buffer_t *buffer;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("flip layer %i", operation->layer_id);
+
+        layer = emu_display_find_layer (display, operation->layer_id, &mixer);
+        if (layer == NULL)
+        {
+                SERVER_ERROR ("Cannot find layer %i in mixer...",
+                              operation->layer_id);
+                return;
+        }
+
+        buffer = emu_buffer_pool_find_buffer (display->buffer_pool, operation->buffer_id);
+        if (buffer == NULL)
+        {
+                SERVER_ERROR ("Cannot find buffer %i in mixer...",
+                              operation->buffer_id);
+                return;
+        }
+
+        if (!server_check_owner (connection, &layer->owner) ||
+            !server_check_owner (connection, &buffer->owner))
+                return;
+
+        SERVER_DEBUG ("Flipping to buffer %x", buffer->id);
+        emu_mixer_flip_layer (mixer, layer, buffer);
+        res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+}
+
+static void
+server_process_addbuffer (emu_connection_t *connection,
+                          const lazy_operation_addbuffer_t *operation,
+                          lazy_operation_addbuffer_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_buffer_t *buffer;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("add buffer %ix%i bpp=%i",
+                      operation->width, operation->height, operation->bpp);
+
+        if (!server_quota_buffer (connection,
+                                  (gsize) operation->width *
+                                  operation->height * operation->bpp))
+                return;
+
+        buffer = emu_buffer_pool_add_buffer (display->buffer_pool,
+                                             operation->width, operation->height,
+                                             operation->bpp);
+        if (buffer != NULL)
+        {
+                buffer->owner = connection->id;
+                SERVER_DEBUG ("\tbuffer=%p file=%s", buffer, buffer->filename);
+
+                res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+                res_operation->buffer_id = buffer->id;
+        }
+        else
+        {
+                SERVER_ERROR ("Cannot add buffer to pool...");
+        }
+}
+
+static void
+server_process_addpitchedbuffer (emu_connection_t *connection,
+                                 const lazy_operation_addpitchedbuffer_t *operation,
+                                 lazy_operation_addpitchedbuffer_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_buffer_t *buffer;
+        lazy_uint_t pitch;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("add pitched buffer %ix%i bpp=%i pitch=%i",
+                      operation->width, operation->height,
+                      operation->bpp, operation->pitch);
+
+        pitch = operation->pitch ? operation->pitch
+                : operation->width * operation->bpp;
+        if (pitch < operation->width * operation->bpp)
+        {
+                SERVER_ERROR ("Pitch %i too small for %ix%i bpp=%i...",
+                              pitch, operation->width, operation->height,
+                              operation->bpp);
+                return;
+        }
+
+        if (!server_quota_buffer (connection,
+                                  server_heap_buffer_size (LAZY_FORMAT_PACKED,
+                                                           operation->width,
+                                                           operation->height,
+                                                           operation->bpp,
+                                                           pitch)))
+                return;
+
+        buffer = emu_buffer_pool_add_pitched_buffer (display->buffer_pool,
+                                                     operation->width,
+                                                     operation->height,
+                                                     operation->bpp,
+                                                     pitch);
+        if (buffer != NULL)
+        {
+                buffer->owner = connection->id;
+                SERVER_DEBUG ("\tbuffer=%p file=%s offset=%x",
+                              buffer, buffer->filename, buffer->heap_offset);
+
+                res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+                res_operation->buffer_id = buffer->id;
+                res_operation->heap_id = buffer->heap->id;
+                res_operation->offset = buffer->heap_offset;
+                res_operation->pitch = buffer->pitch;
+        }
+        else
+        {
+                SERVER_ERROR ("Cannot add pitched buffer to pool...");
+        }
+}
+
+static void
+server_process_addplanarbuffer (emu_connection_t *connection,
+                                const lazy_operation_addplanarbuffer_t *operation,
+                                lazy_operation_addplanarbuffer_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_buffer_t *buffer;
+        lazy_uint_t pitch;
+        gint i;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("add planar buffer %ix%i format=%i pitch=%i",
+                      operation->width, operation->height,
+                      operation->format, operation->pitch);
+
+        if (operation->format != LAZY_FORMAT_I420 &&
+            operation->format != LAZY_FORMAT_YV12)
+        {
+                SERVER_ERROR ("Unknown planar format %i...",
+                              operation->format);
+                return;
+        }
+
+        pitch = operation->pitch ? operation->pitch : operation->width;
+        if (pitch < operation->width)
+        {
+                SERVER_ERROR ("Pitch %i too small for %ix%i...",
+                              pitch, operation->width, operation->height);
+                return;
+        }
+
+        if (!server_quota_buffer (connection,
+                                  server_heap_buffer_size (operation->format,
+                                                           operation->width,
+                                                           operation->height,
+                                                           1, pitch)))
+                return;
+
+        buffer = emu_buffer_pool_add_planar_buffer (display->buffer_pool,
+                                                    operation->width,
+                                                    operation->height,
+                                                    operation->format,
+                                                    pitch);
+        if (buffer != NULL)
+        {
+                buffer->owner = connection->id;
+                SERVER_DEBUG ("\tbuffer=%p file=%s offset=%x",
+                              buffer, buffer->filename, buffer->heap_offset);
+
+                res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+                res_operation->buffer_id = buffer->id;
+                res_operation->heap_id = buffer->heap->id;
+                res_operation->offset = buffer->heap_offset;
+                res_operation->pitch = buffer->pitch;
+                for (i = 0; i < LAZY_MAX_PLANES; i++)
+                {
+                        res_operation->planes[i].offset = buffer->planes[i].offset;
+                        res_operation->planes[i].pitch = buffer->planes[i].pitch;
+                }
+        }
+        else
+        {
+                SERVER_ERROR ("Cannot add planar buffer to pool...");
+        }
+}
+
+static void
+server_process_delbuffer (emu_connection_t *connection,
+                          const lazy_operation_delbuffer_t *operation,
+                          lazy_operation_delbuffer_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_buffer_t *buffer;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("del buffer %i", operation->buffer_id);
+
+        buffer = emu_buffer_pool_find_buffer (display->buffer_pool,
+                                              operation->buffer_id);
+        if (buffer != NULL)
+        {
+                if (!server_check_owner (connection, &buffer->owner))
+                        return;
+
+                emu_buffer_pool_del_buffer (display->buffer_pool,
+                                            operation->buffer_id);
+        }
+        res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+}
+
+static gulong
+server_easing_to_mode (lazy_easing_t easing)
+{
+        switch (easing)
+        {
+        case LAZY_EASING_EASE_IN:
+                return CLUTTER_EASE_IN_CUBIC;
+
+        case LAZY_EASING_EASE_OUT:
+                return CLUTTER_EASE_OUT_CUBIC;
+
+        case LAZY_EASING_EASE_IN_OUT:
+                return CLUTTER_EASE_IN_OUT_CUBIC;
+
+        case LAZY_EASING_LINEAR:
+        default:
+                return CLUTTER_LINEAR;
+        }
+}
+
+static void
+server_process_setlayergeometry (emu_connection_t *connection,
+                                 const lazy_operation_setlayergeometry_t *operation,
+                                 lazy_operation_setlayergeometry_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_mixer_t *mixer;
+        emu_layer_t *layer;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("set layer %i geometry %ix%i@%ix%i -> %ix%i@%ix%i in %ims",
+                      operation->layer_id,
+                      operation->src.w, operation->src.h,
+                      operation->src.x, operation->src.y,
+                      operation->dst.w, operation->dst.h,
+                      operation->dst.x, operation->dst.y,
+                      operation->duration);
+
+        layer = emu_display_find_layer (display, operation->layer_id, &mixer);
+        if (layer == NULL)
+        {
+                SERVER_ERROR ("Cannot find layer %i in mixer...",
+                              operation->layer_id);
+                return;
+        }
+
+        if (!server_check_owner (connection, &layer->owner))
+                return;
+
+        if (operation->src.x >= layer->width ||
+            operation->src.y >= layer->height ||
+            (operation->src.x + operation->src.w) > layer->width ||
+            (operation->src.y + operation->src.h) > layer->height)
+        {
+                SERVER_ERROR ("Input viewport is outside of layer %i...",
+                              operation->layer_id);
+                return;
+        }
+
+        emu_layer_set_viewport_input (layer,
+                                      operation->src.x, operation->src.y,
+                                      operation->src.w, operation->src.h);
+        emu_layer_animate_viewport_output (layer,
+                                           operation->dst.x, operation->dst.y,
+                                           operation->dst.w, operation->dst.h,
+                                           operation->duration,
+                                           server_easing_to_mode (operation->easing));
+        res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+}
+
+static void
+server_process_setlayeropacity (emu_connection_t *connection,
+                                const lazy_operation_setlayeropacity_t *operation,
+                                lazy_operation_setlayeropacity_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_mixer_t *mixer;
+        emu_layer_t *layer;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("set layer %i opacity %i in %ims",
+                      operation->layer_id, operation->opacity,
+                      operation->duration);
+
+        layer = emu_display_find_layer (display, operation->layer_id, &mixer);
+        if (layer == NULL)
+        {
+                SERVER_ERROR ("Cannot find layer %i in mixer...",
+                              operation->layer_id);
+                return;
+        }
+
+        if (!server_check_owner (connection, &layer->owner))
+                return;
+
+        emu_layer_animate_opacity (layer,
+                                   MIN (operation->opacity, 0xff),
+                                   operation->duration,
+                                   server_easing_to_mode (operation->easing));
+        res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+}
+
+static void
+server_process_setlayerzorder (emu_connection_t *connection,
+                               const lazy_operation_setlayerzorder_t *operation,
+                               lazy_operation_setlayerzorder_res_t *res_operation)
+{
+        emu_display_t *display = connection->display;
+        emu_mixer_t *mixer;
+        emu_layer_t *layer;
+
+        res_operation->result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("set layer %i zorder %i",
+                      operation->layer_id, operation->zorder);
+
+        layer = emu_display_find_layer (display, operation->layer_id, &mixer);
+        if (layer == NULL)
+        {
+                SERVER_ERROR ("Cannot find layer %i in mixer...",
+                              operation->layer_id);
+                return;
+        }
+
+        if (!server_check_owner (connection, &layer->owner))
+                return;
+
+        emu_mixer_set_layer_zorder (mixer, layer, operation->zorder);
+        res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+}
+
+static void
+server_process_getstats (emu_display_t *display,
+                         const lazy_operation_getstats_t *operation,
+                         lazy_operation_getstats_res_t *res_operation)
+{
+        guint64 upload_bytes = 0, dedup_bytes = 0;
+        guint i;
+
+        SERVER_DEBUG ("get stats");
+
+        /* Totals over all screens, quality of the most degraded one */
+        memset (res_operation, 0, sizeof (*res_operation));
+        for (i = 0; i < display->screens->len; i++)
+        {
+                emu_mixer_t *mixer = g_ptr_array_index (display->screens, i);
+
+                res_operation->nb_flips += mixer->nb_flips;
+                res_operation->nb_uploads += mixer->nb_uploads;
+                res_operation->nb_redundant_uploads += mixer->nb_redundant_uploads;
+                upload_bytes += mixer->upload_bytes;
+                res_operation->nb_dedup_flips += mixer->nb_dedup_flips;
+                dedup_bytes += mixer->dedup_bytes;
+                res_operation->nb_deferred_uploads += mixer->nb_deferred_uploads;
+                res_operation->nb_streamed_uploads += mixer->nb_streamed_uploads;
+                res_operation->quality_level = MAX (res_operation->quality_level,
+                                                    mixer->quality);
+        }
+        res_operation->upload_kbytes = upload_bytes / 1024;
+        res_operation->dedup_kbytes = dedup_bytes / 1024;
+        res_operation->startup_listen_us = startup_listen_us;
+        res_operation->startup_frame_us = startup_frame_us;
+        res_operation->result = LAZY_OPERATION_RESULT_SUCCESS;
+}
+
+static gboolean
+server_input_addring (emu_connection_t *connection)
+{
+        lazy_operation_addring_res_t res_operation;
+
+        res_operation.result = LAZY_OPERATION_RESULT_FAILURE;
+
+        SERVER_DEBUG ("add ring");
+
+        if (connection->ring == NULL)
+                connection->ring = emu_ring_new (ring_index++);
+
+        if (connection->ring != NULL)
+        {
+                SERVER_DEBUG ("\tring file=%s", connection->ring->filename);
+
+                res_operation.result = LAZY_OPERATION_RESULT_SUCCESS;
+                res_operation.ring_id = connection->ring->id;
+        }
+        else
+        {
+                SERVER_ERROR ("Cannot create command ring...");
+        }
+
+        return server_input_send_result (connection, &res_operation,
+                                         sizeof (res_operation));
+}
+
+static gboolean
+server_input_addlayeronscreen (emu_connection_t *connection,
+                               const lazy_request_t *request)
+{
+        lazy_operation_addlayer_res_t res_operation;
+
+        res_operation.result = LAZY_OPERATION_RESULT_FAILURE;
+
+        if (lazy_request_check (&request->command) < 0)
+                SERVER_DEBUG ("Malformed operation %i from client %u...",
+                              request->operation, connection->id);
+        else
+                server_process_addlayer (connection,
+                                         request->addlayeronscreen.screen_id,
+                                         &request->addlayeronscreen.addlayer,
+                                         &res_operation);
+
+        return server_input_send_result (connection, &res_operation,
+                                         sizeof (res_operation));
+}
+
+/*
+  Runs one request, whether it came from the socket or a ring, once its
+  fields have been checked. The result is left in completion.
+*/
+static void
+server_process (emu_connection_t *connection,
+                const lazy_ring_command_t *command,
+                lazy_ring_completion_t *completion)
+{
+        memset (completion, 0, sizeof (*completion));
+        completion->operation = command->operation;
+        completion->res.result = LAZY_OPERATION_RESULT_FAILURE;
+
+        if (lazy_request_check (command) < 0)
+        {
+                SERVER_DEBUG ("Malformed operation %i from client %u...",
+                              command->operation, connection->id);
+                return;
+        }
+
+        switch (command->operation)
+        {
+        case LAZY_OPERATION_ADD_LAYER:
+                server_process_addlayer (connection, 0,
+                                         &command->addlayer,
+                                         &completion->res.addlayer);
+                break;
+
+        case LAZY_OPERATION_DEL_LAYER:
+                server_process_dellayer (connection,
+                                         &command->dellayer,
+                                         &completion->res.dellayer);
+                break;
+
+        case LAZY_OPERATION_FLIP_LAYER:
+                server_process_fliplayer (connection,
+                                          &command->fliplayer,
+                                          &completion->res.fliplayer);
+                break;
+
+        case LAZY_OPERATION_ADD_BUFFER:
+                server_process_addbuffer (connection,
+                                          &command->addbuffer,
+                                          &completion->res.addbuffer);
+                break;
+
+        case LAZY_OPERATION_DEL_BUFFER:
+                server_process_delbuffer (connection,
+                                          &command->delbuffer,
+                                          &completion->res.delbuffer);
+                break;
+
+        case LAZY_OPERATION_ADD_PITCHED_BUFFER:
+                server_process_addpitchedbuffer (connection,
+                                                 &command->addpitchedbuffer,
+                                                 &completion->res.addpitchedbuffer);
+                break;
+
+        case LAZY_OPERATION_GET_STATS:
+                server_process_getstats (connection->display,
+                                         &command->getstats,
+                                         &completion->res.getstats);
+                break;
+
+        case LAZY_OPERATION_ADD_PLANAR_BUFFER:
+                server_process_addplanarbuffer (connection,
+                                                &command->addplanarbuffer,
+                                                &completion->res.addplanarbuffer);
+                break;
+
+        case LAZY_OPERATION_SET_LAYER_GEOMETRY:
+                server_process_setlayergeometry (connection,
+                                                 &command->setlayergeometry,
+                                                 &completion->res.setlayergeometry);
+                break;
+
+        case LAZY_OPERATION_SET_LAYER_OPACITY:
+                server_process_setlayeropacity (connection,
+                                                &command->setlayeropacity,
+                                                &completion->res.setlayeropacity);
+                break;
 
-        return 0;
+        case LAZY_OPERATION_SET_LAYER_ZORDER:
+                server_process_setlayerzorder (connection,
+                                               &command->setlayerzorder,
+                                               &completion->res.setlayerzorder);
+                break;
+
+        default:
+                SERVER_DEBUG ("Unknown operation %i...",
+                              command->operation);
+                break;
+        }
 }
 
-void
-emu_mixer_del_layer (emu_mixer_t *mixer, gint id)
+/*
+  Consumes up to budget commands as long as there is room for their
+  completions, then goes back to sleep unless the budget ran out first.
+  Returns the number of commands processed.
+*/
+static guint
+server_ring_process (emu_connection_t *connection, guint budget)
 {
-        GList *e;
-        emu_layer_t l;
+        lazy_ring_t *ring = connection->ring->ptr;
+        volatile gint *cmd_head = (volatile gint *) &ring->command_index.head;
+        volatile gint *cmd_tail = (volatile gint *) &ring->command_index.tail;
+        volatile gint *cmd_waiting = (volatile gint *) &ring->command_index.waiting;
+        volatile gint *cpl_head = (volatile gint *) &ring->completion_index.head;
+        volatile gint *cpl_tail = (volatile gint *) &ring->completion_index.tail;
+        guint head, tail, chead, processed = 0;
+        guint in_flight = LAZY_RING_SIZE;
+
+        /* Completions the client has yet to collect */
+        if (client_in_flight > 0)
+                in_flight = MIN (in_flight, (guint) client_in_flight);
+
+        connection->ring_pending = FALSE;
+        g_atomic_int_set (cmd_waiting, 0);
+
+        tail = (guint) g_atomic_int_get (cmd_tail);
+        chead = (guint) g_atomic_int_get (cpl_head);
+
+        while (TRUE)
+        {
+                lazy_ring_command_t command;
+                lazy_ring_completion_t completion;
 
-        g_return_if_fail (mixer != NULL);
+                head = (guint) g_atomic_int_get (cmd_head);
 
-        l.id = id;
-        e = g_list_find_custom (mixer->layers, &l,
-                                (GCompareFunc) emu_mixer_compare_layer);
+                if (head != tail && processed == budget)
+                {
+                        /* Our turn is over, the scheduler comes back. */
+                        connection->ring_pending = TRUE;
+                        break;
+                }
 
-        if (e)
-        {
-                emu_layer_t *layer = e->data;
+                if (head == tail ||
+                    (chead - (guint) g_atomic_int_get (cpl_tail)) >= in_flight)
+                {
+                        /* Announce we sleep, then check nothing raced in. */
+                        g_atomic_int_set (cmd_waiting, 1);
 
-                mixer->layers = g_list_delete_link (mixer->layers, e);
-                emu_mixer_free_layer (layer, mixer);
-        }
-}
+                        if (head == (guint) g_atomic_int_get (cmd_head))
+                                break;
 
-emu_layer_t *
-emu_mixer_find_layer (emu_mixer_t *mixer, gint id)
-{
-        GList *e;
-        emu_layer_t l;
+                        g_atomic_int_set (cmd_waiting, 0);
+                        continue;
+                }
 
-        g_return_val_if_fail (mixer != NULL, NULL);
+                /* The client may scribble over the slot, work on a copy. */
+                memcpy (&command, &ring->commands[tail & (LAZY_RING_SIZE - 1)],
+                        sizeof (command));
+                g_atomic_int_set (cmd_tail, ++tail);
 
-        l.id = id;
-        e = g_list_find_custom (mixer->layers, &l,
-                                (GCompareFunc) emu_mixer_compare_layer);
+                server_process (connection, &command, &completion);
 
-        if (e)
-                return (emu_layer_t *) e->data;
+                memcpy (&ring->completions[chead & (LAZY_RING_SIZE - 1)],
+                        &completion, sizeof (completion));
+                g_atomic_int_set (cpl_head, ++chead);
 
-        return NULL;
-}
+                processed++;
+        }
 
-guint connection_id = 0;
+        return processed;
+}
 
+/*
+  Processes up to budget ring commands and wakes the client up. FALSE
+  when the client could not be kicked and the connection is over.
+*/
 static gboolean
-server_input_send_result (GIOChannel *source, void *result, guint length)
+server_ring_service (emu_connection_t *connection, guint budget,
+                     guint *processed)
 {
-        gsize transfereddata = 0;
-        /* int i; */
+        lazy_ring_t *ring = connection->ring->ptr;
+        lazy_operation_t kick = LAZY_OPERATION_KICK_RING;
 
-        if ((g_io_channel_write (source,
-                                 (gchar *) result, length,
-                                 &transfereddata) != G_IO_ERROR_NONE) ||
-            (transfereddata != length))
+        *processed = server_ring_process (connection, budget);
+        if (*processed > 0 &&
+            g_atomic_int_get ((volatile gint *) &ring->completion_index.waiting))
         {
-                SERVER_ERROR ("Cannot ack operation...");
-                return FALSE;
+                SERVER_DEBUG ("kick client");
+                return server_input_send_result (connection,
+                                                 &kick, sizeof (kick));
         }
 
         return TRUE;
 }
 
 static gboolean
-server_input_addlayer (GIOChannel *source,
-                       emu_mixer_t *mixer)
+server_input_kickring (emu_connection_t *connection)
 {
-        lazy_operation_addlayer_t operation;
-        gsize transfereddata = 0;
-        const gsize toreaddata = sizeof (operation) - sizeof (lazy_operation_t);
-        lazy_operation_addlayer_res_t res_operation;
-        emu_layer_t *layer;
-        emu_buffer_t *buffer;
-
-        res_operation.result = LAZY_OPERATION_RESULT_FAILURE;
-
-        if ((g_io_channel_read (source,
-                                ((gchar *) &operation) + sizeof (lazy_operation_t),
-                                toreaddata,
-                                &transfereddata) != G_IO_ERROR_NONE) ||
-            (transfereddata != toreaddata))
+        if (connection->ring == NULL)
         {
-                SERVER_ERROR ("Cannot addlayer operation...");
-                return server_input_send_result (source, &res_operation,
-                                         sizeof (res_operation));
+                SERVER_DEBUG ("Kick without ring...");
+                return TRUE;
         }
 
-        SERVER_DEBUG ("add layer %ix%i@%ix%i -> %ix%i@%ix%i - buffer=%i",
-                      operation.src.w, operation.src.h,
-                      operation.src.x, operation.src.y,
-                      operation.dst.w, operation.dst.h,
-                      operation.dst.x, operation.dst.y,
-                      operation.buffer_id);
+        /* Served when the connection gets its turn */
+        connection->ring_pending = TRUE;
 
+        return TRUE;
+}
 
-        buffer = emu_buffer_pool_find_buffer (mixer->buffer_pool, operation.buffer_id);
-        if (buffer == NULL)
+/*
+  Reads what has arrived of the current request, without blocking, and
+  processes it once complete. FALSE when the connection is over.
+*/
+static gboolean
+server_input_request (emu_connection_t *connection)
+{
+        GIOChannel *source = connection->channel;
+        lazy_request_t request;
+        lazy_ring_completion_t completion;
+        gsize wanted;
+        gssize readdata;
+        glong size;
+
+        while ((size = lazy_request_decode (&connection->input,
+                                            connection->input_length,
+                                            &request)) == 0)
         {
-                SERVER_ERROR ("Cannot find buffer %i in mixer...",
-                              operation.buffer_id);
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
-        }
+                /* The operation first, then the rest of its request */
+                wanted = sizeof (lazy_operation_t);
+                if (connection->input_length >= wanted)
+                        wanted = lazy_request_size (connection->input.operation);
+
+                /*
+                  A client stalling mid-request must not stall the others,
+                  so reads never block, nor do the replies, see
+                  server_input_send_result().
+                */
+                readdata = recv (g_io_channel_unix_get_fd (source),
+                                 (gchar *) &connection->input +
+                                 connection->input_length,
+                                 wanted - connection->input_length,
+                                 MSG_DONTWAIT);
+                if (readdata < 0 &&
+                    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                        return TRUE;
+
+                if (readdata <= 0)
+                {
+                        SERVER_DEBUG ("Closing connection %u...", connection->id);
+                        return FALSE;
+                }
 
-        if (operation.src.x >= buffer->width ||
-            operation.src.y >= buffer->height ||
-            (operation.src.x + operation.src.w) > buffer->width ||
-            (operation.src.y + operation.src.h) > buffer->height)
-        {
-                SERVER_ERROR ("Input viewport is outside of buffer %i...",
-                              operation.buffer_id);
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
+                connection->input_length += readdata;
         }
 
-        layer = emu_layer_new (operation.layer_id,
-                               operation.width,
-                               operation.height);
-
-        if (layer == NULL)
+        connection->input_length = 0;
+        if (size < 0)
         {
-                SERVER_ERROR ("Cannot create new layer%i (%ix%i)",
-                              operation.layer_id,
-                              operation.width, operation.height);
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
+                SERVER_DEBUG ("Unknown operation %i from client %u...",
+                              connection->input.operation, connection->id);
+                return FALSE;
         }
 
-        g_return_val_if_fail (layer != NULL, FALSE);
-
-        if (emu_mixer_add_layer (mixer, layer) < 0)
+        switch (request.operation)
         {
-                emu_layer_free (layer);
-                SERVER_ERROR ("Cannot add layer%i to mixer...",
-                              operation.layer_id);
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
-        }
+        case LAZY_OPERATION_ADD_RING:
+                return server_input_addring (connection);
 
-        emu_layer_set_viewport_input (layer,
-                                      operation.src.x, operation.src.y,
-                                      operation.src.w, operation.src.h);
-        emu_layer_set_viewport_output (layer,
-                                       operation.dst.x, operation.dst.y,
-                                       operation.dst.w, operation.dst.h);
+        case LAZY_OPERATION_KICK_RING:
+                return server_input_kickring (connection);
 
-        emu_layer_set_buffer (layer, buffer);
-        res_operation.result = LAZY_OPERATION_RESULT_SUCCESS;
+        case LAZY_OPERATION_ADD_LAYER_ON_SCREEN:
+                return server_input_addlayeronscreen (connection, &request);
 
-        return server_input_send_result (source, &res_operation,
-                                         sizeof (res_operation));
+        default:
+                server_process (connection, &request.command, &completion);
+                return server_input_send_result (connection, &completion.res,
+                                                 lazy_response_size (request.operation));
+        }
 }
 
 static gboolean
-server_input_dellayer (GIOChannel *source,
-                       emu_mixer_t *mixer)
-{
-        lazy_operation_dellayer_t operation;
-        gsize transfereddata = 0;
-        const gsize toreaddata = sizeof (operation) - sizeof (lazy_operation_t);
-        lazy_operation_dellayer_res_t res_operation;
-
-        res_operation.result = LAZY_OPERATION_RESULT_FAILURE;
-
-        if ((g_io_channel_read (source,
-                                ((gchar *) &operation) + sizeof (lazy_operation_t),
-                                toreaddata,
-                                &transfereddata) != G_IO_ERROR_NONE) ||
-            (transfereddata != toreaddata))
-        {
-                SERVER_ERROR ("Cannot dellayer operation...");
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
-        }
-
-        SERVER_DEBUG ("del layer %i", operation.layer_id);
-
-        emu_mixer_del_layer (mixer, operation.layer_id);
-        res_operation.result = LAZY_OPERATION_RESULT_SUCCESS;
-
-        return server_input_send_result (source, &res_operation,
-                                         sizeof (res_operation));
-}
+server_input_callback (GIOChannel *source,
+                       GIOCondition condition,
+                       emu_connection_t *connection);
 
 static gboolean
-server_input_fliplayer (GIOChannel *source,
-                        emu_mixer_t *mixer)
+server_input_pending (emu_connection_t *connection)
 {
-        lazy_operation_fliplayer_t operation;
-        gsize transfereddata = 0;
-        const gsize toreaddata = sizeof (operation) - sizeof (lazy_operation_t);
-        lazy_operation_fliplayer_res_t res_operation;
-        emu_layer_t *layer;
-        emu_buffer_t *buffer;
-
-        res_operation.result = LAZY_OPERATION_RESULT_FAILURE;
-
-        if ((g_io_channel_read (source,
-                                ((gchar *) &operation) + sizeof (lazy_operation_t),
-                                toreaddata,
-                                &transfereddata) != G_IO_ERROR_NONE) ||
-            (transfereddata != toreaddata))
-        {
-                SERVER_ERROR ("Cannot dellayer operation...");
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
-        }
-
-        SERVER_DEBUG ("flip layer %i", operation.layer_id);
-
-        layer = emu_mixer_find_layer (mixer, operation.layer_id);
-        if (layer == NULL)
-        {
-                SERVER_ERROR ("Cannot find layer %i in mixer...",
-                              operation.layer_id);
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
-        }
-
-        buffer = emu_buffer_pool_find_buffer (mixer->buffer_pool, operation.buffer_id);
-        if (buffer == NULL)
-        {
-                SERVER_ERROR ("Cannot find buffer %i in mixer...",
-                              operation.buffer_id);
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
-        }
+        struct pollfd pfd;
 
-        SERVER_DEBUG ("Flipping to buffer %x", buffer->id);
-        emu_layer_set_buffer (layer, buffer);
-        res_operation.result = LAZY_OPERATION_RESULT_SUCCESS;
+        pfd.fd = g_io_channel_unix_get_fd (connection->channel);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
 
-        return server_input_send_result (source, &res_operation,
-                                         sizeof (res_operation));
+        return poll (&pfd, 1, 0) > 0;
 }
 
+/*
+  Deficit round robin over the connections with requests: each turn, a
+  connection is credited client_quantum requests, socket requests and
+  ring commands alike, and goes to the back of the queue once it has
+  spent them. Connections that run out of requests are watched again,
+  the ones with too many replies queued once these drain.
+*/
 static gboolean
-server_input_addbuffer (GIOChannel *source,
-                        emu_mixer_t *mixer)
+server_schedule (gpointer data)
 {
-        lazy_operation_addbuffer_t operation;
-        gsize transfereddata = 0;
-        const gsize toreaddata = sizeof (operation) - sizeof (lazy_operation_t);
-        lazy_operation_addbuffer_res_t res_operation;
-        emu_buffer_t *buffer;
-
-        res_operation.result = LAZY_OPERATION_RESULT_FAILURE;
+        guint i, nb = g_queue_get_length (ready_connections);
 
-        if ((g_io_channel_read (source,
-                                ((gchar *) &operation) + sizeof (lazy_operation_t),
-                                toreaddata,
-                                &transfereddata) != G_IO_ERROR_NONE) ||
-            (transfereddata != toreaddata))
+        for (i = 0; i < nb; i++)
         {
-                SERVER_ERROR ("Cannot addbuffer operation...");
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
-        }
-
-        SERVER_DEBUG ("add buffer %ix%i bpp=%i",
-                      operation.width, operation.height, operation.bpp);
+                emu_connection_t *connection = g_queue_pop_head (ready_connections);
+                gboolean alive = TRUE, busy = TRUE;
 
-        buffer = emu_buffer_pool_add_buffer (mixer->buffer_pool,
-                                             operation.width, operation.height,
-                                             operation.bpp);
-        if (buffer != NULL)
-        {
-                SERVER_DEBUG ("\tbuffer=%p file=%s", buffer, buffer->filename);
+                connection->deficit += client_quantum;
+                while (alive && connection->deficit > 0)
+                {
+                        /* Not reading its replies, it gets no more. */
+                        if (connection->output->len >= CONNECTION_OUTPUT_MAX)
+                        {
+                                connection->output_full = TRUE;
+                                break;
+                        }
+
+                        if (server_input_pending (connection))
+                        {
+                                alive = server_input_request (connection);
+                                connection->deficit--;
+                        }
+                        else if (connection->ring_pending)
+                        {
+                                guint processed;
+
+                                alive = server_ring_service (connection,
+                                                             connection->deficit,
+                                                             &processed);
+                                connection->deficit -= processed;
+                        }
+                        else
+                        {
+                                busy = FALSE;
+                                break;
+                        }
+                }
 
-                res_operation.result = LAZY_OPERATION_RESULT_SUCCESS;
-                res_operation.buffer_id = buffer->id;
+                if (!alive)
+                {
+                        SERVER_DEBUG ("Closing connection %u...", connection->id);
+                        emu_connection_free (connection);
+                }
+                else if (connection->output_full)
+                        connection->deficit = 0;
+                else if (busy)
+                        g_queue_push_tail (ready_connections, connection);
+                else
+                {
+                        connection->deficit = 0;
+                        connection->watch_id = g_io_add_watch (connection->channel,
+                                                               G_IO_IN | G_IO_HUP,
+                                                               (GIOFunc) server_input_callback,
+                                                               connection);
+                }
         }
-        else
+
+        if (g_queue_is_empty (ready_connections))
         {
-                SERVER_ERROR ("Cannot add buffer to pool...");
+                scheduler_id = 0;
+                return FALSE;
         }
 
-        /* Roger that... */
-        return server_input_send_result (source, &res_operation,
-                                         sizeof (res_operation));
+        return TRUE;
 }
 
-static gboolean
-server_input_delbuffer (GIOChannel *source,
-                        emu_mixer_t *mixer)
+static void
+server_ready_connection (emu_connection_t *connection)
 {
-        lazy_operation_delbuffer_t operation;
-        gsize transfereddata = 0;
-        const gsize toreaddata = sizeof (operation) - sizeof (lazy_operation_t);
-        lazy_operation_delbuffer_res_t res_operation;
-
-        res_operation.result = LAZY_OPERATION_RESULT_FAILURE;
+        g_queue_push_tail (ready_connections, connection);
 
-        if ((g_io_channel_read (source,
-                                ((gchar *) &operation) + sizeof (lazy_operation_t),
-                                toreaddata,
-                                &transfereddata) != G_IO_ERROR_NONE) ||
-            (transfereddata != toreaddata))
-        {
-                SERVER_ERROR ("Cannot dellayer operation...");
-                return server_input_send_result (source, &res_operation,
-                                                 sizeof (res_operation));
-        }
-
-        SERVER_DEBUG ("del buffer %i", operation.buffer_id);
-
-        emu_buffer_pool_del_buffer (mixer->buffer_pool, operation.buffer_id);
-        res_operation.result = LAZY_OPERATION_RESULT_SUCCESS;
-
-        /* Roger that... */
-        return server_input_send_result (source, &res_operation,
-                                         sizeof (res_operation));
+        if (scheduler_id == 0)
+                scheduler_id = g_idle_add_full (G_PRIORITY_DEFAULT,
+                                                server_schedule, NULL, NULL);
 }
 
+/* Queues the connection for its turn instead of serving it right away. */
 static gboolean
 server_input_callback (GIOChannel *source,
                        GIOCondition condition,
-                       emu_mixer_t *mixer)
+                       emu_connection_t *connection)
 {
-        lazy_operation_t op;
-        gsize readdata = 0;
-
         SERVER_DEBUG ("callback cond=%i!", condition);
 
-        if (condition & G_IO_HUP) {
-                return FALSE;
-        }
+        connection->watch_id = 0;
+        server_ready_connection (connection);
 
-        if (g_io_channel_read (source,
-                                (gchar *) &op,
-                                sizeof (op),
-                                &readdata) != G_IO_ERROR_NONE)
-        {
-                SERVER_ERROR ("Cannot read operation...");
-                return FALSE;
-        }
+        return FALSE;
+}
 
-        if (readdata == 0)
+/* Sends queued replies, serving the connection again once they drain. */
+static gboolean
+server_output_callback (GIOChannel *source,
+                        GIOCondition condition,
+                        emu_connection_t *connection)
+{
+        if ((condition & (G_IO_HUP | G_IO_ERR)) ||
+            !server_output_flush (connection))
         {
-                SERVER_DEBUG ("Closing connection...");
+                SERVER_DEBUG ("Closing connection %u...", connection->id);
+                connection->output_id = 0;
+                g_queue_remove (ready_connections, connection);
+                emu_connection_free (connection);
                 return FALSE;
         }
 
-        switch (op)
+        if (connection->output_full &&
+            connection->output->len < CONNECTION_OUTPUT_MAX)
         {
-        case LAZY_OPERATION_ADD_LAYER:
-                return server_input_addlayer (source, mixer);
-                break;
-
-        case LAZY_OPERATION_DEL_LAYER:
-                return server_input_dellayer (source, mixer);
-                break;
-
-        case LAZY_OPERATION_FLIP_LAYER:
-                return server_input_fliplayer (source, mixer);
-                break;
-
-        case LAZY_OPERATION_ADD_BUFFER:
-                return server_input_addbuffer (source, mixer);
-                break;
+                connection->output_full = FALSE;
+                server_ready_connection (connection);
+        }
 
-        case LAZY_OPERATION_DEL_BUFFER:
-                return server_input_delbuffer (source, mixer);
-                break;
+        if (connection->output->len > 0)
+                return TRUE;
 
-        default:
-                SERVER_ERROR ("Unknown operation...");
-                return FALSE;
-        }
+        connection->output_id = 0;
 
-        return TRUE;
+        return FALSE;
 }
 
 static gboolean
 server_accept_callback (GIOChannel *source,
                         GIOCondition condition,
-                        emu_mixer_t *mixer)
+                        emu_display_t *display)
 
 {
         int fd;
         int socket;
         GIOChannel *ioc;
+        emu_connection_t *connection;
 
         SERVER_DEBUG ("New connection...");
 
         fd = g_io_channel_unix_get_fd (source);
         socket = accept (fd, NULL, NULL);
+        if (socket < 0)
+        {
+                SERVER_DEBUG ("Cannot accept : %s", strerror (errno));
+                return TRUE;
+        }
 
         ioc = g_io_channel_unix_new (socket);
-        connection_id = g_io_add_watch (ioc,
-                                        G_IO_IN | G_IO_HUP,
-                                        (GIOFunc) server_input_callback,
-                                        mixer);
+        g_io_channel_set_close_on_unref (ioc, TRUE);
+
+        connection = emu_connection_new (++connection_index, ioc, display);
+        connection->watch_id = g_io_add_watch (ioc,
+                                               G_IO_IN | G_IO_HUP,
+                                               (GIOFunc) server_input_callback,
+                                               connection);
 
         return TRUE;
 }
 
-void
-server_setup_connection (emu_mixer_t *mixer)
+/*
+  Binds the port before anything else is initialised: clients that
+  connect while the screens come up wait in the listen backlog instead
+  of being refused.
+*/
+int
+server_bind (void)
 {
         int fd;
 	ssize_t len;
         struct sockaddr_in sv_addr;
-        GIOChannel *ioc;
-
-        if (!mixer)
-        {
-                SERVER_ERROR ("No mixer...");
-                exit (1);
-        }
 
         if ((fd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
 	{
@@ -953,18 +5658,98 @@ server_setup_connection (emu_mixer_t *mixer)
 		exit (1);
 	}
 
-        listen (fd, 1);
+        listen (fd, SOMAXCONN);
+
+        return fd;
+}
+
+/* Starts accepting the connections queued on fd. */
+void
+server_setup_connection (emu_display_t *display, int fd)
+{
+        GIOChannel *ioc;
+
+        if (!display)
+        {
+                SERVER_ERROR ("No display...");
+                exit (1);
+        }
 
         ioc = g_io_channel_unix_new (fd);
 
         connection_id = g_io_add_watch (ioc,
                                         G_IO_IN,
                                         (GIOFunc) server_accept_callback,
-                                        mixer);
+                                        display);
 }
 
-int
-main (int argc, char *argv[])
+static gboolean
+server_save_state (emu_display_t *display)
+{
+        emu_display_save (display, state_file);
+
+        return TRUE;
+}
+
+static void
+server_first_paint (ClutterActor *stage, gpointer data)
+{
+        startup_frame_us = g_timer_elapsed (startup_timer, NULL) * 1000000;
+        g_signal_handlers_disconnect_by_func (stage,
+                                              server_first_paint, data);
+
+        SERVER_DEBUG ("startup: listening after %lu us, first frame after %lu us",
+                      startup_listen_us, startup_frame_us);
+}
+
+static GOptionEntry entries[] =
+{
+        { "atlas-threshold", 'a', 0, G_OPTION_ARG_INT, &atlas_threshold,
+          "Pack layers up to N pixels wide and high in a shared texture atlas (0 disables)",
+          "N" },
+        { "pbo-ring", 'p', 0, G_OPTION_ARG_INT, &pbo_ring_size,
+          "Stream uploads through a ring of N pixel buffers per layer (0 disables)",
+          "N" },
+        { "dedup", 'd', 0, G_OPTION_ARG_NONE, &dedup_uploads,
+          "Hash buffers at flip time and skip uploading unchanged content",
+          NULL },
+        { "tile-diff", 't', 0, G_OPTION_ARG_NONE, &tile_diff,
+          "Checksum 64x64 tiles at flip time and only upload the ones that changed",
+          NULL },
+        { "frame-budget", 'f', 0, G_OPTION_ARG_INT, &frame_budget,
+          "Lower upload quality while uploads take more than MS per frame (0 disables)",
+          "MS" },
+        { "state", 's', 0, G_OPTION_ARG_FILENAME, &state_file,
+          "Restore layers and buffers from FILE, and keep it up to date",
+          "FILE" },
+        { "screen", 'S', 0, G_OPTION_ARG_STRING_ARRAY, &screen_modes,
+          "Add an output screen, repeat for more (default: one 1280x720 screen)",
+          "WxH[@HZ]" },
+        { "stream", 'o', 0, G_OPTION_ARG_STRING, &stream_destination,
+          "Stream the screens to DEST: - for stdout, unix:PATH or a TCP port to serve a viewer",
+          "DEST" },
+        { "prewarm", 'w', 0, G_OPTION_ARG_STRING, &prewarm_spec,
+          "Preallocate and prefault room for N buffers of WxH pixels of BPP bytes (default 4)",
+          "N:WxH[xBPP]" },
+        { "client-kbytes", 'K', 0, G_OPTION_ARG_INT, &client_kbytes,
+          "Let each client hold at most N KiB of buffers (0 disables)",
+          "N" },
+        { "client-layers", 'L', 0, G_OPTION_ARG_INT, &client_layers,
+          "Let each client create at most N layers (0 disables)",
+          "N" },
+        { "client-in-flight", 'I', 0, G_OPTION_ARG_INT, &client_in_flight,
+          "Stop consuming the ring of a client with N completions not collected yet (0 disables)",
+          "N" },
+        { "quantum", 'Q', 0, G_OPTION_ARG_INT, &client_quantum,
+          "Serve at most N requests of a client before moving on to the next one",
+          "N" },
+        { NULL }
+};
+
+/* Opens a window composited by a new screen of display. */
+static emu_mixer_t *
+server_add_screen (emu_display_t *display,
+                   gint width, gint height, gint refresh_rate)
 {
         ClutterActor *stage;
         GtkWidget    *window, *clutter, *vbox;
@@ -975,12 +5760,6 @@ main (int argc, char *argv[])
                 .alpha = 0xff
         };
 
-        if (argc > 1)
-                path_to_buffers = argv[1];
-
-        if (gtk_clutter_init (&argc, &argv) != CLUTTER_INIT_SUCCESS)
-                g_error ("Unable to initialize GtkClutter");
-
         window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
         g_signal_connect (window, "destroy",
                           G_CALLBACK (gtk_main_quit), NULL);
@@ -989,7 +5768,7 @@ main (int argc, char *argv[])
         gtk_container_add (GTK_CONTAINER (window), vbox);
 
         clutter = gtk_clutter_embed_new ();
-        gtk_widget_set_size_request (clutter, WINWIDTH, WINHEIGHT);
+        gtk_widget_set_size_request (clutter, width, height);
 
         gtk_container_add (GTK_CONTAINER (vbox), clutter);
 
@@ -998,15 +5777,161 @@ main (int argc, char *argv[])
 
         gtk_widget_show_all (window);
 
-        emu_mixer_t *mixer = emu_mixer_new (CLUTTER_STAGE (stage));
-        if (!mixer)
+        return emu_display_add_screen (display, CLUTTER_STAGE (stage),
+                                       refresh_rate);
+}
+
+int
+main (int argc, char *argv[])
+{
+        emu_display_t *display;
+        emu_sink_t *sink = NULL;
+        gint prewarm_nb = 0, prewarm_width, prewarm_height, prewarm_bpp = 4;
+        guint i;
+        int fd;
+
+        /* Stream encoders run on their own threads. */
+        if (!g_thread_supported ())
+                g_thread_init (NULL);
+
+        /* Clients going away mid-reply are dealt with where written to. */
+        signal (SIGPIPE, SIG_IGN);
+
+        startup_timer = g_timer_new ();
+        fd = server_bind ();
+        startup_listen_us = g_timer_elapsed (startup_timer, NULL) * 1000000;
+
+        if (gtk_clutter_init_with_args (&argc, &argv,
+                                        "[PATH_TO_BUFFERS]",
+                                        entries, NULL,
+                                        NULL) != CLUTTER_INIT_SUCCESS)
+                g_error ("Unable to initialize GtkClutter");
+
+        if (argc > 1)
+                path_to_buffers = argv[1];
+
+        pbo_ring_size = CLAMP (pbo_ring_size, 0, PBO_RING_MAX);
+        atlas_threshold = CLAMP (atlas_threshold, 0,
+                                 ATLAS_SIZE - 2 * ATLAS_PADDING);
+        client_quantum = MAX (client_quantum, 1);
+        ready_connections = g_queue_new ();
+#ifndef HAVE_COGL_PIXEL_BUFFER_NEW_FOR_SIZE
+        if (pbo_ring_size > 0)
+                g_warning ("Built without Cogl pixel buffers, uploads stay synchronous");
+#endif
+
+        display = emu_display_new ();
+        if (!display)
+        {
+                fprintf (stderr, "Cannot create display...\n");
+                exit (1);
+        }
+
+        for (i = 0; screen_modes && screen_modes[i]; i++)
+        {
+                gint width, height, refresh_rate = 0;
+
+                if (sscanf (screen_modes[i], "%ix%i@%i",
+                            &width, &height, &refresh_rate) < 2 ||
+                    width <= 0 || height <= 0 || refresh_rate < 0)
+                {
+                        fprintf (stderr, "Invalid screen mode %s...\n",
+                                 screen_modes[i]);
+                        exit (1);
+                }
+
+                if (!server_add_screen (display, width, height, refresh_rate))
+                {
+                        fprintf (stderr, "Cannot create screen %s...\n",
+                                 screen_modes[i]);
+                        exit (1);
+                }
+        }
+
+        if (display->screens->len == 0 &&
+            !server_add_screen (display, WINWIDTH, WINHEIGHT, 0))
         {
                 fprintf (stderr, "Cannot create mixer...\n");
                 exit (1);
         }
-        server_setup_connection (mixer);
+
+        g_signal_connect_after (emu_display_get_screen (display, 0)->stage,
+                                "paint", G_CALLBACK (server_first_paint), NULL);
+
+        if (prewarm_spec &&
+            (sscanf (prewarm_spec, "%i:%ix%ix%i", &prewarm_nb,
+                     &prewarm_width, &prewarm_height, &prewarm_bpp) < 3 ||
+             prewarm_nb <= 0 || prewarm_width <= 0 || prewarm_height <= 0 ||
+             prewarm_bpp <= 0))
+        {
+                fprintf (stderr, "Invalid prewarm %s...\n", prewarm_spec);
+                exit (1);
+        }
+
+        if (stream_destination)
+        {
+                sink = emu_sink_new (stream_destination);
+                if (!sink)
+                        exit (1);
+
+                for (i = 0; i < display->screens->len; i++)
+                        if (!emu_sink_add_screen (sink,
+                                                  g_ptr_array_index (display->screens, i)))
+                                exit (1);
+        }
+
+        if (state_file)
+        {
+                emu_display_restore (display, state_file);
+                g_timeout_add_seconds (SNAPSHOT_PERIOD,
+                                       (GSourceFunc) server_save_state,
+                                       display);
+        }
+
+        /* After the restore, new heaps must not reuse restored ids. */
+        if (prewarm_nb > 0 &&
+            emu_buffer_pool_prewarm (display->buffer_pool, prewarm_nb,
+                                     prewarm_width, prewarm_height,
+                                     prewarm_bpp) < (guint) prewarm_nb)
+                g_warning ("Could only prewarm part of %s", prewarm_spec);
+
+        server_setup_connection (display, fd);
 
         gtk_main();
 
+        if (state_file)
+                emu_display_save (display, state_file);
+
+#ifdef HAVE_SERVER_DEBUG
+        for (i = 0; i < display->screens->len; i++)
+        {
+                emu_mixer_t *mixer = g_ptr_array_index (display->screens, i);
+
+                SERVER_DEBUG ("screen %u: flips=%u uploads=%u redundant=%u "
+                              "uploaded=%lluKiB deduplicated=%u saved=%lluKiB "
+                              "deferred=%u streamed=%u quality=%i",
+                              mixer->screen_id, mixer->nb_flips, mixer->nb_uploads,
+                              mixer->nb_redundant_uploads,
+                              (unsigned long long) (mixer->upload_bytes / 1024),
+                              mixer->nb_dedup_flips,
+                              (unsigned long long) (mixer->dedup_bytes / 1024),
+                              mixer->nb_deferred_uploads,
+                              mixer->nb_streamed_uploads, mixer->quality);
+        }
+
+        for (i = 0; sink && i < sink->streams->len; i++)
+        {
+                emu_stream_t *stream = g_ptr_array_index (sink->streams, i);
+
+                SERVER_DEBUG ("stream %u: frames=%u dropped=%u sent=%lluKiB",
+                              stream->mixer->screen_id, stream->frame,
+                              stream->nb_dropped,
+                              (unsigned long long) (stream->sent_bytes / 1024));
+        }
+#endif /* HAVE_SERVER_DEBUG */
+
+        if (sink)
+                emu_sink_free (sink);
+
         return 0;
 }
@@ -0,0 +1,217 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "liblazy.h"
+
+/**/
+typedef enum
+{
+        BENCH_MODE_SYNC,
+        BENCH_MODE_ASYNC,
+        BENCH_MODE_RING,
+} bench_mode_t;
+
+typedef struct
+{
+        double  *start;
+        double  *latency;
+        unsigned int nb_done;
+        unsigned int nb_failed;
+} bench_t;
+
+static double
+bench_now (void)
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_compare_double (const void *a, const void *b)
+{
+        double da = *(const double *) a, db = *(const double *) b;
+
+        return (da > db) - (da < db);
+}
+
+static void
+bench_flip_completion (lazy_connection_t *connection,
+                       lazy_operation_t operation,
+                       const void *result,
+                       void *user_data)
+{
+        const lazy_operation_fliplayer_res_t *res = result;
+        bench_t *bench = user_data;
+
+        bench->latency[bench->nb_done] = bench_now () - bench->start[bench->nb_done];
+        if (res->result != LAZY_OPERATION_RESULT_SUCCESS)
+                bench->nb_failed++;
+        bench->nb_done++;
+}
+
+static void
+usage (const char *name)
+{
+        fprintf (stderr,
+                 "Usage: %s [-h host] [-p port] [-b path_to_buffers]\n"
+                 "          [-n ops] [-m sync|async|ring] [-d depth]\n"
+                 "          [-s width x height]\n", name);
+        exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+        const char *host = NULL, *path_to_buffers = NULL;
+        int port = 0, opt;
+        unsigned int nb_ops = 10000, depth = 16, width = 64, height = 64;
+        unsigned int i, submitted;
+        lazy_uint_t buffers[2];
+        lazy_rectangle_t rect;
+        bench_mode_t mode = BENCH_MODE_SYNC;
+        lazy_connection_t *connection;
+        bench_t bench;
+        double begin, elapsed;
+
+        while ((opt = getopt (argc, argv, "h:p:b:n:m:d:s:")) != -1)
+        {
+                switch (opt)
+                {
+                case 'h':
+                        host = optarg;
+                        break;
+                case 'p':
+                        port = atoi (optarg);
+                        break;
+                case 'b':
+                        path_to_buffers = optarg;
+                        break;
+                case 'n':
+                        nb_ops = strtoul (optarg, NULL, 0);
+                        break;
+                case 'm':
+                        if (!strcmp (optarg, "sync"))
+                                mode = BENCH_MODE_SYNC;
+                        else if (!strcmp (optarg, "async"))
+                                mode = BENCH_MODE_ASYNC;
+                        else if (!strcmp (optarg, "ring"))
+                                mode = BENCH_MODE_RING;
+                        else
+                                usage (argv[0]);
+                        break;
+                case 'd':
+                        depth = strtoul (optarg, NULL, 0);
+                        break;
+                case 's':
+                        if (sscanf (optarg, "%ux%u", &width, &height) != 2)
+                                usage (argv[0]);
+                        break;
+                default:
+                        usage (argv[0]);
+                }
+        }
+
+        if (nb_ops == 0 || depth == 0 || width == 0 || height == 0)
+                usage (argv[0]);
+        if (mode == BENCH_MODE_SYNC)
+                depth = 1;
+
+        connection = lazy_connect (host, port, path_to_buffers);
+        if (connection == NULL)
+        {
+                fprintf (stderr, "Cannot connect to LazyVisu\n");
+                return 1;
+        }
+
+        if (mode == BENCH_MODE_RING && lazy_use_ring (connection) < 0)
+        {
+                fprintf (stderr, "Cannot set up the command ring\n");
+                return 1;
+        }
+
+        for (i = 0; i < 2; i++)
+        {
+                unsigned char *pixels;
+                lazy_uint_t pitch;
+
+                if (lazy_add_buffer (connection, width, height, 4, &buffers[i]) < 0)
+                {
+                        fprintf (stderr, "Cannot add buffer\n");
+                        return 1;
+                }
+
+                pixels = lazy_buffer_map (connection, buffers[i], &pitch);
+                if (pixels)
+                        memset (pixels, i ? 0xff : 0x00, pitch * height);
+        }
+
+        rect.x = rect.y = 0;
+        rect.w = width;
+        rect.h = height;
+        if (lazy_add_layer (connection, 0, width, height,
+                            &rect, &rect, buffers[0]) < 0)
+        {
+                fprintf (stderr, "Cannot add layer\n");
+                return 1;
+        }
+
+        memset (&bench, 0, sizeof (bench));
+        bench.start = malloc (nb_ops * sizeof (double));
+        bench.latency = malloc (nb_ops * sizeof (double));
+        if (bench.start == NULL || bench.latency == NULL)
+                return 1;
+
+        begin = bench_now ();
+        for (submitted = 0; submitted < nb_ops; submitted++)
+        {
+                while (lazy_get_pending (connection) >= depth)
+                        if (lazy_dispatch (connection, 1) < 0)
+                                goto error;
+
+                bench.start[submitted] = bench_now ();
+                if (lazy_flip_layer_async (connection, 0,
+                                           buffers[submitted & 1],
+                                           bench_flip_completion, &bench) < 0)
+                        goto error;
+        }
+        if (lazy_flush (connection) < 0)
+                goto error;
+        elapsed = bench_now () - begin;
+
+        qsort (bench.latency, bench.nb_done, sizeof (double),
+               bench_compare_double);
+
+        printf ("mode=%s ops=%u depth=%u size=%ux%u failed=%u\n",
+                mode == BENCH_MODE_SYNC ? "sync" :
+                mode == BENCH_MODE_ASYNC ? "async" : "ring",
+                bench.nb_done, depth, width, height, bench.nb_failed);
+        printf ("ops/sec=%.0f p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus\n",
+                bench.nb_done / elapsed,
+                bench.latency[bench.nb_done / 2] * 1e6,
+                bench.latency[bench.nb_done * 9 / 10] * 1e6,
+                bench.latency[bench.nb_done * 99 / 100] * 1e6,
+                bench.latency[bench.nb_done - 1] * 1e6);
+
+        lazy_del_layer (connection, 0);
+        lazy_del_buffer (connection, buffers[0]);
+        lazy_del_buffer (connection, buffers[1]);
+        lazy_disconnect (connection);
+
+        return 0;
+
+error:
+        fprintf (stderr, "Connection to LazyVisu lost\n");
+        lazy_disconnect (connection);
+
+        return 1;
+}
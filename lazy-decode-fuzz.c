@@ -0,0 +1,36 @@
+/*
+  libFuzzer entry point for the request decoder: the input is taken as
+  the bytes a client sent on its socket, decoded and checked request
+  after request the way the server does.
+*/
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "lazy-decode.h"
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+        lazy_request_t request;
+        long length;
+
+        while ((length = lazy_request_decode (data, size, &request)) > 0)
+        {
+                /* A request never spans more than what was received */
+                if ((size_t) length > size)
+                        abort ();
+
+                lazy_request_check (&request.command);
+
+                data += length;
+                size -= length;
+        }
+
+        return 0;
+}
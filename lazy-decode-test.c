@@ -0,0 +1,148 @@
+/*
+  Requests the decoder has to wait for, turn down or give up on, fed as
+  raw bytes the way a client would send them.
+*/
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lazy-decode.h"
+
+static int failures = 0;
+
+#define TEST_CHECK(condition) do {                                      \
+                if (!(condition))                                       \
+                {                                                       \
+                        fprintf (stderr, "%s:%d: %s failed\n",          \
+                                 __FILE__, __LINE__, #condition);       \
+                        failures++;                                     \
+                }                                                       \
+        } while (0)
+
+static void
+test_init_addbuffer (lazy_operation_addbuffer_t *operation,
+                     lazy_uint_t width, lazy_uint_t height, lazy_uint_t bpp)
+{
+        memset (operation, 0, sizeof (*operation));
+        operation->operation = LAZY_OPERATION_ADD_BUFFER;
+        operation->width = width;
+        operation->height = height;
+        operation->bpp = bpp;
+}
+
+static void
+test_truncated (void)
+{
+        lazy_operation_addbuffer_t operation;
+        lazy_request_t request;
+        size_t length;
+
+        test_init_addbuffer (&operation, 64, 64, 4);
+
+        for (length = 0; length < sizeof (operation); length++)
+                TEST_CHECK (lazy_request_decode (&operation, length,
+                                                 &request) == 0);
+
+        TEST_CHECK (lazy_request_decode (&operation, sizeof (operation),
+                                         &request) ==
+                    (long) sizeof (operation));
+        TEST_CHECK (lazy_request_check (&request.command) == 0);
+}
+
+static void
+test_oversized (void)
+{
+        lazy_operation_addbuffer_t operation;
+        lazy_operation_addlayer_t addlayer;
+        lazy_request_t request;
+
+        test_init_addbuffer (&operation, LAZY_MAX_SIZE + 1, 64, 4);
+        TEST_CHECK (lazy_request_decode (&operation, sizeof (operation),
+                                         &request) > 0);
+        TEST_CHECK (lazy_request_check (&request.command) < 0);
+
+        test_init_addbuffer (&operation, 64, (lazy_uint_t) -1, 4);
+        TEST_CHECK (lazy_request_decode (&operation, sizeof (operation),
+                                         &request) > 0);
+        TEST_CHECK (lazy_request_check (&request.command) < 0);
+
+        memset (&addlayer, 0, sizeof (addlayer));
+        addlayer.operation = LAZY_OPERATION_ADD_LAYER;
+        addlayer.width = 64;
+        addlayer.height = 64;
+        addlayer.src.w = LAZY_MAX_SIZE + 1;
+        TEST_CHECK (lazy_request_decode (&addlayer, sizeof (addlayer),
+                                         &request) > 0);
+        TEST_CHECK (lazy_request_check (&request.command) < 0);
+}
+
+static void
+test_bad_bpp (void)
+{
+        lazy_operation_addbuffer_t operation;
+        lazy_request_t request;
+        lazy_uint_t bpp;
+
+        for (bpp = 0; bpp <= 8; bpp++)
+        {
+                test_init_addbuffer (&operation, 64, 64, bpp);
+                TEST_CHECK (lazy_request_decode (&operation, sizeof (operation),
+                                                 &request) > 0);
+                TEST_CHECK ((lazy_request_check (&request.command) == 0) ==
+                            (bpp == 4));
+        }
+}
+
+static void
+test_unknown_operation (void)
+{
+        lazy_ring_command_t command;
+        lazy_request_t request;
+
+        memset (&command, 0, sizeof (command));
+        command.operation = (lazy_operation_t) 0x1000;
+        TEST_CHECK (lazy_request_decode (&command, sizeof (command),
+                                         &request) < 0);
+
+        /* Known from the operation alone, the rest need not be there */
+        TEST_CHECK (lazy_request_decode (&command, sizeof (lazy_operation_t),
+                                         &request) < 0);
+}
+
+static void
+test_add_layer_on_screen (void)
+{
+        lazy_operation_addlayeronscreen_t operation;
+        lazy_request_t request;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.addlayer.operation = LAZY_OPERATION_ADD_LAYER_ON_SCREEN;
+        operation.addlayer.width = 64;
+        operation.addlayer.height = 64;
+        operation.screen_id = 1;
+
+        /* Does not fit in a ring slot, the socket has room for it */
+        TEST_CHECK (sizeof (operation) > sizeof (lazy_ring_command_t));
+        TEST_CHECK (lazy_request_decode (&operation, sizeof (operation) - 1,
+                                         &request) == 0);
+        TEST_CHECK (lazy_request_decode (&operation, sizeof (operation),
+                                         &request) ==
+                    (long) sizeof (operation));
+        TEST_CHECK (request.addlayeronscreen.screen_id == 1);
+        TEST_CHECK (lazy_request_check (&request.command) == 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+        test_truncated ();
+        test_oversized ();
+        test_bad_bpp ();
+        test_unknown_operation ();
+        test_add_layer_on_screen ();
+
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,205 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "lazy-decode.h"
+
+/* Packed buffers are BGRA, nothing else gets composed */
+#define LAZY_BPP (4)
+
+/* Largest line of a packed buffer, in bytes */
+#define LAZY_MAX_PITCH (LAZY_MAX_SIZE * LAZY_BPP)
+
+size_t
+lazy_request_size (lazy_operation_t operation)
+{
+        switch (operation)
+        {
+        case LAZY_OPERATION_ADD_LAYER:
+                return sizeof (lazy_operation_addlayer_t);
+        case LAZY_OPERATION_DEL_LAYER:
+                return sizeof (lazy_operation_dellayer_t);
+        case LAZY_OPERATION_FLIP_LAYER:
+                return sizeof (lazy_operation_fliplayer_t);
+        case LAZY_OPERATION_ADD_BUFFER:
+                return sizeof (lazy_operation_addbuffer_t);
+        case LAZY_OPERATION_DEL_BUFFER:
+                return sizeof (lazy_operation_delbuffer_t);
+        case LAZY_OPERATION_ADD_RING:
+                return sizeof (lazy_operation_addring_t);
+        case LAZY_OPERATION_KICK_RING:
+                return sizeof (lazy_operation_t);
+        case LAZY_OPERATION_SET_LAYER_GEOMETRY:
+                return sizeof (lazy_operation_setlayergeometry_t);
+        case LAZY_OPERATION_SET_LAYER_OPACITY:
+                return sizeof (lazy_operation_setlayeropacity_t);
+        case LAZY_OPERATION_SET_LAYER_ZORDER:
+                return sizeof (lazy_operation_setlayerzorder_t);
+        case LAZY_OPERATION_ADD_PITCHED_BUFFER:
+                return sizeof (lazy_operation_addpitchedbuffer_t);
+        case LAZY_OPERATION_GET_STATS:
+                return sizeof (lazy_operation_getstats_t);
+        case LAZY_OPERATION_ADD_PLANAR_BUFFER:
+                return sizeof (lazy_operation_addplanarbuffer_t);
+        case LAZY_OPERATION_ADD_LAYER_ON_SCREEN:
+                return sizeof (lazy_operation_addlayeronscreen_t);
+        default:
+                return 0;
+        }
+}
+
+size_t
+lazy_response_size (lazy_operation_t operation)
+{
+        switch (operation)
+        {
+        case LAZY_OPERATION_ADD_LAYER:
+        case LAZY_OPERATION_ADD_LAYER_ON_SCREEN:
+                return sizeof (lazy_operation_addlayer_res_t);
+        case LAZY_OPERATION_DEL_LAYER:
+                return sizeof (lazy_operation_dellayer_res_t);
+        case LAZY_OPERATION_FLIP_LAYER:
+                return sizeof (lazy_operation_fliplayer_res_t);
+        case LAZY_OPERATION_ADD_BUFFER:
+                return sizeof (lazy_operation_addbuffer_res_t);
+        case LAZY_OPERATION_DEL_BUFFER:
+                return sizeof (lazy_operation_delbuffer_res_t);
+        case LAZY_OPERATION_ADD_RING:
+                return sizeof (lazy_operation_addring_res_t);
+        case LAZY_OPERATION_SET_LAYER_GEOMETRY:
+                return sizeof (lazy_operation_setlayergeometry_res_t);
+        case LAZY_OPERATION_SET_LAYER_OPACITY:
+                return sizeof (lazy_operation_setlayeropacity_res_t);
+        case LAZY_OPERATION_SET_LAYER_ZORDER:
+                return sizeof (lazy_operation_setlayerzorder_res_t);
+        case LAZY_OPERATION_ADD_PITCHED_BUFFER:
+                return sizeof (lazy_operation_addpitchedbuffer_res_t);
+        case LAZY_OPERATION_GET_STATS:
+                return sizeof (lazy_operation_getstats_res_t);
+        case LAZY_OPERATION_ADD_PLANAR_BUFFER:
+                return sizeof (lazy_operation_addplanarbuffer_res_t);
+        default:
+                return 0;
+        }
+}
+
+long
+lazy_request_decode (const void *data, size_t length,
+                     lazy_request_t *request)
+{
+        lazy_operation_t operation;
+        size_t size;
+
+        if (length < sizeof (operation))
+                return 0;
+
+        memcpy (&operation, data, sizeof (operation));
+        size = lazy_request_size (operation);
+        if (size == 0 || size > sizeof (*request))
+                return -1;
+
+        if (length < size)
+                return 0;
+
+        memset (request, 0, sizeof (*request));
+        memcpy (request, data, size);
+
+        return size;
+}
+
+/* Sides and offsets are bounded, so sums of them cannot wrap around. */
+static int
+lazy_check_size (lazy_uint_t width, lazy_uint_t height)
+{
+        return width > 0 && width <= LAZY_MAX_SIZE &&
+                height > 0 && height <= LAZY_MAX_SIZE;
+}
+
+static int
+lazy_check_rectangle (const lazy_rectangle_t *rectangle)
+{
+        return rectangle->x <= LAZY_MAX_SIZE &&
+                rectangle->y <= LAZY_MAX_SIZE &&
+                rectangle->w <= LAZY_MAX_SIZE &&
+                rectangle->h <= LAZY_MAX_SIZE;
+}
+
+static int
+lazy_check_easing (lazy_easing_t easing)
+{
+        return (unsigned int) easing <= LAZY_EASING_EASE_IN_OUT;
+}
+
+/* Destinations may start off screen, on either side */
+static int
+lazy_check_addlayer (const lazy_operation_addlayer_t *addlayer)
+{
+        return lazy_check_size (addlayer->width, addlayer->height) &&
+                lazy_check_rectangle (&addlayer->src) &&
+                addlayer->dst.w <= LAZY_MAX_SIZE &&
+                addlayer->dst.h <= LAZY_MAX_SIZE;
+}
+
+int
+lazy_request_check (const lazy_ring_command_t *command)
+{
+        const lazy_operation_addbuffer_t *addbuffer;
+        const lazy_operation_addpitchedbuffer_t *addpitchedbuffer;
+        const lazy_operation_addplanarbuffer_t *addplanarbuffer;
+        const lazy_operation_setlayergeometry_t *setlayergeometry;
+        const lazy_operation_setlayeropacity_t *setlayeropacity;
+        int ok;
+
+        switch (command->operation)
+        {
+        case LAZY_OPERATION_ADD_LAYER:
+        case LAZY_OPERATION_ADD_LAYER_ON_SCREEN:
+                ok = lazy_check_addlayer (&command->addlayer);
+                break;
+
+        case LAZY_OPERATION_ADD_BUFFER:
+                addbuffer = &command->addbuffer;
+                ok = lazy_check_size (addbuffer->width, addbuffer->height) &&
+                        addbuffer->bpp == LAZY_BPP;
+                break;
+
+        case LAZY_OPERATION_ADD_PITCHED_BUFFER:
+                addpitchedbuffer = &command->addpitchedbuffer;
+                ok = lazy_check_size (addpitchedbuffer->width,
+                                      addpitchedbuffer->height) &&
+                        addpitchedbuffer->bpp == LAZY_BPP &&
+                        addpitchedbuffer->pitch <= LAZY_MAX_PITCH;
+                break;
+
+        case LAZY_OPERATION_ADD_PLANAR_BUFFER:
+                addplanarbuffer = &command->addplanarbuffer;
+                ok = lazy_check_size (addplanarbuffer->width,
+                                      addplanarbuffer->height) &&
+                        addplanarbuffer->pitch <= LAZY_MAX_PITCH &&
+                        (addplanarbuffer->format == LAZY_FORMAT_I420 ||
+                         addplanarbuffer->format == LAZY_FORMAT_YV12);
+                break;
+
+        case LAZY_OPERATION_SET_LAYER_GEOMETRY:
+                setlayergeometry = &command->setlayergeometry;
+                ok = lazy_check_rectangle (&setlayergeometry->src) &&
+                        setlayergeometry->dst.w <= LAZY_MAX_SIZE &&
+                        setlayergeometry->dst.h <= LAZY_MAX_SIZE &&
+                        lazy_check_easing (setlayergeometry->easing);
+                break;
+
+        case LAZY_OPERATION_SET_LAYER_OPACITY:
+                setlayeropacity = &command->setlayeropacity;
+                ok = setlayeropacity->opacity <= 255 &&
+                        lazy_check_easing (setlayeropacity->easing);
+                break;
+
+        default:
+                ok = lazy_request_size (command->operation) != 0;
+                break;
+        }
+
+        return ok ? 0 : -1;
+}
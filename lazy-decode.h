@@ -0,0 +1,61 @@
+#ifndef __LAZY_DECODE_H__
+#define __LAZY_DECODE_H__
+
+#include <stddef.h>
+
+#if !defined(__LONG_TYPE_32__) && !defined(__LONG_TYPE_64)
+# if defined(__SIZEOF_LONG__) && (__SIZEOF_LONG__ == 4)
+#  define __LONG_TYPE_32__
+# else
+#  define __LONG_TYPE_64
+# endif
+#endif
+#include "lazy_passthrough_internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Server side decoding of the LazyVisu protocol, kept apart from the
+  compositor so that it can be driven on its own, by a fuzzer or a
+  test, with arbitrary bytes.
+
+  Nothing in a request is trusted: lazy_request_check() has to accept
+  it before any of its fields is used.
+*/
+
+/* Any request, those sent on the socket only may not fit in a ring */
+typedef union
+{
+        lazy_operation_t operation;
+
+        lazy_ring_command_t command;
+        lazy_operation_addlayeronscreen_t addlayeronscreen;
+} lazy_request_t;
+
+/* Bytes of a request, operation included, 0 for an unknown operation */
+size_t lazy_request_size (lazy_operation_t operation);
+
+/* Bytes of the result sent back on the socket, 0 when there is none */
+size_t lazy_response_size (lazy_operation_t operation);
+
+/*
+  Copies the request at the start of length bytes of data to request.
+  Returns the bytes it spans, 0 when more are needed and -1 when the
+  operation is unknown and the stream cannot be followed anymore.
+*/
+long lazy_request_decode (const void *data, size_t length,
+                          lazy_request_t *request);
+
+/*
+  0 when the fields of command are within what the server accepts.
+  Only the ADD_LAYER part of an ADD_LAYER_ON_SCREEN is looked at.
+*/
+int lazy_request_check (const lazy_ring_command_t *command);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LAZY_DECODE_H__ */
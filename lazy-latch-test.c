@@ -0,0 +1,187 @@
+/*
+  Latching of flips skipped as unchanged, by whole content hashes and by
+  tiles: a client flips A, then B with the same pixels, and rewrites A
+  before the stage paints. What lands in the texture must come from B.
+
+  The flips and uploads go through the mixer and the layer as the server
+  does them, the texture is read back to see what was sent. It needs a
+  display, and is skipped without one. The compositor is built in with
+  its main() out of the way.
+*/
+#define main lazyvisu_main
+#include "LazyVisu.c"
+#undef main
+
+#define TEST_WIDTH  (2 * TILE_SIZE)
+#define TEST_HEIGHT (2 * TILE_SIZE)
+
+/* Exit status automake counts as a skipped test */
+#define TEST_SKIP (77)
+
+static gint failures = 0;
+
+#define TEST_CHECK(condition) do {                                      \
+                if (!(condition))                                       \
+                {                                                       \
+                        g_printerr ("%s:%d: %s failed\n",               \
+                                    __FILE__, __LINE__, #condition);    \
+                        failures++;                                     \
+                }                                                       \
+        } while (0)
+
+/* Opaque grey, premultiplying it leaves it as it is */
+static void
+test_fill_tile (guint8 *pixels, gint pitch, gint tx, gint ty, guint8 value)
+{
+        gint x, y;
+
+        for (y = ty * TILE_SIZE; y < (ty + 1) * TILE_SIZE; y++)
+        {
+                guint8 *pixel = pixels + y * pitch + tx * TILE_SIZE * 4;
+
+                for (x = 0; x < TILE_SIZE; x++, pixel += 4)
+                {
+                        pixel[0] = pixel[1] = pixel[2] = value;
+                        pixel[3] = 0xff;
+                }
+        }
+}
+
+static void
+test_fill (emu_buffer_t *buffer, guint8 value)
+{
+        gint tx, ty;
+
+        for (ty = 0; ty < buffer->height / TILE_SIZE; ty++)
+                for (tx = 0; tx < buffer->width / TILE_SIZE; tx++)
+                        test_fill_tile (buffer->ptr, buffer->pitch,
+                                        tx, ty, value);
+}
+
+static emu_buffer_t *
+test_buffer_new (guint id, gchar *name, guint8 value)
+{
+        emu_buffer_t *buffer;
+
+        buffer = g_new0 (emu_buffer_t, 1);
+        buffer->filename = name;
+        buffer->fd = -1;
+        buffer->id = id;
+        buffer->width = TEST_WIDTH;
+        buffer->height = TEST_HEIGHT;
+        buffer->bpp = 4;
+        buffer->pitch = TEST_WIDTH * 4;
+        buffer->format = LAZY_FORMAT_PACKED;
+        emu_format_get_planes (buffer->format,
+                               buffer->width, buffer->height,
+                               buffer->bpp, buffer->pitch,
+                               buffer->planes, &buffer->nb_planes);
+        buffer->ptr = g_malloc (buffer->pitch * buffer->height);
+        test_fill (buffer, value);
+
+        return buffer;
+}
+
+static void
+test_buffer_free (emu_buffer_t *buffer)
+{
+        g_free (buffer->ptr);
+        g_free (buffer->tile_hashes);
+        g_free (buffer);
+}
+
+/* Value of the top left pixel of a tile in the layer texture */
+static gint
+test_texture_tile (emu_layer_t *layer, gint tx, gint ty)
+{
+        CoglHandle texture;
+        guint8 *data;
+        gint value;
+
+        texture = clutter_texture_get_cogl_texture (CLUTTER_TEXTURE (layer->actor));
+        if (texture == COGL_INVALID_HANDLE)
+                return -1;
+
+        data = g_malloc (TEST_WIDTH * TEST_HEIGHT * 4);
+        cogl_texture_get_data (texture, COGL_PIXEL_FORMAT_BGRA_8888,
+                               TEST_WIDTH * 4, data);
+        value = data[ty * TILE_SIZE * TEST_WIDTH * 4 + tx * TILE_SIZE * 4];
+        g_free (data);
+
+        return value;
+}
+
+/*
+  old everywhere, then A and B changing the first tile only. A gets
+  rewritten once B is flipped, expected_size is what the next paint
+  should then send.
+*/
+static void
+test_latch (emu_mixer_t *mixer, gsize expected_size)
+{
+        emu_layer_t *layer = emu_layer_new (1, TEST_WIDTH, TEST_HEIGHT);
+        emu_buffer_t *old = test_buffer_new (1, "old", 0x11);
+        emu_buffer_t *a = test_buffer_new (2, "A", 0x11);
+        emu_buffer_t *b = test_buffer_new (3, "B", 0x11);
+        emu_buffer_t *c = test_buffer_new (4, "C", 0x11);
+
+        test_fill_tile (a->ptr, a->pitch, 0, 0, 0x22);
+        test_fill_tile (b->ptr, b->pitch, 0, 0, 0x22);
+        test_fill_tile (c->ptr, c->pitch, 0, 0, 0x22);
+
+        emu_mixer_flip_layer (mixer, layer, old);
+        TEST_CHECK (emu_layer_upload (layer) ==
+                    (gsize) TEST_WIDTH * TEST_HEIGHT * 4);
+        TEST_CHECK (layer->buffer == old);
+
+        emu_mixer_flip_layer (mixer, layer, a);
+        TEST_CHECK (layer->pending == a);
+        emu_mixer_flip_layer (mixer, layer, b);
+        TEST_CHECK (layer->pending == b);
+
+        /* A belongs to the client again */
+        test_fill_tile (a->ptr, a->pitch, 0, 0, 0x33);
+        test_fill_tile (a->ptr, a->pitch, 1, 0, 0x33);
+
+        TEST_CHECK (emu_layer_upload (layer) == expected_size);
+        TEST_CHECK (layer->buffer == b);
+        TEST_CHECK (test_texture_tile (layer, 0, 0) == 0x22);
+        TEST_CHECK (test_texture_tile (layer, 1, 0) == 0x11);
+        TEST_CHECK (test_texture_tile (layer, 0, 1) == 0x11);
+
+        /* Nothing pending, the skipped buffer is the one to re-latch */
+        emu_mixer_flip_layer (mixer, layer, c);
+        TEST_CHECK (layer->pending == NULL);
+        TEST_CHECK (layer->buffer == c);
+        TEST_CHECK (emu_layer_upload (layer) == 0);
+
+        emu_layer_free (layer);
+        test_buffer_free (old);
+        test_buffer_free (a);
+        test_buffer_free (b);
+        test_buffer_free (c);
+}
+
+int
+main (int argc, char *argv[])
+{
+        emu_mixer_t *mixer;
+
+        if (clutter_init (&argc, &argv) != CLUTTER_INIT_SUCCESS)
+                return TEST_SKIP;
+
+        mixer = emu_mixer_new (CLUTTER_STAGE (clutter_stage_get_default ()),
+                               0, 0);
+
+        dedup_uploads = TRUE;
+        tile_diff = FALSE;
+        test_latch (mixer, (gsize) TEST_WIDTH * TEST_HEIGHT * 4);
+
+        /* Only the first tile differs from what was painted */
+        tile_diff = TRUE;
+        test_latch (mixer, (gsize) TILE_SIZE * TILE_SIZE * 4);
+
+        emu_mixer_free (mixer);
+
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,612 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "liblazy.h"
+#include "lazy-decode.h"
+
+/*
+  Synthetic load generator: drives N layers of M buffers each with
+  flips at a given rate, rewriting a damaged area before each flip,
+  then prints one JSON object per run so results can be collected
+  across releases. It may first throw malformed requests at the
+  server, which has to survive them.
+*/
+
+/* Malformed requests sent on each connection before dropping it */
+#define LOAD_GARBAGE_PER_CONNECTION (64)
+
+typedef struct
+{
+        double  *start;
+        double  *latency;
+        unsigned int nb_done;
+        unsigned int nb_failed;
+} load_t;
+
+typedef struct
+{
+        double        cpu;
+        unsigned long rss_kb;
+} load_usage_t;
+
+static double
+load_now (void)
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+load_compare_double (const void *a, const void *b)
+{
+        double da = *(const double *) a, db = *(const double *) b;
+
+        return (da > db) - (da < db);
+}
+
+static double
+load_percentile (const load_t *load, unsigned int percent)
+{
+        if (load->nb_done == 0)
+                return 0;
+
+        return load->latency[(load->nb_done - 1) * percent / 100];
+}
+
+/* CPU seconds and resident size of a process, from /proc. */
+static int
+load_get_usage (int pid, load_usage_t *usage)
+{
+        char filename[64], line[256];
+        unsigned long utime, stime;
+        FILE *file;
+        int ret;
+
+        snprintf (filename, sizeof (filename), "/proc/%i/stat", pid);
+        file = fopen (filename, "r");
+        if (file == NULL)
+                return -1;
+        ret = fscanf (file,
+                      "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                      &utime, &stime);
+        fclose (file);
+        if (ret != 2)
+                return -1;
+
+        usage->cpu = (double) (utime + stime) / sysconf (_SC_CLK_TCK);
+        usage->rss_kb = 0;
+
+        snprintf (filename, sizeof (filename), "/proc/%i/status", pid);
+        file = fopen (filename, "r");
+        if (file == NULL)
+                return -1;
+        while (fgets (line, sizeof (line), file))
+                if (sscanf (line, "VmRSS: %lu", &usage->rss_kb) == 1)
+                        break;
+        fclose (file);
+
+        return 0;
+}
+
+static void
+load_flip_completion (lazy_connection_t *connection,
+                      lazy_operation_t operation,
+                      const void *result,
+                      void *user_data)
+{
+        const lazy_operation_fliplayer_res_t *res = result;
+        load_t *load = user_data;
+
+        load->latency[load->nb_done] = load_now () - load->start[load->nb_done];
+        if (res->result != LAZY_OPERATION_RESULT_SUCCESS)
+                load->nb_failed++;
+        load->nb_done++;
+}
+
+static int
+load_connect_raw (const char *host, int port)
+{
+        struct addrinfo hints, *addresses, *address;
+        char service[16];
+        int fd = -1;
+
+        memset (&hints, 0, sizeof (hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        snprintf (service, sizeof (service), "%i",
+                  port > 0 ? port : LAZY_PASSTHROUGH_PORT);
+        if (getaddrinfo (host ? host : LAZY_PASSTHROUGH_HOST, service,
+                         &hints, &addresses) != 0)
+                return -1;
+
+        for (address = addresses; address != NULL; address = address->ai_next)
+        {
+                fd = socket (address->ai_family, address->ai_socktype,
+                             address->ai_protocol);
+                if (fd < 0)
+                        continue;
+                if (connect (fd, address->ai_addr, address->ai_addrlen) == 0)
+                        break;
+                close (fd);
+                fd = -1;
+        }
+        freeaddrinfo (addresses);
+
+        return fd;
+}
+
+/*
+  Sends nb requests of random operations with random fields, small
+  enough half of the time to get past the first checks, on connections
+  that are dropped without reading a result, some of them mid-request.
+*/
+static int
+load_send_garbage (const char *host, int port, unsigned int nb,
+                   unsigned int seed)
+{
+        lazy_request_t command;
+        lazy_uint_t *fields = (lazy_uint_t *) ((char *) &command +
+                                               sizeof (lazy_operation_t));
+        unsigned int i, f, nb_fields;
+        size_t size;
+        int fd = -1;
+
+        srand (seed);
+        for (i = 0; i < nb; i++)
+        {
+                if (fd < 0 && (fd = load_connect_raw (host, port)) < 0)
+                        return -1;
+
+                command.operation = rand () % (LAZY_OPERATION_ADD_LAYER_ON_SCREEN + 2);
+                size = lazy_request_size (command.operation);
+                if (size == 0)
+                        size = sizeof (command);
+
+                nb_fields = (sizeof (command) - sizeof (lazy_operation_t)) /
+                        sizeof (lazy_uint_t);
+                for (f = 0; f < nb_fields; f++)
+                        fields[f] = (rand () & 1) ? (lazy_uint_t) rand () :
+                                (lazy_uint_t) (rand () % 1024);
+
+                if (rand () % 16 == 0)
+                        size = rand () % size;
+
+                if (send (fd, &command, size, MSG_NOSIGNAL) < 0 ||
+                    (i + 1) % LOAD_GARBAGE_PER_CONNECTION == 0 ||
+                    size < lazy_request_size (command.operation))
+                {
+                        close (fd);
+                        fd = -1;
+                }
+        }
+
+        if (fd >= 0)
+                close (fd);
+
+        return 0;
+}
+
+/*
+  Sends a request that is well formed but asks for what the server
+  cannot do, a 24 bit buffer, and checks that it is turned down.
+  Returns -1 when it is not, or when the server does not answer.
+*/
+static int
+load_check_rejected (const char *host, int port)
+{
+        lazy_operation_addbuffer_t operation;
+        lazy_operation_addbuffer_res_t res_operation;
+        ssize_t size = 0, received;
+        int fd;
+
+        if ((fd = load_connect_raw (host, port)) < 0)
+                return -1;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_ADD_BUFFER;
+        operation.width = 64;
+        operation.height = 64;
+        operation.bpp = 3;
+
+        if (send (fd, &operation, sizeof (operation), MSG_NOSIGNAL) !=
+            sizeof (operation))
+        {
+                close (fd);
+                return -1;
+        }
+
+        while (size < (ssize_t) sizeof (res_operation))
+        {
+                received = recv (fd, (char *) &res_operation + size,
+                                 sizeof (res_operation) - size, 0);
+                if (received < 0 && errno == EINTR)
+                        continue;
+                if (received <= 0)
+                        break;
+                size += received;
+        }
+        close (fd);
+
+        if (size < (ssize_t) sizeof (res_operation) ||
+            res_operation.result != LAZY_OPERATION_RESULT_FAILURE)
+                return -1;
+
+        return 0;
+}
+
+static void
+usage (const char *name)
+{
+        fprintf (stderr,
+                 "Usage: %s [options]\n"
+                 "  -h host        server host\n"
+                 "  -p port        server port\n"
+                 "  -b path        path to buffers\n"
+                 "  -N name        scenario name reported in the results\n"
+                 "  -l layers      number of layers (1)\n"
+                 "  -L id          id of the first layer, to share a server (0)\n"
+                 "  -m buffers     buffers per layer (2)\n"
+                 "  -s WxH         layer resolution (320x240)\n"
+                 "  -v             I420 video buffers instead of BGR(A)\n"
+                 "  -r rate        flips per second per layer, 0 unthrottled (60)\n"
+                 "  -D WxH         damaged area rewritten before each flip (full)\n"
+                 "  -n flips       total number of flips (1000)\n"
+                 "  -q depth       maximum flips in flight (4)\n"
+                 "  -P pid         also report CPU time and RSS of the server\n"
+                 "  -w ms          keep retrying to connect while the server starts (0)\n"
+                 "  -S ms          fail when the server took longer to its first frame\n"
+                 "  -G nb[:seed]   first send nb malformed requests, the server must survive\n"
+                 "  -T rate        fail under rate flips per second\n"
+                 "  -U             fail unless the server streamed uploads through pixel buffers\n",
+                 name);
+        exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+        const char *host = NULL, *path_to_buffers = NULL, *name = "default";
+        int port = 0, server_pid = 0, opt;
+        unsigned int wait_ms = 0, startup_budget_ms = 0;
+        unsigned int nb_garbage = 0, garbage_seed = 1, min_rate = 0;
+        unsigned int need_streaming = 0;
+        unsigned int first_layer = 0, nb_layers = 1, nb_buffers = 2, width = 320, height = 240;
+        /* The server composes BGRA only, there is no 24 bit path to load */
+        const unsigned int bpp = 4;
+        unsigned int rate = 60, damage_w = 0, damage_h = 0;
+        unsigned int nb_flips = 1000, depth = 4, video = 0;
+        unsigned int i, l, b;
+        lazy_uint_t *buffers;
+        lazy_plane_t planes[LAZY_MAX_PLANES];
+        lazy_connection_t *connection;
+        lazy_operation_getstats_res_t stats_begin, stats_end;
+        load_usage_t server_begin, server_end;
+        struct rusage client_usage;
+        load_t load;
+        double begin, elapsed, interval;
+
+        while ((opt = getopt (argc, argv, "h:p:b:N:l:L:m:s:vr:D:n:q:P:w:S:G:T:U")) != -1)
+        {
+                switch (opt)
+                {
+                case 'h':
+                        host = optarg;
+                        break;
+                case 'p':
+                        port = atoi (optarg);
+                        break;
+                case 'b':
+                        path_to_buffers = optarg;
+                        break;
+                case 'N':
+                        name = optarg;
+                        break;
+                case 'l':
+                        nb_layers = strtoul (optarg, NULL, 0);
+                        break;
+                case 'L':
+                        first_layer = strtoul (optarg, NULL, 0);
+                        break;
+                case 'm':
+                        nb_buffers = strtoul (optarg, NULL, 0);
+                        break;
+                case 's':
+                        if (sscanf (optarg, "%ux%u", &width, &height) != 2)
+                                usage (argv[0]);
+                        break;
+                case 'v':
+                        video = 1;
+                        break;
+                case 'r':
+                        rate = strtoul (optarg, NULL, 0);
+                        break;
+                case 'D':
+                        if (sscanf (optarg, "%ux%u", &damage_w, &damage_h) != 2)
+                                usage (argv[0]);
+                        break;
+                case 'n':
+                        nb_flips = strtoul (optarg, NULL, 0);
+                        break;
+                case 'q':
+                        depth = strtoul (optarg, NULL, 0);
+                        break;
+                case 'P':
+                        server_pid = atoi (optarg);
+                        break;
+                case 'w':
+                        wait_ms = strtoul (optarg, NULL, 0);
+                        break;
+                case 'S':
+                        startup_budget_ms = strtoul (optarg, NULL, 0);
+                        break;
+                case 'G':
+                        if (sscanf (optarg, "%u:%u", &nb_garbage, &garbage_seed) < 1)
+                                usage (argv[0]);
+                        break;
+                case 'T':
+                        min_rate = strtoul (optarg, NULL, 0);
+                        break;
+                case 'U':
+                        need_streaming = 1;
+                        break;
+                default:
+                        usage (argv[0]);
+                }
+        }
+
+        if (nb_layers == 0 || nb_buffers == 0 || width == 0 || height == 0 ||
+            nb_flips == 0 || depth == 0)
+                usage (argv[0]);
+
+        if (damage_w == 0 || damage_w > width)
+                damage_w = width;
+        if (damage_h == 0 || damage_h > height)
+                damage_h = height;
+
+        if (nb_garbage &&
+            load_send_garbage (host, port, nb_garbage, garbage_seed) < 0)
+        {
+                fprintf (stderr, "LazyVisu went away under malformed requests\n");
+                return 1;
+        }
+
+        if (nb_garbage && load_check_rejected (host, port) < 0)
+        {
+                fprintf (stderr, "LazyVisu did not turn down a 24 bit buffer\n");
+                return 1;
+        }
+
+        /* The server binds its port first and accepts once it is up */
+        begin = load_now ();
+        while ((connection = lazy_connect (host, port, path_to_buffers)) == NULL &&
+               load_now () - begin < wait_ms / 1e3)
+                usleep (10000);
+        if (connection == NULL)
+        {
+                fprintf (stderr, "Cannot connect to LazyVisu\n");
+                return 1;
+        }
+
+        /* Its first frame may still be on its way */
+        memset (&stats_begin, 0, sizeof (stats_begin));
+        while (lazy_get_stats (connection, &stats_begin) == 0 &&
+               stats_begin.startup_frame_us == 0 &&
+               load_now () - begin < wait_ms / 1e3)
+                usleep (10000);
+
+        buffers = calloc (nb_layers * nb_buffers, sizeof (lazy_uint_t));
+        load.start = malloc (nb_flips * sizeof (double));
+        load.latency = malloc (nb_flips * sizeof (double));
+        if (buffers == NULL || load.start == NULL || load.latency == NULL)
+                return 1;
+        load.nb_done = load.nb_failed = 0;
+
+        for (l = 0; l < nb_layers; l++)
+        {
+                lazy_rectangle_t src, dst;
+
+                for (b = 0; b < nb_buffers; b++)
+                {
+                        lazy_uint_t *buffer_id = &buffers[l * nb_buffers + b];
+
+                        if ((video ?
+                             lazy_add_planar_buffer (connection, width, height,
+                                                     LAZY_FORMAT_I420, 0,
+                                                     buffer_id, planes) :
+                             lazy_add_buffer (connection, width, height, bpp,
+                                              buffer_id)) < 0)
+                        {
+                                fprintf (stderr, "Cannot add buffer\n");
+                                return 1;
+                        }
+                }
+
+                src.x = src.y = 0;
+                src.w = width;
+                src.h = height;
+                dst = src;
+                dst.x = dst.y = 16 * l;
+
+                if (lazy_add_layer (connection, first_layer + l, width, height,
+                                    &src, &dst, buffers[l * nb_buffers]) < 0)
+                {
+                        fprintf (stderr, "Cannot add layer\n");
+                        return 1;
+                }
+        }
+
+        memset (&stats_begin, 0, sizeof (stats_begin));
+        lazy_get_stats (connection, &stats_begin);
+        if (server_pid && load_get_usage (server_pid, &server_begin) < 0)
+        {
+                fprintf (stderr, "Cannot read usage of process %i\n", server_pid);
+                server_pid = 0;
+        }
+
+        interval = rate ? 1.0 / ((double) rate * nb_layers) : 0;
+
+        begin = load_now ();
+        for (i = 0; i < nb_flips; i++)
+        {
+                unsigned char *pixels;
+                lazy_uint_t buffer_id, pitch;
+                unsigned int y;
+
+                /* Wait for the next slot, collecting acks meanwhile. */
+                while (1)
+                {
+                        double wait = begin + i * interval - load_now ();
+                        struct pollfd pfd = { lazy_get_fd (connection), POLLIN, 0 };
+
+                        if (lazy_get_pending (connection) >= depth)
+                                wait = -1;
+                        else if (wait <= 0)
+                                break;
+
+                        if (lazy_get_pending (connection) == 0)
+                        {
+                                struct timespec ts;
+
+                                ts.tv_sec = (time_t) wait;
+                                ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+                                nanosleep (&ts, NULL);
+                                continue;
+                        }
+
+                        if (poll (&pfd, 1, wait < 0 ? -1 : (int) (wait * 1000)) > 0 &&
+                            lazy_dispatch (connection, 0) < 0)
+                                goto error;
+                }
+
+                l = i % nb_layers;
+                b = (i / nb_layers + 1) % nb_buffers;
+                buffer_id = buffers[l * nb_buffers + b];
+
+                pixels = lazy_buffer_map (connection, buffer_id, &pitch);
+                if (pixels && video)
+                {
+                        unsigned int p;
+
+                        for (p = 0; p < LAZY_MAX_PLANES; p++)
+                        {
+                                unsigned int shift = (p > 0);
+
+                                for (y = 0; y < (damage_h + shift) >> shift; y++)
+                                        memset (pixels + planes[p].offset +
+                                                y * planes[p].pitch,
+                                                i & 0xff,
+                                                (damage_w + shift) >> shift);
+                        }
+                }
+                else if (pixels)
+                        for (y = 0; y < damage_h; y++)
+                                memset (pixels + y * pitch, i & 0xff,
+                                        damage_w * bpp);
+
+                load.start[i] = load_now ();
+                if (lazy_flip_layer_async (connection, first_layer + l, buffer_id,
+                                           load_flip_completion, &load) < 0)
+                        goto error;
+        }
+        if (lazy_flush (connection) < 0)
+                goto error;
+        elapsed = load_now () - begin;
+
+        memset (&stats_end, 0, sizeof (stats_end));
+        lazy_get_stats (connection, &stats_end);
+        getrusage (RUSAGE_SELF, &client_usage);
+
+        qsort (load.latency, load.nb_done, sizeof (double),
+               load_compare_double);
+
+        printf ("{\"scenario\": \"%s\", \"layers\": %u, \"buffers\": %u, "
+                "\"width\": %u, \"height\": %u, \"bpp\": %u, "
+                "\"format\": \"%s\", \"rate\": %u, "
+                "\"damage_width\": %u, \"damage_height\": %u, "
+                "\"flips\": %u, \"failed\": %u, \"seconds\": %.3f, "
+                "\"flips_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                "\"server_uploads\": %u, \"server_redundant_uploads\": %u, "
+                "\"server_upload_kbytes\": %u, \"server_dedup_kbytes\": %u, "
+                "\"server_deferred_uploads\": %u, \"server_quality_level\": %u, "
+                "\"server_streamed_uploads\": %u, "
+                "\"server_startup_listen_ms\": %.1f, "
+                "\"server_startup_frame_ms\": %.1f, "
+                "\"client_cpu_s\": %.3f, \"client_rss_kb\": %ld",
+                name, nb_layers, nb_buffers, width, height, bpp,
+                video ? "i420" : "packed", rate,
+                damage_w, damage_h,
+                load.nb_done, load.nb_failed, elapsed,
+                load.nb_done / elapsed,
+                load_percentile (&load, 50) * 1e6,
+                load_percentile (&load, 99) * 1e6,
+                stats_end.nb_uploads - stats_begin.nb_uploads,
+                stats_end.nb_redundant_uploads - stats_begin.nb_redundant_uploads,
+                stats_end.upload_kbytes - stats_begin.upload_kbytes,
+                stats_end.dedup_kbytes - stats_begin.dedup_kbytes,
+                stats_end.nb_deferred_uploads - stats_begin.nb_deferred_uploads,
+                stats_end.quality_level,
+                stats_end.nb_streamed_uploads - stats_begin.nb_streamed_uploads,
+                stats_end.startup_listen_us / 1e3,
+                stats_end.startup_frame_us / 1e3,
+                client_usage.ru_utime.tv_sec + client_usage.ru_utime.tv_usec / 1e6 +
+                client_usage.ru_stime.tv_sec + client_usage.ru_stime.tv_usec / 1e6,
+                client_usage.ru_maxrss);
+        if (server_pid && load_get_usage (server_pid, &server_end) == 0)
+                printf (", \"server_cpu_s\": %.3f, \"server_rss_kb\": %lu",
+                        server_end.cpu - server_begin.cpu, server_end.rss_kb);
+        printf ("}\n");
+
+        for (l = 0; l < nb_layers; l++)
+                lazy_del_layer (connection, first_layer + l);
+        for (i = 0; i < nb_layers * nb_buffers; i++)
+                lazy_del_buffer (connection, buffers[i]);
+        lazy_disconnect (connection);
+
+        if (startup_budget_ms &&
+            (stats_end.startup_frame_us == 0 ||
+             stats_end.startup_frame_us > startup_budget_ms * 1000))
+        {
+                fprintf (stderr, "Server startup over %u ms budget\n",
+                         startup_budget_ms);
+                return 1;
+        }
+
+        if (need_streaming &&
+            stats_end.nb_streamed_uploads == stats_begin.nb_streamed_uploads)
+        {
+                fprintf (stderr, "No upload went through pixel buffers\n");
+                return 1;
+        }
+
+        if (min_rate && load.nb_done < min_rate * elapsed)
+        {
+                fprintf (stderr, "Throughput under %u flips per second\n",
+                         min_rate);
+                return 1;
+        }
+
+        return 0;
+
+error:
+        fprintf (stderr, "Connection to LazyVisu lost\n");
+        lazy_disconnect (connection);
+
+        return 1;
+}
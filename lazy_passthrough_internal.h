@@ -6,6 +6,9 @@
 
 #define LAZY_FILENAME_MAX_LENGHT (10)
 
+/* Largest width or height of a buffer or layer */
+#define LAZY_MAX_SIZE (8192)
+
 typedef char lazy_char_t;
 
 #ifdef __LONG_TYPE_32__
@@ -24,6 +27,15 @@ typedef enum
         LAZY_OPERATION_FLIP_LAYER,
         LAZY_OPERATION_ADD_BUFFER,
         LAZY_OPERATION_DEL_BUFFER,
+        LAZY_OPERATION_ADD_RING,
+        LAZY_OPERATION_KICK_RING,
+        LAZY_OPERATION_SET_LAYER_GEOMETRY,
+        LAZY_OPERATION_SET_LAYER_OPACITY,
+        LAZY_OPERATION_SET_LAYER_ZORDER,
+        LAZY_OPERATION_ADD_PITCHED_BUFFER,
+        LAZY_OPERATION_GET_STATS,
+        LAZY_OPERATION_ADD_PLANAR_BUFFER,
+        LAZY_OPERATION_ADD_LAYER_ON_SCREEN,
 } lazy_operation_t;
 
 /**/
@@ -62,6 +74,19 @@ typedef struct
         lazy_operation_result_t result;
 } lazy_operation_addlayer_res_t;
 
+/* Add layer on screen
+
+   ADD_LAYER on any screen, ADD_LAYER itself goes on screen 0. It does
+   not fit in a ring slot and is only sent on the socket, before the
+   connection switches to a ring. The result is an ADD_LAYER one.
+*/
+typedef struct
+{
+        lazy_operation_addlayer_t addlayer; /* ADD_LAYER_ON_SCREEN */
+
+        lazy_uint_t screen_id;
+} lazy_operation_addlayeronscreen_t;
+
 /* Del layer */
 typedef struct
 {
@@ -107,6 +132,78 @@ typedef struct
         lazy_uint_t buffer_id;
 } lazy_operation_addbuffer_res_t;
 
+/* New pitched buffer
+
+   Sub-allocated at offset inside <path_to_buffers>/h<hex heap id>,
+   offsets are page aligned. Deleted with LAZY_OPERATION_DEL_BUFFER.
+*/
+typedef struct
+{
+        lazy_operation_t operation;
+
+        lazy_uint_t width;
+        lazy_uint_t height;
+        lazy_uint_t bpp;
+        lazy_uint_t pitch; /* bytes per line, 0 for width * bpp */
+} lazy_operation_addpitchedbuffer_t;
+
+typedef struct
+{
+        lazy_operation_result_t result;
+
+        lazy_uint_t buffer_id;
+
+        lazy_uint_t heap_id;
+        lazy_uint_t offset;
+        lazy_uint_t pitch;
+} lazy_operation_addpitchedbuffer_res_t;
+
+/* New planar buffer
+
+   Video frames in their decoder layout, converted to RGB by the server
+   when composited. Planes follow each other in a single allocation,
+   like a pitched buffer; chroma planes are subsampled by 2 in both
+   directions and their pitch is half the luma one, rounded up.
+*/
+typedef enum
+{
+        LAZY_FORMAT_PACKED, /* bpp bytes per pixel, BGR(A) */
+        LAZY_FORMAT_I420,   /* Y, then U, then V */
+        LAZY_FORMAT_YV12,   /* Y, then V, then U */
+} lazy_format_t;
+
+#define LAZY_MAX_PLANES (3)
+
+typedef struct
+{
+        lazy_uint_t offset; /* from the start of the buffer */
+        lazy_uint_t pitch;
+} lazy_plane_t;
+
+typedef struct
+{
+        lazy_operation_t operation;
+
+        lazy_uint_t width;
+        lazy_uint_t height;
+        lazy_format_t format;
+        lazy_uint_t pitch; /* bytes per luma line, 0 for width */
+} lazy_operation_addplanarbuffer_t;
+
+typedef struct
+{
+        lazy_operation_result_t result;
+
+        lazy_uint_t buffer_id;
+
+        lazy_uint_t heap_id;
+        lazy_uint_t offset;
+        lazy_uint_t pitch;
+
+        /* Y, U and V, whatever their order in memory */
+        lazy_plane_t planes[LAZY_MAX_PLANES];
+} lazy_operation_addplanarbuffer_res_t;
+
 /* Delete buffer */
 typedef struct
 {
@@ -120,4 +217,235 @@ typedef struct
         lazy_operation_result_t result;
 } lazy_operation_delbuffer_res_t;
 
+/* Get statistics */
+typedef struct
+{
+        lazy_operation_t operation;
+} lazy_operation_getstats_t;
+
+typedef struct
+{
+        lazy_operation_result_t result;
+
+        lazy_uint_t nb_flips;
+        lazy_uint_t nb_uploads;
+        lazy_uint_t nb_redundant_uploads; /* flips never painted */
+        lazy_uint_t upload_kbytes;
+        lazy_uint_t nb_dedup_flips;       /* unchanged content, not uploaded */
+        lazy_uint_t dedup_kbytes;
+        lazy_uint_t nb_deferred_uploads;  /* held back a frame when overloaded */
+        lazy_uint_t quality_level;        /* 0 is full quality */
+        lazy_uint_t startup_listen_us;    /* from launch to port bound */
+        lazy_uint_t startup_frame_us;     /* from launch to first paint, 0 before */
+        lazy_uint_t nb_streamed_uploads;  /* through pixel buffers, see -p */
+} lazy_operation_getstats_res_t;
+
+/* Add ring */
+typedef struct
+{
+        lazy_operation_t operation;
+} lazy_operation_addring_t;
+
+typedef struct
+{
+        lazy_operation_result_t result;
+
+        lazy_uint_t ring_id;
+} lazy_operation_addring_res_t;
+
+/* Kick ring
+
+   A bare lazy_operation_t, without any payload nor result. Sent by
+   the client when it pushed commands while the server was waiting,
+   and by the server when it pushed completions while the client was
+   waiting.
+*/
+
+/* Layer transitions */
+typedef enum
+{
+        LAZY_EASING_LINEAR,
+        LAZY_EASING_EASE_IN,
+        LAZY_EASING_EASE_OUT,
+        LAZY_EASING_EASE_IN_OUT,
+} lazy_easing_t;
+
+/* Set layer geometry */
+typedef struct
+{
+        lazy_operation_t operation;
+
+        lazy_uint_t layer_id;
+
+        lazy_rectangle_t src;
+        lazy_rectangle_t dst;
+
+        /* Transition to dst in milliseconds, 0 to apply immediately */
+        lazy_uint_t duration;
+        lazy_easing_t easing;
+} lazy_operation_setlayergeometry_t;
+
+typedef struct
+{
+        lazy_operation_result_t result;
+} lazy_operation_setlayergeometry_res_t;
+
+/* Set layer opacity */
+typedef struct
+{
+        lazy_operation_t operation;
+
+        lazy_uint_t layer_id;
+
+        lazy_uint_t opacity; /* 0 - 255 */
+
+        /* Transition in milliseconds, 0 to apply immediately */
+        lazy_uint_t duration;
+        lazy_easing_t easing;
+} lazy_operation_setlayeropacity_t;
+
+typedef struct
+{
+        lazy_operation_result_t result;
+} lazy_operation_setlayeropacity_res_t;
+
+/* Set layer zorder, higher values are stacked on top */
+typedef struct
+{
+        lazy_operation_t operation;
+
+        lazy_uint_t layer_id;
+
+        lazy_uint_t zorder;
+} lazy_operation_setlayerzorder_t;
+
+typedef struct
+{
+        lazy_operation_result_t result;
+} lazy_operation_setlayerzorder_res_t;
+
+/* Command ring
+
+   Once a connection got a ring through LAZY_OPERATION_ADD_RING, the
+   client maps <path_to_buffers>/r<hex ring id> and may append
+   operation records to the command ring instead of writing them on
+   the socket. Results come back in order through the completion
+   ring. The socket is then only used for kicks: after publishing a
+   new head, the producer side sends a LAZY_OPERATION_KICK_RING if the
+   consumer side set its waiting flag.
+
+   Indexes are free running counters, a slot is index & (LAZY_RING_SIZE
+   - 1). The server never consumes a command without a free completion
+   slot, so a client must also kick after consuming completions if
+   commands are still pending and the server is waiting.
+*/
+#define LAZY_RING_SIZE (256)
+#define LAZY_RING_CACHELINE (64)
+
+typedef union
+{
+        lazy_operation_t operation;
+
+        lazy_operation_addlayer_t addlayer;
+        lazy_operation_dellayer_t dellayer;
+        lazy_operation_fliplayer_t fliplayer;
+        lazy_operation_addbuffer_t addbuffer;
+        lazy_operation_delbuffer_t delbuffer;
+        lazy_operation_setlayergeometry_t setlayergeometry;
+        lazy_operation_setlayeropacity_t setlayeropacity;
+        lazy_operation_setlayerzorder_t setlayerzorder;
+        lazy_operation_addpitchedbuffer_t addpitchedbuffer;
+        lazy_operation_getstats_t getstats;
+        lazy_operation_addplanarbuffer_t addplanarbuffer;
+} lazy_ring_command_t;
+
+typedef struct
+{
+        lazy_operation_t operation;
+
+        union
+        {
+                lazy_operation_result_t result;
+
+                lazy_operation_addlayer_res_t addlayer;
+                lazy_operation_dellayer_res_t dellayer;
+                lazy_operation_fliplayer_res_t fliplayer;
+                lazy_operation_addbuffer_res_t addbuffer;
+                lazy_operation_delbuffer_res_t delbuffer;
+                lazy_operation_setlayergeometry_res_t setlayergeometry;
+                lazy_operation_setlayeropacity_res_t setlayeropacity;
+                lazy_operation_setlayerzorder_res_t setlayerzorder;
+                lazy_operation_addpitchedbuffer_res_t addpitchedbuffer;
+                lazy_operation_getstats_res_t getstats;
+                lazy_operation_addplanarbuffer_res_t addplanarbuffer;
+        } res;
+} lazy_ring_completion_t;
+
+typedef struct
+{
+        /* Written by the producer */
+        volatile lazy_uint_t head;
+        lazy_char_t head_padding[LAZY_RING_CACHELINE - sizeof (lazy_uint_t)];
+
+        /* Written by the consumer */
+        volatile lazy_uint_t tail;
+        volatile lazy_uint_t waiting;
+        lazy_char_t tail_padding[LAZY_RING_CACHELINE - 2 * sizeof (lazy_uint_t)];
+} lazy_ring_index_t;
+
+typedef struct
+{
+        lazy_ring_index_t command_index;
+        lazy_ring_index_t completion_index;
+
+        lazy_ring_command_t commands[LAZY_RING_SIZE];
+        lazy_ring_completion_t completions[LAZY_RING_SIZE];
+} lazy_ring_t;
+
+/* Output stream
+
+   Composited screens sent to a viewer by LazyVisu --stream. Each frame
+   is a lazy_stream_frame_t followed by nb_tiles tiles, each one a
+   lazy_stream_tile_t followed by size bytes of encoded RGBA pixels,
+   top row first. Only tiles that changed since the previous frame of
+   the same screen are sent, all of them after a viewer connects.
+*/
+#define LAZY_STREAM_MAGIC (0x4c565346) /* "LVSF" */
+#define LAZY_STREAM_TILE_SIZE (64)
+
+typedef enum
+{
+        LAZY_STREAM_ENCODING_RAW,
+        LAZY_STREAM_ENCODING_RLE,  /* runs of (count - 1, RGBA pixel), 5 bytes each */
+        LAZY_STREAM_ENCODING_ZLIB, /* zlib stream of the raw pixels */
+} lazy_stream_encoding_t;
+
+typedef struct
+{
+        lazy_uint_t magic;
+
+        lazy_uint_t screen_id;
+        lazy_uint_t frame;
+
+        lazy_uint_t width;
+        lazy_uint_t height;
+
+        lazy_uint_t nb_tiles;
+} lazy_stream_frame_t;
+
+typedef struct
+{
+        /* Area of the screen */
+        lazy_uint_t x;
+        lazy_uint_t y;
+        lazy_uint_t w;
+        lazy_uint_t h;
+
+        /* Pixels are (w >> scale_shift) x (h >> scale_shift), rounded up */
+        lazy_uint_t scale_shift;
+
+        lazy_stream_encoding_t encoding;
+        lazy_uint_t size;
+} lazy_stream_tile_t;
+
 #endif /* __LAZY_PASSTHROUGH_INTERNAL_H__ */
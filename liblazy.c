@@ -0,0 +1,1051 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "liblazy.h"
+
+/**/
+#define LAZY_DEFAULT_BUFFER_PATH "/tmp/rootfs/tmp"
+
+#define LAZY_NO_HEAP ((lazy_uint_t) -1)
+
+/**/
+typedef struct
+{
+        lazy_operation_t        operation;
+        size_t                  result_size;
+        lazy_completion_func_t  func;
+        void                   *user_data;
+} lazy_pending_t;
+
+typedef struct _lazy_heap
+{
+        struct _lazy_heap *next;
+
+        lazy_uint_t  id;
+        void        *ptr;
+        size_t       size;
+} lazy_heap_t;
+
+typedef struct _lazy_buffer
+{
+        struct _lazy_buffer *next;
+
+        lazy_uint_t  id;
+        lazy_uint_t  pitch;
+
+        /* Either a slice of a heap... */
+        lazy_uint_t  heap_id;
+        lazy_uint_t  offset;
+
+        /* ...or its own file, mapped on first use */
+        void        *ptr;
+        size_t       size;
+} lazy_buffer_t;
+
+struct _lazy_connection
+{
+        int   fd;
+        char *path_to_buffers;
+
+        /* Requests waiting for their result, in submission order */
+        lazy_pending_t *pending;
+        unsigned int    pending_size;
+        unsigned int    pending_head;
+        unsigned int    nb_pending;
+
+        lazy_heap_t   *heaps;
+        lazy_buffer_t *buffers;
+
+        lazy_ring_t   *ring;
+        lazy_uint_t    ring_id;
+};
+
+/**/
+static int
+lazy_write_all (int fd, const void *data, size_t size)
+{
+        const char *ptr = data;
+
+        while (size > 0)
+        {
+                ssize_t ret = write (fd, ptr, size);
+
+                if (ret < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                ptr += ret;
+                size -= ret;
+        }
+
+        return 0;
+}
+
+static int
+lazy_read_all (int fd, void *data, size_t size)
+{
+        char *ptr = data;
+
+        while (size > 0)
+        {
+                ssize_t ret = read (fd, ptr, size);
+
+                if (ret < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                if (ret == 0)
+                        return -1;
+
+                ptr += ret;
+                size -= ret;
+        }
+
+        return 0;
+}
+
+static size_t
+lazy_result_size (lazy_operation_t operation)
+{
+        switch (operation)
+        {
+        case LAZY_OPERATION_ADD_LAYER:
+                return sizeof (lazy_operation_addlayer_res_t);
+        case LAZY_OPERATION_DEL_LAYER:
+                return sizeof (lazy_operation_dellayer_res_t);
+        case LAZY_OPERATION_FLIP_LAYER:
+                return sizeof (lazy_operation_fliplayer_res_t);
+        case LAZY_OPERATION_ADD_BUFFER:
+                return sizeof (lazy_operation_addbuffer_res_t);
+        case LAZY_OPERATION_DEL_BUFFER:
+                return sizeof (lazy_operation_delbuffer_res_t);
+        case LAZY_OPERATION_SET_LAYER_GEOMETRY:
+                return sizeof (lazy_operation_setlayergeometry_res_t);
+        case LAZY_OPERATION_SET_LAYER_OPACITY:
+                return sizeof (lazy_operation_setlayeropacity_res_t);
+        case LAZY_OPERATION_SET_LAYER_ZORDER:
+                return sizeof (lazy_operation_setlayerzorder_res_t);
+        case LAZY_OPERATION_ADD_PITCHED_BUFFER:
+                return sizeof (lazy_operation_addpitchedbuffer_res_t);
+        case LAZY_OPERATION_GET_STATS:
+                return sizeof (lazy_operation_getstats_res_t);
+        case LAZY_OPERATION_ADD_PLANAR_BUFFER:
+                return sizeof (lazy_operation_addplanarbuffer_res_t);
+        default:
+                return 0;
+        }
+}
+
+static void *
+lazy_map_file (const char *filename, size_t *size)
+{
+        struct stat st;
+        void *ptr;
+        int fd;
+
+        fd = open (filename, O_RDWR);
+        if (fd < 0)
+                return NULL;
+
+        if (fstat (fd, &st) < 0 || st.st_size <= 0)
+        {
+                close (fd);
+                return NULL;
+        }
+
+        ptr = mmap (NULL, st.st_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+        close (fd);
+
+        if (ptr == MAP_FAILED)
+                return NULL;
+
+        *size = st.st_size;
+
+        return ptr;
+}
+
+/**/
+static lazy_buffer_t *
+lazy_find_buffer (lazy_connection_t *connection, lazy_uint_t id,
+                  lazy_buffer_t ***prev)
+{
+        lazy_buffer_t **item;
+
+        for (item = &connection->buffers; *item != NULL; item = &(*item)->next)
+        {
+                if ((*item)->id == id)
+                {
+                        if (prev)
+                                *prev = item;
+                        return *item;
+                }
+        }
+
+        return NULL;
+}
+
+static lazy_buffer_t *
+lazy_add_buffer_info (lazy_connection_t *connection, lazy_uint_t id,
+                      lazy_uint_t pitch,
+                      lazy_uint_t heap_id, lazy_uint_t offset)
+{
+        lazy_buffer_t *buffer;
+
+        buffer = calloc (1, sizeof (lazy_buffer_t));
+        if (buffer == NULL)
+                return NULL;
+
+        buffer->id = id;
+        buffer->pitch = pitch;
+        buffer->heap_id = heap_id;
+        buffer->offset = offset;
+
+        buffer->next = connection->buffers;
+        connection->buffers = buffer;
+
+        return buffer;
+}
+
+static void
+lazy_forget_buffer (lazy_connection_t *connection, lazy_uint_t id)
+{
+        lazy_buffer_t *buffer, **prev;
+
+        buffer = lazy_find_buffer (connection, id, &prev);
+        if (buffer == NULL)
+                return;
+
+        *prev = buffer->next;
+
+        if (buffer->ptr)
+                munmap (buffer->ptr, buffer->size);
+
+        free (buffer);
+}
+
+static lazy_heap_t *
+lazy_get_heap (lazy_connection_t *connection, lazy_uint_t id)
+{
+        lazy_heap_t *heap;
+        char *filename;
+
+        for (heap = connection->heaps; heap != NULL; heap = heap->next)
+                if (heap->id == id)
+                        return heap;
+
+        heap = calloc (1, sizeof (lazy_heap_t));
+        if (heap == NULL)
+                return NULL;
+
+        filename = malloc (strlen (connection->path_to_buffers) +
+                           LAZY_FILENAME_MAX_LENGHT + 2);
+        if (filename == NULL)
+        {
+                free (heap);
+                return NULL;
+        }
+
+        sprintf (filename, "%s/h%x", connection->path_to_buffers, id);
+        heap->ptr = lazy_map_file (filename, &heap->size);
+        free (filename);
+
+        if (heap->ptr == NULL)
+        {
+                free (heap);
+                return NULL;
+        }
+
+        heap->id = id;
+        heap->next = connection->heaps;
+        connection->heaps = heap;
+
+        return heap;
+}
+
+/**/
+lazy_connection_t *
+lazy_connect (const char *host, int port, const char *path_to_buffers)
+{
+        lazy_connection_t *connection;
+        struct addrinfo hints, *addresses, *address;
+        char service[16];
+        int one = 1;
+
+        if (host == NULL)
+                host = LAZY_PASSTHROUGH_HOST;
+        if (port <= 0)
+                port = LAZY_PASSTHROUGH_PORT;
+        if (path_to_buffers == NULL)
+                path_to_buffers = LAZY_DEFAULT_BUFFER_PATH;
+
+        connection = calloc (1, sizeof (lazy_connection_t));
+        if (connection == NULL)
+                return NULL;
+
+        connection->fd = -1;
+        connection->path_to_buffers = strdup (path_to_buffers);
+        if (connection->path_to_buffers == NULL)
+                goto error;
+
+        memset (&hints, 0, sizeof (hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        snprintf (service, sizeof (service), "%i", port);
+        if (getaddrinfo (host, service, &hints, &addresses) != 0)
+                goto error;
+
+        for (address = addresses; address != NULL; address = address->ai_next)
+        {
+                connection->fd = socket (address->ai_family,
+                                         address->ai_socktype,
+                                         address->ai_protocol);
+                if (connection->fd < 0)
+                        continue;
+
+                if (connect (connection->fd,
+                             address->ai_addr, address->ai_addrlen) == 0)
+                        break;
+
+                close (connection->fd);
+                connection->fd = -1;
+        }
+        freeaddrinfo (addresses);
+
+        if (connection->fd < 0)
+                goto error;
+
+        /* Requests are small and pipelined, don't let Nagle hold them. */
+        setsockopt (connection->fd, IPPROTO_TCP, TCP_NODELAY,
+                    &one, sizeof (one));
+
+        return connection;
+
+error:
+        lazy_disconnect (connection);
+
+        return NULL;
+}
+
+void
+lazy_disconnect (lazy_connection_t *connection)
+{
+        if (connection == NULL)
+                return;
+
+        while (connection->buffers)
+                lazy_forget_buffer (connection, connection->buffers->id);
+
+        while (connection->heaps)
+        {
+                lazy_heap_t *heap = connection->heaps;
+
+                connection->heaps = heap->next;
+                munmap (heap->ptr, heap->size);
+                free (heap);
+        }
+
+        if (connection->ring)
+                munmap (connection->ring, sizeof (lazy_ring_t));
+
+        if (connection->fd >= 0)
+                close (connection->fd);
+
+        free (connection->pending);
+        free (connection->path_to_buffers);
+        free (connection);
+}
+
+int
+lazy_get_fd (lazy_connection_t *connection)
+{
+        return connection->fd;
+}
+
+unsigned int
+lazy_get_pending (lazy_connection_t *connection)
+{
+        return connection->nb_pending;
+}
+
+/**/
+static int
+lazy_push_pending (lazy_connection_t *connection,
+                   lazy_operation_t operation,
+                   lazy_completion_func_t func, void *user_data)
+{
+        lazy_pending_t *pending;
+
+        if (connection->nb_pending == connection->pending_size)
+        {
+                unsigned int i, size = connection->pending_size ?
+                        2 * connection->pending_size : 64;
+
+                pending = malloc (size * sizeof (lazy_pending_t));
+                if (pending == NULL)
+                        return -1;
+
+                for (i = 0; i < connection->nb_pending; i++)
+                        pending[i] = connection->pending[(connection->pending_head + i) %
+                                                         connection->pending_size];
+
+                free (connection->pending);
+                connection->pending = pending;
+                connection->pending_size = size;
+                connection->pending_head = 0;
+        }
+
+        pending = &connection->pending[(connection->pending_head +
+                                        connection->nb_pending) %
+                                       connection->pending_size];
+        pending->operation = operation;
+        pending->result_size = lazy_result_size (operation);
+        pending->func = func;
+        pending->user_data = user_data;
+
+        connection->nb_pending++;
+
+        return 0;
+}
+
+/* Keeps track of where buffers live before handing results out. */
+static void
+lazy_complete (lazy_connection_t *connection, const void *result)
+{
+        lazy_pending_t pending;
+
+        pending = connection->pending[connection->pending_head];
+        connection->pending_head = (connection->pending_head + 1) %
+                connection->pending_size;
+        connection->nb_pending--;
+
+        if (pending.operation == LAZY_OPERATION_ADD_PITCHED_BUFFER)
+        {
+                const lazy_operation_addpitchedbuffer_res_t *res = result;
+
+                if (res->result == LAZY_OPERATION_RESULT_SUCCESS)
+                        lazy_add_buffer_info (connection, res->buffer_id,
+                                              res->pitch,
+                                              res->heap_id, res->offset);
+        }
+        else if (pending.operation == LAZY_OPERATION_ADD_PLANAR_BUFFER)
+        {
+                const lazy_operation_addplanarbuffer_res_t *res = result;
+
+                if (res->result == LAZY_OPERATION_RESULT_SUCCESS)
+                        lazy_add_buffer_info (connection, res->buffer_id,
+                                              res->pitch,
+                                              res->heap_id, res->offset);
+        }
+
+        if (pending.func)
+                pending.func (connection, pending.operation, result,
+                              pending.user_data);
+}
+
+static int
+lazy_kick (lazy_connection_t *connection)
+{
+        lazy_operation_t kick = LAZY_OPERATION_KICK_RING;
+
+        return lazy_write_all (connection->fd, &kick, sizeof (kick));
+}
+
+/* Makes sure the server is not sleeping on commands we pushed. */
+static int
+lazy_ring_wake_server (lazy_connection_t *connection)
+{
+        lazy_ring_t *ring = connection->ring;
+
+        __sync_synchronize ();
+        if (ring->command_index.head != ring->command_index.tail &&
+            ring->command_index.waiting)
+                return lazy_kick (connection);
+
+        return 0;
+}
+
+static int
+lazy_dispatch_ring (lazy_connection_t *connection, int block)
+{
+        lazy_ring_t *ring = connection->ring;
+        int dispatched = 0;
+
+        while (1)
+        {
+                lazy_uint_t head, tail = ring->completion_index.tail;
+
+                __sync_synchronize ();
+                head = ring->completion_index.head;
+                __sync_synchronize ();
+
+                while (tail != head)
+                {
+                        lazy_ring_completion_t completion;
+
+                        memcpy (&completion,
+                                &ring->completions[tail & (LAZY_RING_SIZE - 1)],
+                                sizeof (completion));
+                        __sync_synchronize ();
+                        ring->completion_index.tail = ++tail;
+
+                        if (connection->nb_pending > 0)
+                                lazy_complete (connection, &completion.res);
+                        dispatched++;
+                }
+
+                /* The server may have stalled on a full completion ring. */
+                if (lazy_ring_wake_server (connection) < 0)
+                        return -1;
+
+                if (dispatched > 0 || !block || connection->nb_pending == 0)
+                        return dispatched;
+
+                ring->completion_index.waiting = 1;
+                __sync_synchronize ();
+
+                if (ring->completion_index.head == tail)
+                {
+                        lazy_operation_t kick;
+
+                        if (lazy_read_all (connection->fd, &kick, sizeof (kick)) < 0)
+                        {
+                                ring->completion_index.waiting = 0;
+                                return -1;
+                        }
+                }
+
+                ring->completion_index.waiting = 0;
+        }
+}
+
+int
+lazy_dispatch (lazy_connection_t *connection, int block)
+{
+        int dispatched = 0;
+
+        if (connection->ring)
+                return lazy_dispatch_ring (connection, block);
+
+        while (connection->nb_pending > 0)
+        {
+                lazy_pending_t *pending;
+                lazy_ring_completion_t completion;
+
+                if (!block || dispatched > 0)
+                {
+                        struct pollfd pfd = { connection->fd, POLLIN, 0 };
+
+                        if (poll (&pfd, 1, 0) <= 0)
+                                break;
+                }
+
+                pending = &connection->pending[connection->pending_head];
+                if (lazy_read_all (connection->fd, &completion.res,
+                                   pending->result_size) < 0)
+                        return -1;
+
+                lazy_complete (connection, &completion.res);
+                dispatched++;
+        }
+
+        return dispatched;
+}
+
+int
+lazy_flush (lazy_connection_t *connection)
+{
+        while (connection->nb_pending > 0)
+                if (lazy_dispatch (connection, 1) < 0)
+                        return -1;
+
+        return 0;
+}
+
+int
+lazy_submit (lazy_connection_t *connection,
+             const void *operation, size_t size,
+             lazy_completion_func_t func, void *user_data)
+{
+        lazy_operation_t op;
+
+        if (size < sizeof (lazy_operation_t) ||
+            size > sizeof (lazy_ring_command_t))
+                return -1;
+
+        op = *(const lazy_operation_t *) operation;
+        if (lazy_result_size (op) == 0)
+                return -1;
+
+        if (connection->ring)
+        {
+                lazy_ring_t *ring = connection->ring;
+                lazy_uint_t head = ring->command_index.head;
+
+                while (head - ring->command_index.tail >= LAZY_RING_SIZE)
+                        if (lazy_dispatch (connection, 1) < 0)
+                                return -1;
+
+                memcpy (&ring->commands[head & (LAZY_RING_SIZE - 1)],
+                        operation, size);
+                if (lazy_push_pending (connection, op, func, user_data) < 0)
+                        return -1;
+
+                __sync_synchronize ();
+                ring->command_index.head = head + 1;
+
+                return lazy_ring_wake_server (connection);
+        }
+
+        if (lazy_push_pending (connection, op, func, user_data) < 0)
+                return -1;
+
+        return lazy_write_all (connection->fd, operation, size);
+}
+
+/**/
+typedef struct
+{
+        void   *result;
+        size_t  size;
+        int     done;
+} lazy_sync_t;
+
+static void
+lazy_sync_completion (lazy_connection_t *connection,
+                      lazy_operation_t operation,
+                      const void *result,
+                      void *user_data)
+{
+        lazy_sync_t *sync = user_data;
+
+        memcpy (sync->result, result, sync->size);
+        sync->done = 1;
+}
+
+static int
+lazy_call (lazy_connection_t *connection,
+           const void *operation, size_t size,
+           void *result, size_t result_size)
+{
+        lazy_sync_t sync = { result, result_size, 0 };
+
+        if (lazy_submit (connection, operation, size,
+                         lazy_sync_completion, &sync) < 0)
+                return -1;
+
+        while (!sync.done)
+                if (lazy_dispatch (connection, 1) < 0)
+                        return -1;
+
+        return (*(lazy_operation_result_t *) result ==
+                LAZY_OPERATION_RESULT_SUCCESS) ? 0 : -1;
+}
+
+int
+lazy_use_ring (lazy_connection_t *connection)
+{
+        lazy_operation_t operation = LAZY_OPERATION_ADD_RING;
+        lazy_operation_addring_res_t res_operation;
+        char *filename;
+        size_t size;
+
+        if (connection->ring)
+                return 0;
+
+        /* Results of socket requests must not mix with the ring's. */
+        if (lazy_flush (connection) < 0)
+                return -1;
+
+        if (lazy_write_all (connection->fd, &operation, sizeof (operation)) < 0 ||
+            lazy_read_all (connection->fd, &res_operation, sizeof (res_operation)) < 0 ||
+            res_operation.result != LAZY_OPERATION_RESULT_SUCCESS)
+                return -1;
+
+        filename = malloc (strlen (connection->path_to_buffers) +
+                           LAZY_FILENAME_MAX_LENGHT + 2);
+        if (filename == NULL)
+                return -1;
+
+        sprintf (filename, "%s/r%x",
+                 connection->path_to_buffers, res_operation.ring_id);
+        connection->ring = lazy_map_file (filename, &size);
+        free (filename);
+
+        if (connection->ring == NULL)
+                return -1;
+
+        if (size < sizeof (lazy_ring_t))
+        {
+                munmap (connection->ring, size);
+                connection->ring = NULL;
+                return -1;
+        }
+
+        connection->ring_id = res_operation.ring_id;
+
+        return 0;
+}
+
+/**/
+int
+lazy_add_buffer (lazy_connection_t *connection,
+                 lazy_uint_t width, lazy_uint_t height, lazy_uint_t bpp,
+                 lazy_uint_t *buffer_id)
+{
+        lazy_operation_addbuffer_t operation;
+        lazy_operation_addbuffer_res_t res_operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_ADD_BUFFER;
+        operation.width = width;
+        operation.height = height;
+        operation.bpp = bpp;
+
+        if (lazy_call (connection, &operation, sizeof (operation),
+                       &res_operation, sizeof (res_operation)) < 0)
+                return -1;
+
+        /* A previous buffer may have been evicted with that id. */
+        lazy_forget_buffer (connection, res_operation.buffer_id);
+        lazy_add_buffer_info (connection, res_operation.buffer_id,
+                              width * bpp, LAZY_NO_HEAP, 0);
+
+        if (buffer_id)
+                *buffer_id = res_operation.buffer_id;
+
+        return 0;
+}
+
+int
+lazy_add_pitched_buffer (lazy_connection_t *connection,
+                         lazy_uint_t width, lazy_uint_t height,
+                         lazy_uint_t bpp, lazy_uint_t pitch,
+                         lazy_uint_t *buffer_id)
+{
+        lazy_operation_addpitchedbuffer_t operation;
+        lazy_operation_addpitchedbuffer_res_t res_operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_ADD_PITCHED_BUFFER;
+        operation.width = width;
+        operation.height = height;
+        operation.bpp = bpp;
+        operation.pitch = pitch;
+
+        if (lazy_call (connection, &operation, sizeof (operation),
+                       &res_operation, sizeof (res_operation)) < 0)
+                return -1;
+
+        if (buffer_id)
+                *buffer_id = res_operation.buffer_id;
+
+        return 0;
+}
+
+int
+lazy_add_planar_buffer (lazy_connection_t *connection,
+                        lazy_uint_t width, lazy_uint_t height,
+                        lazy_format_t format, lazy_uint_t pitch,
+                        lazy_uint_t *buffer_id,
+                        lazy_plane_t planes[LAZY_MAX_PLANES])
+{
+        lazy_operation_addplanarbuffer_t operation;
+        lazy_operation_addplanarbuffer_res_t res_operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_ADD_PLANAR_BUFFER;
+        operation.width = width;
+        operation.height = height;
+        operation.format = format;
+        operation.pitch = pitch;
+
+        if (lazy_call (connection, &operation, sizeof (operation),
+                       &res_operation, sizeof (res_operation)) < 0)
+                return -1;
+
+        if (buffer_id)
+                *buffer_id = res_operation.buffer_id;
+        if (planes)
+                memcpy (planes, res_operation.planes,
+                        sizeof (res_operation.planes));
+
+        return 0;
+}
+
+int
+lazy_del_buffer (lazy_connection_t *connection, lazy_uint_t buffer_id)
+{
+        lazy_operation_delbuffer_t operation;
+        lazy_operation_delbuffer_res_t res_operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_DEL_BUFFER;
+        operation.buffer_id = buffer_id;
+
+        lazy_forget_buffer (connection, buffer_id);
+
+        return lazy_call (connection, &operation, sizeof (operation),
+                          &res_operation, sizeof (res_operation));
+}
+
+void *
+lazy_buffer_map (lazy_connection_t *connection,
+                 lazy_uint_t buffer_id,
+                 lazy_uint_t *pitch)
+{
+        lazy_buffer_t *buffer;
+        char *filename;
+
+        buffer = lazy_find_buffer (connection, buffer_id, NULL);
+        if (buffer == NULL)
+        {
+                /* Created elsewhere, assume its own file. */
+                buffer = lazy_add_buffer_info (connection, buffer_id,
+                                               0, LAZY_NO_HEAP, 0);
+                if (buffer == NULL)
+                        return NULL;
+        }
+
+        if (pitch)
+                *pitch = buffer->pitch;
+
+        if (buffer->heap_id != LAZY_NO_HEAP)
+        {
+                lazy_heap_t *heap = lazy_get_heap (connection, buffer->heap_id);
+
+                if (heap == NULL)
+                        return NULL;
+
+                return (char *) heap->ptr + buffer->offset;
+        }
+
+        if (buffer->ptr)
+                return buffer->ptr;
+
+        filename = malloc (strlen (connection->path_to_buffers) +
+                           LAZY_FILENAME_MAX_LENGHT + 2);
+        if (filename == NULL)
+                return NULL;
+
+        sprintf (filename, "%s/%x", connection->path_to_buffers, buffer_id);
+        buffer->ptr = lazy_map_file (filename, &buffer->size);
+        free (filename);
+
+        return buffer->ptr;
+}
+
+/**/
+static void
+lazy_init_addlayer (lazy_operation_addlayer_t *operation,
+                    lazy_operation_t op,
+                    lazy_uint_t layer_id,
+                    lazy_uint_t width, lazy_uint_t height,
+                    const lazy_rectangle_t *src,
+                    const lazy_rectangle_t *dst,
+                    lazy_uint_t buffer_id)
+{
+        memset (operation, 0, sizeof (*operation));
+        operation->operation = op;
+        operation->layer_id = layer_id;
+        operation->width = width;
+        operation->height = height;
+        operation->src = *src;
+        operation->dst = *dst;
+        operation->buffer_id = buffer_id;
+}
+
+int
+lazy_add_layer (lazy_connection_t *connection,
+                lazy_uint_t layer_id,
+                lazy_uint_t width, lazy_uint_t height,
+                const lazy_rectangle_t *src,
+                const lazy_rectangle_t *dst,
+                lazy_uint_t buffer_id)
+{
+        lazy_operation_addlayer_t operation;
+        lazy_operation_addlayer_res_t res_operation;
+
+        lazy_init_addlayer (&operation, LAZY_OPERATION_ADD_LAYER, layer_id,
+                            width, height, src, dst, buffer_id);
+
+        return lazy_call (connection, &operation, sizeof (operation),
+                          &res_operation, sizeof (res_operation));
+}
+
+int
+lazy_add_layer_on_screen (lazy_connection_t *connection,
+                          lazy_uint_t screen_id,
+                          lazy_uint_t layer_id,
+                          lazy_uint_t width, lazy_uint_t height,
+                          const lazy_rectangle_t *src,
+                          const lazy_rectangle_t *dst,
+                          lazy_uint_t buffer_id)
+{
+        lazy_operation_addlayeronscreen_t operation;
+        lazy_operation_addlayer_res_t res_operation;
+
+        if (screen_id == 0)
+                return lazy_add_layer (connection, layer_id, width, height,
+                                       src, dst, buffer_id);
+
+        /* Too big for a ring slot, it has to go on the socket. */
+        if (connection->ring)
+                return -1;
+
+        /* Results of pipelined requests must not mix with this one. */
+        if (lazy_flush (connection) < 0)
+                return -1;
+
+        lazy_init_addlayer (&operation.addlayer,
+                            LAZY_OPERATION_ADD_LAYER_ON_SCREEN, layer_id,
+                            width, height, src, dst, buffer_id);
+        operation.screen_id = screen_id;
+
+        if (lazy_write_all (connection->fd, &operation, sizeof (operation)) < 0 ||
+            lazy_read_all (connection->fd, &res_operation, sizeof (res_operation)) < 0)
+                return -1;
+
+        return (res_operation.result == LAZY_OPERATION_RESULT_SUCCESS) ? 0 : -1;
+}
+
+int
+lazy_del_layer (lazy_connection_t *connection, lazy_uint_t layer_id)
+{
+        lazy_operation_dellayer_t operation;
+        lazy_operation_dellayer_res_t res_operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_DEL_LAYER;
+        operation.layer_id = layer_id;
+
+        return lazy_call (connection, &operation, sizeof (operation),
+                          &res_operation, sizeof (res_operation));
+}
+
+int
+lazy_flip_layer (lazy_connection_t *connection,
+                 lazy_uint_t layer_id, lazy_uint_t buffer_id)
+{
+        lazy_operation_fliplayer_t operation;
+        lazy_operation_fliplayer_res_t res_operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_FLIP_LAYER;
+        operation.layer_id = layer_id;
+        operation.buffer_id = buffer_id;
+
+        return lazy_call (connection, &operation, sizeof (operation),
+                          &res_operation, sizeof (res_operation));
+}
+
+int
+lazy_flip_layer_async (lazy_connection_t *connection,
+                       lazy_uint_t layer_id, lazy_uint_t buffer_id,
+                       lazy_completion_func_t func, void *user_data)
+{
+        lazy_operation_fliplayer_t operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_FLIP_LAYER;
+        operation.layer_id = layer_id;
+        operation.buffer_id = buffer_id;
+
+        return lazy_submit (connection, &operation, sizeof (operation),
+                            func, user_data);
+}
+
+int
+lazy_set_layer_geometry (lazy_connection_t *connection,
+                         lazy_uint_t layer_id,
+                         const lazy_rectangle_t *src,
+                         const lazy_rectangle_t *dst,
+                         lazy_uint_t duration, lazy_easing_t easing)
+{
+        lazy_operation_setlayergeometry_t operation;
+        lazy_operation_setlayergeometry_res_t res_operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_SET_LAYER_GEOMETRY;
+        operation.layer_id = layer_id;
+        operation.src = *src;
+        operation.dst = *dst;
+        operation.duration = duration;
+        operation.easing = easing;
+
+        return lazy_call (connection, &operation, sizeof (operation),
+                          &res_operation, sizeof (res_operation));
+}
+
+int
+lazy_set_layer_opacity (lazy_connection_t *connection,
+                        lazy_uint_t layer_id, lazy_uint_t opacity,
+                        lazy_uint_t duration, lazy_easing_t easing)
+{
+        lazy_operation_setlayeropacity_t operation;
+        lazy_operation_setlayeropacity_res_t res_operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_SET_LAYER_OPACITY;
+        operation.layer_id = layer_id;
+        operation.opacity = opacity;
+        operation.duration = duration;
+        operation.easing = easing;
+
+        return lazy_call (connection, &operation, sizeof (operation),
+                          &res_operation, sizeof (res_operation));
+}
+
+int
+lazy_set_layer_zorder (lazy_connection_t *connection,
+                       lazy_uint_t layer_id, lazy_uint_t zorder)
+{
+        lazy_operation_setlayerzorder_t operation;
+        lazy_operation_setlayerzorder_res_t res_operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_SET_LAYER_ZORDER;
+        operation.layer_id = layer_id;
+        operation.zorder = zorder;
+
+        return lazy_call (connection, &operation, sizeof (operation),
+                          &res_operation, sizeof (res_operation));
+}
+
+/**/
+int
+lazy_get_stats (lazy_connection_t *connection,
+                lazy_operation_getstats_res_t *stats)
+{
+        lazy_operation_getstats_t operation;
+
+        memset (&operation, 0, sizeof (operation));
+        operation.operation = LAZY_OPERATION_GET_STATS;
+
+        return lazy_call (connection, &operation, sizeof (operation),
+                          stats, sizeof (*stats));
+}
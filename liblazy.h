@@ -0,0 +1,122 @@
+#ifndef __LIBLAZY_H__
+#define __LIBLAZY_H__
+
+#include <stddef.h>
+
+#if !defined(__LONG_TYPE_32__) && !defined(__LONG_TYPE_64)
+# if defined(__SIZEOF_LONG__) && (__SIZEOF_LONG__ == 4)
+#  define __LONG_TYPE_32__
+# else
+#  define __LONG_TYPE_64
+# endif
+#endif
+#include "lazy_passthrough_internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Client side of the LazyVisu protocol.
+
+  A connection stays open for its whole life and requests are
+  pipelined: the asynchronous calls return as soon as the request is
+  sent, results are handed to the completion callback from
+  lazy_dispatch() in submission order. Synchronous calls simply wait
+  for their own result, dispatching the ones queued before.
+
+  All calls return 0 on success and -1 on failure.
+*/
+
+typedef struct _lazy_connection lazy_connection_t;
+
+/* result points to the lazy_operation_*_res_t matching operation. */
+typedef void (*lazy_completion_func_t) (lazy_connection_t *connection,
+                                        lazy_operation_t operation,
+                                        const void *result,
+                                        void *user_data);
+
+lazy_connection_t *lazy_connect (const char *host, int port,
+                                 const char *path_to_buffers);
+void lazy_disconnect (lazy_connection_t *connection);
+
+int lazy_get_fd (lazy_connection_t *connection);
+
+/* Sends subsequent requests through a shared-memory command ring. */
+int lazy_use_ring (lazy_connection_t *connection);
+
+/* Completions */
+int lazy_dispatch (lazy_connection_t *connection, int block);
+int lazy_flush (lazy_connection_t *connection);
+unsigned int lazy_get_pending (lazy_connection_t *connection);
+
+/* Generic submission, operation starts with its lazy_operation_t */
+int lazy_submit (lazy_connection_t *connection,
+                 const void *operation, size_t size,
+                 lazy_completion_func_t func, void *user_data);
+
+/* Buffers */
+int lazy_add_buffer (lazy_connection_t *connection,
+                     lazy_uint_t width, lazy_uint_t height, lazy_uint_t bpp,
+                     lazy_uint_t *buffer_id);
+int lazy_add_pitched_buffer (lazy_connection_t *connection,
+                             lazy_uint_t width, lazy_uint_t height,
+                             lazy_uint_t bpp, lazy_uint_t pitch,
+                             lazy_uint_t *buffer_id);
+/* Video frame, planes gets where Y, U and V lie in the mapping. */
+int lazy_add_planar_buffer (lazy_connection_t *connection,
+                            lazy_uint_t width, lazy_uint_t height,
+                            lazy_format_t format, lazy_uint_t pitch,
+                            lazy_uint_t *buffer_id,
+                            lazy_plane_t planes[LAZY_MAX_PLANES]);
+int lazy_del_buffer (lazy_connection_t *connection, lazy_uint_t buffer_id);
+
+/* Cached mapping of a buffer, valid until the buffer is deleted. */
+void *lazy_buffer_map (lazy_connection_t *connection,
+                       lazy_uint_t buffer_id,
+                       lazy_uint_t *pitch);
+
+/* Layers */
+int lazy_add_layer (lazy_connection_t *connection,
+                    lazy_uint_t layer_id,
+                    lazy_uint_t width, lazy_uint_t height,
+                    const lazy_rectangle_t *src,
+                    const lazy_rectangle_t *dst,
+                    lazy_uint_t buffer_id);
+/*
+  Layer ids are shared by all screens, adding moves an existing layer.
+  Screens other than 0 cannot be reached once lazy_use_ring() is on.
+*/
+int lazy_add_layer_on_screen (lazy_connection_t *connection,
+                              lazy_uint_t screen_id,
+                              lazy_uint_t layer_id,
+                              lazy_uint_t width, lazy_uint_t height,
+                              const lazy_rectangle_t *src,
+                              const lazy_rectangle_t *dst,
+                              lazy_uint_t buffer_id);
+int lazy_del_layer (lazy_connection_t *connection, lazy_uint_t layer_id);
+int lazy_flip_layer (lazy_connection_t *connection,
+                     lazy_uint_t layer_id, lazy_uint_t buffer_id);
+int lazy_flip_layer_async (lazy_connection_t *connection,
+                           lazy_uint_t layer_id, lazy_uint_t buffer_id,
+                           lazy_completion_func_t func, void *user_data);
+int lazy_set_layer_geometry (lazy_connection_t *connection,
+                             lazy_uint_t layer_id,
+                             const lazy_rectangle_t *src,
+                             const lazy_rectangle_t *dst,
+                             lazy_uint_t duration, lazy_easing_t easing);
+int lazy_set_layer_opacity (lazy_connection_t *connection,
+                            lazy_uint_t layer_id, lazy_uint_t opacity,
+                            lazy_uint_t duration, lazy_easing_t easing);
+int lazy_set_layer_zorder (lazy_connection_t *connection,
+                           lazy_uint_t layer_id, lazy_uint_t zorder);
+
+/* Server */
+int lazy_get_stats (lazy_connection_t *connection,
+                    lazy_operation_getstats_res_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBLAZY_H__ */